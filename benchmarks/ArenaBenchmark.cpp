@@ -0,0 +1,94 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step time of a large hierarchy with its buffers on the heap and packed into an arena (Hierarchy::setArenaMode).
+// Also reports the memory of the process backed by transparent huge pages, where the system exposes it
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+using namespace ogmaneo;
+
+// Anonymous memory backed by huge pages (kB), -1 if unknown
+static long long getAnonHugePages() {
+    std::ifstream smaps("/proc/self/smaps_rollup");
+
+    const std::string key = "AnonHugePages:";
+
+    std::string line;
+
+    while (std::getline(smaps, line)) {
+        if (line.compare(0, key.length(), key) == 0)
+            return std::stoll(line.substr(key.length()));
+    }
+
+    return -1;
+}
+
+int main() {
+    const Int3 inputSize(32, 32, 16);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(3);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++) {
+        layerDescs[l].hiddenSize = Int3(32, 32, 32);
+
+        layerDescs[l].ffRadius = layerDescs[l].pRadius = 3;
+    }
+
+    IntBuffer inputCs(inputSize.x * inputSize.y);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs };
+
+    double times[2];
+
+    for (int arenaMode = 0; arenaMode < 2; arenaMode++) {
+        ComputeSystem cs;
+
+        cs.rng.seed(1);
+
+        Hierarchy h;
+
+        h.initRandom(cs, { inputSize }, { InputType::prediction }, layerDescs);
+
+        h.setArenaMode(arenaMode);
+
+        int t = 0;
+
+        auto step = [&]() {
+            for (std::size_t i = 0; i < inputCs.size(); i++)
+                inputCs[i] = (t * 3 + i / 5) % inputSize.z;
+
+            h.step(cs, inputs, true);
+
+            t++;
+        };
+
+        // Warm up
+        for (int i = 0; i < 10; i++)
+            step();
+
+        times[arenaMode] = timeRuns(step, 10);
+
+        printf("%s: %.3f ms per step, huge pages %lld kB", arenaMode ? "arena" : "heap", times[arenaMode] * 1e3, getAnonHugePages());
+
+        if (arenaMode)
+            printf(", arena %.1f MB", h.getArena()->getCapacity() / (1024.0 * 1024.0));
+
+        printf("\n");
+    }
+
+    printf("arena speedup %.2fx\n", times[0] / times[1]);
+
+    return 0;
+}
\ No newline at end of file
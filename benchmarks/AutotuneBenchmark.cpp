@@ -0,0 +1,90 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step time of a hierarchy with the default batch size of 2D kernels, and with batch sizes and schedules
+// autotuned per call site (ComputeSystem::setAutotune). Timed after tuning has locked in every call site
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+
+using namespace ogmaneo;
+
+int main() {
+    const Int3 inputSize(32, 32, 16);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(3);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++)
+        layerDescs[l].hiddenSize = Int3(32, 32, 16);
+
+    IntBuffer inputCs(inputSize.x * inputSize.y);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs };
+
+    double times[2];
+
+    for (int tuned = 0; tuned < 2; tuned++) {
+        ComputeSystem cs;
+
+        cs.rng.seed(1);
+
+        if (tuned)
+            cs.setAutotune();
+
+        Hierarchy h;
+
+        h.initRandom(cs, { inputSize }, { InputType::prediction }, layerDescs);
+
+        int t = 0;
+
+        auto step = [&]() {
+            for (std::size_t i = 0; i < inputCs.size(); i++)
+                inputCs[i] = (t + i) % inputSize.z;
+
+            h.step(cs, inputs, true);
+
+            t++;
+        };
+
+        // Warm up, until every call site is tuned
+        for (int i = 0; i < 1000; i++) {
+            step();
+
+            if (tuned) {
+                std::vector<KernelTuning> tunings = cs.getKernelTunings();
+
+                bool locked = true;
+
+                for (std::size_t j = 0; j < tunings.size(); j++)
+                    locked = locked && tunings[j].locked;
+
+                if (locked && i >= 100)
+                    break;
+            }
+            else if (i >= 100)
+                break;
+        }
+
+        times[tuned] = timeRuns(step, 50);
+
+        if (tuned) {
+            std::vector<KernelTuning> tunings = cs.getKernelTunings();
+
+            for (std::size_t j = 0; j < tunings.size(); j++)
+                printf("%-24s scope %d size %dx%d: batch %dx%d schedule %d%s\n", tunings[j].name.c_str(), tunings[j].scope, tunings[j].size.x, tunings[j].size.y,
+                    tunings[j].batchSize.x, tunings[j].batchSize.y, tunings[j].schedule, tunings[j].locked ? "" : " (not locked)");
+        }
+    }
+
+    printf("step: default %.3f ms, autotuned %.3f ms (%.2fx)\n", times[0] * 1e3, times[1] * 1e3, times[0] / times[1]);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,86 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step time and last level cache read misses of a hierarchy of 64x64 layers with the batches of 2D kernels traversed in row order
+// and in Z-order (ComputeSystem::batchOrder2), for several batch sizes. Only the traversal changes, the layout of the buffers is the same.
+// Misses are counted with perf_event_open where the system allows it
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+
+using namespace ogmaneo;
+
+int main() {
+    const Int3 inputSize(64, 64, 16);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(2);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++) {
+        layerDescs[l].hiddenSize = Int3(64, 64, 16);
+
+        layerDescs[l].ffRadius = layerDescs[l].pRadius = 3;
+    }
+
+    IntBuffer inputCs(inputSize.x * inputSize.y);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs };
+
+    int counter = openMissCounter(lastLevelCacheMisses);
+
+    if (counter < 0)
+        printf("cache miss counter unavailable\n");
+
+    const Int2 batchSizes[] = { Int2(1, 1), Int2(2, 2), Int2(4, 4) };
+
+    for (std::size_t s = 0; s < sizeof(batchSizes) / sizeof(Int2); s++) {
+        double times[2];
+        double misses[2];
+
+        for (int order = 0; order < 2; order++) {
+            ComputeSystem cs;
+
+            cs.rng.seed(1);
+
+            cs.batchSize2 = batchSizes[s];
+            cs.batchOrder2 = static_cast<BatchOrder>(order);
+
+            Hierarchy h;
+
+            h.initRandom(cs, { inputSize }, { InputType::prediction }, layerDescs);
+
+            int t = 0;
+
+            auto step = [&]() {
+                for (std::size_t i = 0; i < inputCs.size(); i++)
+                    inputCs[i] = (t * 3 + i / 7) % inputSize.z;
+
+                h.step(cs, inputs, true);
+
+                t++;
+            };
+
+            // Warm up
+            for (int i = 0; i < 20; i++)
+                step();
+
+            misses[order] = countMisses(counter, step, 20);
+
+            times[order] = timeRuns(step, 20);
+        }
+
+        printf("batch %dx%d: row order %.3f ms, Z-order %.3f ms (%.2fx), cache misses per step: row order %.0f, Z-order %.0f\n", batchSizes[s].x, batchSizes[s].y,
+            times[rowOrder] * 1e3, times[mortonOrder] * 1e3, times[rowOrder] / times[mortonOrder], misses[rowOrder], misses[mortonOrder]);
+    }
+
+    closeMissCounter(counter);
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,120 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace ogmaneo {
+// Seconds per call of func, the fastest of several repetitions of runs calls (filters out noise from other processes)
+template <typename F>
+double timeRuns(
+    const F &func, // Function to time
+    int runs, // Calls per repetition
+    int repetitions = 5 // Repetitions
+) {
+    double best = 0.0;
+
+    for (int r = 0; r < repetitions; r++) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < runs; i++)
+            func();
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / runs;
+
+        best = r == 0 ? seconds : std::min(best, seconds);
+    }
+
+    return best;
+}
+
+// Caches whose read misses can be counted
+enum MissCounter {
+    dataTLBMisses,
+    lastLevelCacheMisses
+};
+
+// Hardware counter of read misses of a cache by this process (user space only), opened with perf_event_open.
+// -1 if the system doesn't allow it
+inline int openMissCounter(
+    MissCounter cache // Cache to count
+) {
+#ifdef __linux__
+    perf_event_attr attr;
+
+    std::memset(&attr, 0, sizeof(perf_event_attr));
+
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(perf_event_attr);
+    attr.config = (cache == dataTLBMisses ? PERF_COUNT_HW_CACHE_DTLB : PERF_COUNT_HW_CACHE_LL) |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1; // Include threads created later (OpenMP workers)
+
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    (void)cache;
+
+    return -1;
+#endif
+}
+
+// Misses per call of func counted by a counter of openMissCounter over runs calls, -1 if the counter is unavailable
+template <typename F>
+double countMisses(
+    int counter, // Counter from openMissCounter
+    const F &func, // Function to count
+    int runs // Calls
+) {
+    long long misses = -1;
+
+#ifdef __linux__
+    if (counter >= 0) {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+
+        for (int i = 0; i < runs; i++)
+            func();
+
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (read(counter, &misses, sizeof(long long)) != sizeof(long long))
+            misses = -1;
+    }
+#else
+    (void)counter;
+    (void)func;
+#endif
+
+    return misses >= 0 ? static_cast<double>(misses) / runs : -1.0;
+}
+
+// Release a counter of openMissCounter
+inline void closeMissCounter(
+    int counter // Counter from openMissCounter, may be -1
+) {
+#ifdef __linux__
+    if (counter >= 0)
+        close(counter);
+#else
+    (void)counter;
+#endif
+}
+} // namespace ogmaneo
\ No newline at end of file
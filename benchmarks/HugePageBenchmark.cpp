@@ -0,0 +1,116 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step time and data TLB misses of a large hierarchy with its buffers advised to use transparent huge pages and advised not to
+// (setHugePageAdvice). Also reports the memory of the process backed by huge pages. TLB misses are counted with perf_event_open
+// where the system allows it. Usage: HugePageBenchmark [hidden columns per side, default 48]
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+using namespace ogmaneo;
+
+// Value of a kB field of a /proc file of this process, -1 if unknown
+static long long readProcKB(
+    const char* path, // e.g. /proc/self/status
+    const std::string &key // Field name including the colon
+) {
+    std::ifstream file(path);
+
+    std::string line;
+
+    while (std::getline(file, line)) {
+        if (line.compare(0, key.length(), key) == 0)
+            return std::stoll(line.substr(key.length()));
+    }
+
+    return -1;
+}
+
+int main(
+    int argc,
+    char* argv[]
+) {
+    int columns = argc > 1 ? std::atoi(argv[1]) : 48;
+
+    const Int3 inputSize(columns, columns, 16);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(2);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++) {
+        layerDescs[l].hiddenSize = Int3(columns, columns, 32);
+
+        layerDescs[l].ffRadius = layerDescs[l].pRadius = 3;
+    }
+
+    IntBuffer inputCs(inputSize.x * inputSize.y);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs };
+
+    int counter = openMissCounter(dataTLBMisses);
+
+    if (counter < 0)
+        printf("dTLB miss counter unavailable\n");
+
+    double times[2];
+
+    // Without the advice first, so huge pages of the other run aren't still mapped
+    for (int advise = 0; advise < 2; advise++) {
+        setHugePageAdvice(advise);
+
+        long long hugePagesBefore = readProcKB("/proc/self/smaps_rollup", "AnonHugePages:");
+        long long residentBefore = readProcKB("/proc/self/status", "VmRSS:");
+
+        ComputeSystem cs;
+
+        cs.rng.seed(1);
+
+        Hierarchy h;
+
+        h.initRandom(cs, { inputSize }, { InputType::prediction }, layerDescs);
+
+        int t = 0;
+
+        auto step = [&]() {
+            for (std::size_t i = 0; i < inputCs.size(); i++)
+                inputCs[i] = (t * 3 + i / 5) % inputSize.z;
+
+            h.step(cs, inputs, true);
+
+            t++;
+        };
+
+        // Warm up
+        for (int i = 0; i < 2; i++)
+            step();
+
+        const int runs = 3;
+
+        double misses = countMisses(counter, step, runs);
+
+        times[advise] = timeRuns(step, runs, 3);
+
+        printf("%s: hierarchy %.1f MB, %.3f ms per step, dTLB misses %.0f per step, huge pages %.1f MB\n", advise ? "huge pages" : "no huge pages",
+            (readProcKB("/proc/self/status", "VmRSS:") - residentBefore) / 1024.0, times[advise] * 1e3, misses,
+            (readProcKB("/proc/self/smaps_rollup", "AnonHugePages:") - hugePagesBefore) / 1024.0);
+    }
+
+    printf("huge page speedup %.2fx\n", times[0] / times[1]);
+
+    setHugePageAdvice(true);
+
+    closeMissCounter(counter);
+
+    return 0;
+}
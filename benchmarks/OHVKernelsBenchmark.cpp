@@ -0,0 +1,92 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Compares the OHV kernels specialized for one-hot sizes 8, 16, 32 and 64 with the runtime-stride (generic) kernels,
+// which run for all other sizes. Each specialized size is measured next to its neighbour one larger:
+// the kernels visit one weight per column of a receptive field whatever the one-hot size, so the work is the same.
+// Single threaded, times are nanoseconds per visited weight
+
+#include "Benchmark.h"
+
+#include <ogmaneo/ComputeSystem.h>
+
+#include <cstdio>
+
+using namespace ogmaneo;
+
+int main() {
+    const Int2 size(32, 32);
+    const int radius = 2;
+
+    const int oneHotSizes[] = { 8, 9, 16, 17, 32, 33, 64, 65 };
+
+    ComputeSystem cs;
+
+    printf("%-12s %-12s %14s %14s %20s %11s\n", "oneHotSize", "kernel", "multiplyOHVs", "multiplyOHVsT", "multiplyOHVsColumn", "deltaOHVs");
+
+    for (int oneHotSize : oneHotSizes) {
+        Int3 inSize(size.x, size.y, oneHotSize);
+        Int3 outSize(size.x, size.y, oneHotSize);
+
+        SparseMatrix mat;
+
+        initSMLocalRF(inSize, outSize, radius, mat, true);
+        initSMUniform(cs, mat, -0.01f, 0.0f, cs.rng);
+
+        mat.requireT();
+
+        IntBuffer inputCs(size.x * size.y);
+        IntBuffer outputCs(size.x * size.y);
+
+        for (std::size_t i = 0; i < inputCs.size(); i++) {
+            inputCs[i] = cs.rng() % oneHotSize;
+            outputCs[i] = cs.rng() % oneHotSize;
+        }
+
+        // Weights visited by a pass of each kernel over the whole matrix
+        double visited = 0.0;
+
+        for (int x = 0; x < size.x; x++)
+            for (int y = 0; y < size.y; y++)
+                visited += mat.countFields(Int2(x, y)) * oneHotSize;
+
+        float sink = 0.0f;
+
+        std::vector<float> sums(oneHotSize);
+
+        double multiplyTime = timeRuns([&]() {
+            for (int row = 0; row < mat.rows; row++)
+                sink += mat.multiplyOHVs(inputCs, row, oneHotSize);
+        }, 10);
+
+        double multiplyTTime = timeRuns([&]() {
+            for (int column = 0; column < mat.columns; column++)
+                sink += mat.multiplyOHVsT(outputCs, column, oneHotSize);
+        }, 10);
+
+        double columnTime = timeRuns([&]() {
+            for (int outColumn = 0; outColumn < size.x * size.y; outColumn++)
+                mat.multiplyOHVsColumn(inputCs, outColumn, oneHotSize, sums.data());
+        }, 10);
+
+        double deltaTime = timeRuns([&]() {
+            for (int row = 0; row < mat.rows; row++)
+                mat.deltaOHVs(inputCs, 0.0001f, row, oneHotSize);
+        }, 10);
+
+        bool specialized = oneHotSize == 8 || oneHotSize == 16 || oneHotSize == 32 || oneHotSize == 64;
+
+        printf("%-12d %-12s %14.3f %14.3f %20.3f %11.3f\n", oneHotSize, specialized ? "specialized" : "generic",
+            multiplyTime * 1e9 / visited, multiplyTTime * 1e9 / visited, columnTime * 1e9 / visited, deltaTime * 1e9 / visited);
+
+        if (sink == 12345.0f)
+            printf("\n");
+    }
+
+    return 0;
+}
\ No newline at end of file
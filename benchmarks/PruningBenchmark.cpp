@@ -0,0 +1,98 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Step time (inference and learning), serialized size and prediction agreement of a trained hierarchy pruned to keep the
+// largest weights of each visible column (Hierarchy::prune), against the unpruned hierarchy. Pruned matrices keep the
+// column-blocked layout with a mask of the kept cells per group, so they only load the remaining weights, but each group costs
+// a mask lookup, so they step faster once most weights are removed
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+#include <sstream>
+
+using namespace ogmaneo;
+
+int main() {
+    const Int3 inputSize(32, 32, 16);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(2);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++)
+        layerDescs[l].hiddenSize = Int3(32, 32, 16);
+
+    ComputeSystem cs;
+
+    cs.rng.seed(1);
+
+    Hierarchy reference;
+
+    reference.initRandom(cs, { inputSize }, { InputType::prediction }, layerDescs);
+
+    // Moving diagonal bands
+    std::vector<std::vector<IntBuffer>> inputStream(100, std::vector<IntBuffer>(1, IntBuffer(inputSize.x * inputSize.y)));
+
+    for (std::size_t t = 0; t < inputStream.size(); t++)
+        for (int x = 0; x < inputSize.x; x++)
+            for (int y = 0; y < inputSize.y; y++)
+                inputStream[t][0][address2(Int2(x, y), Int2(inputSize.x, inputSize.y))] = ((x + y + t) / 4) % inputSize.z;
+
+    // Train
+    for (int i = 0; i < 500; i++)
+        reference.step(cs, { &inputStream[i % inputStream.size()][0] }, true);
+
+    // 0 is the unpruned hierarchy
+    const int keepPerGroups[] = { 0, 8, 4, 2, 1 };
+
+    double baseTimes[2] = { 0.0, 0.0 };
+
+    for (std::size_t k = 0; k < sizeof(keepPerGroups) / sizeof(int); k++) {
+        Hierarchy h = reference;
+
+        if (keepPerGroups[k] > 0)
+            h.prune(0.0f, keepPerGroups[k]);
+
+        std::ostringstream os;
+
+        h.writeToStream(os);
+
+        float agreement = getPredictionAgreement(cs, reference, h, inputStream);
+
+        double times[2];
+
+        for (int learn = 0; learn < 2; learn++) {
+            Hierarchy stepped = h;
+
+            int t = 0;
+
+            auto step = [&]() {
+                stepped.step(cs, { &inputStream[t % inputStream.size()][0] }, learn);
+
+                t++;
+            };
+
+            times[learn] = timeRuns(step, 20);
+        }
+
+        if (k == 0) {
+            baseTimes[0] = times[0];
+            baseTimes[1] = times[1];
+
+            printf("unpruned:    ");
+        }
+        else
+            printf("keep %d/%-2d:  ", keepPerGroups[k], inputSize.z);
+
+        printf("inference %.3f ms (%.2fx), learning %.3f ms (%.2fx), size %.1f MB, agreement %.4f\n",
+            times[0] * 1e3, baseTimes[0] / times[0], times[1] * 1e3, baseTimes[1] / times[1], os.str().size() / (1024.0 * 1024.0), agreement);
+    }
+
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,93 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Inference step time, serialized size and prediction agreement of a trained hierarchy (a prediction and an action input)
+// quantized to int8 (Hierarchy::quantize), against the fp32 hierarchy
+
+#include "Benchmark.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+#include <sstream>
+
+using namespace ogmaneo;
+
+int main() {
+    const Int3 inputSize(32, 32, 16);
+    const Int3 actionSize(4, 4, 8);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(3);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++)
+        layerDescs[l].hiddenSize = Int3(32, 32, 16);
+
+    ComputeSystem cs;
+
+    cs.rng.seed(1);
+
+    Hierarchy reference;
+
+    reference.initRandom(cs, { inputSize, actionSize }, { InputType::prediction, InputType::action }, layerDescs);
+
+    // Moving diagonal bands, and actions that follow them
+    std::vector<std::vector<IntBuffer>> inputStream(100, { IntBuffer(inputSize.x * inputSize.y), IntBuffer(actionSize.x * actionSize.y) });
+
+    for (std::size_t t = 0; t < inputStream.size(); t++) {
+        for (int x = 0; x < inputSize.x; x++)
+            for (int y = 0; y < inputSize.y; y++)
+                inputStream[t][0][address2(Int2(x, y), Int2(inputSize.x, inputSize.y))] = ((x + y + t) / 4) % inputSize.z;
+
+        for (std::size_t i = 0; i < inputStream[t][1].size(); i++)
+            inputStream[t][1][i] = (t / 4 + i) % actionSize.z;
+    }
+
+    // Train, rewarding the actions of the stream
+    for (int i = 0; i < 500; i++) {
+        const std::vector<IntBuffer> &inputs = inputStream[i % inputStream.size()];
+
+        float reward = reference.getPredictionCs(1) == inputs[1] ? 1.0f : 0.0f;
+
+        reference.step(cs, { &inputs[0], &inputs[1] }, true, reward);
+    }
+
+    Hierarchy quantized = reference;
+
+    quantized.quantize();
+
+    float agreement = getPredictionAgreement(cs, reference, quantized, inputStream);
+
+    const Hierarchy* hierarchies[] = { &reference, &quantized };
+
+    double times[2];
+
+    for (int q = 0; q < 2; q++) {
+        std::ostringstream os;
+
+        hierarchies[q]->writeToStream(os);
+
+        Hierarchy stepped = *hierarchies[q];
+
+        int t = 0;
+
+        auto step = [&]() {
+            const std::vector<IntBuffer> &inputs = inputStream[t % inputStream.size()];
+
+            stepped.step(cs, { &inputs[0], &inputs[1] }, false);
+
+            t++;
+        };
+
+        times[q] = timeRuns(step, 20);
+
+        printf("%s inference %.3f ms (%.2fx), size %.2f MB, agreement %.4f\n", q == 0 ? "fp32:" : "int8:", times[q] * 1e3, times[0] / times[q],
+            os.str().size() / (1024.0 * 1024.0), q == 0 ? 1.0f : agreement);
+    }
+
+    return 0;
+}
@@ -8,19 +8,40 @@
 
 #include "Actor.h"
 
+#include <algorithm>
+#include <cstring>
+
 using namespace ogmaneo;
 
+void Actor::initScales() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    hiddenScales.resize(numHiddenColumns);
+
+    // From the geometry, so pruning doesn't change the normalization
+    for (int x = 0; x < hiddenSize.x; x++)
+        for (int y = 0; y < hiddenSize.y; y++) {
+            int count = 0;
+
+            for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+                count += visibleLayers[vli].valueWeights.countFields(Int2(x, y));
+
+            hiddenScales[address2(Int2(x, y), Int2(hiddenSize.x, hiddenSize.y))] = 1.0f / std::max(1, count);
+        }
+}
+
 void Actor::forward(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &rng,
     const std::vector<const IntBuffer*> &inputCs
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
     // --- Value ---
 
+    float scale = hiddenScales[hiddenColumnIndex];
+
     float value = 0.0f;
-    int count = 0;
 
     // For each visible layer
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -28,35 +49,28 @@ void Actor::forward(
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
         value += vl.valueWeights.multiplyOHVs(*inputCs[vli], hiddenColumnIndex, vld.size.z);
-        count += vl.valueWeights.count(hiddenColumnIndex) / vld.size.z;
     }
 
-    hiddenValues[hiddenColumnIndex] = value / std::max(1, count);
+    hiddenValues[hiddenColumnIndex] = value * scale;
 
     // --- Action ---
 
-    std::vector<float> activations(hiddenSize.z);
-    float maxActivation = -999999.0f;
+    float* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    std::fill(activations, activations + hiddenSize.z, 0.0f);
 
-        float sum = 0.0f;
-
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
-
-            sum += vl.actionWeights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z);
-        }
+    // All visible layers accumulate straight into the (normalized) activations
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        sum /= std::max(1, count);
+        vl.actionWeights.multiplyOHVsColumn(*inputCs[vli], hiddenColumnIndex, vld.size.z, activations, scale);
+    }
 
-        activations[hc] = sum;
+    float maxActivation = -999999.0f;
 
-        maxActivation = std::max(maxActivation, sum);
-    }
+    for (int hc = 0; hc < hiddenSize.z; hc++)
+        maxActivation = std::max(maxActivation, activations[hc]);
 
     float total = 0.0f;
 
@@ -88,8 +102,8 @@ void Actor::forward(
 
 void Actor::learn(
     const Int2 &pos,
-    std::mt19937 &rng,
-    const std::vector<const IntBuffer*> &inputCsPrev,
+    PhiloxRNG &/* rng */,
+    const std::vector<IntBuffer> &inputCsPrev,
     const IntBuffer* hiddenCsPrev,
     float q,
     float g
@@ -100,19 +114,19 @@ void Actor::learn(
 
     float newValue = q + g * hiddenValues[hiddenColumnIndex];
 
+    float scale = hiddenScales[hiddenColumnIndex];
+
     float value = 0.0f;
-    int count = 0;
 
     // For each visible layer
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
         VisibleLayer &vl = visibleLayers[vli];
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        value += vl.valueWeights.multiplyOHVs(*inputCsPrev[vli], hiddenColumnIndex, vld.size.z);
-        count += vl.valueWeights.count(hiddenColumnIndex) / vld.size.z;
+        value += vl.valueWeights.multiplyOHVs(inputCsPrev[vli], hiddenColumnIndex, vld.size.z);
     }
 
-    value /= std::max(1, count);
+    value *= scale;
 
     float tdErrorValue = newValue - value;
 
@@ -123,35 +137,28 @@ void Actor::learn(
         VisibleLayer &vl = visibleLayers[vli];
         const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        vl.valueWeights.deltaOHVs(*inputCsPrev[vli], deltaValue, hiddenColumnIndex, vld.size.z);
+        vl.valueWeights.deltaOHVs(inputCsPrev[vli], deltaValue, hiddenColumnIndex, vld.size.z);
     }
 
     // --- Action ---
 
     int targetC = (*hiddenCsPrev)[address2(pos, Int2(hiddenSize.x, hiddenSize.y))];
 
-    std::vector<float> activations(hiddenSize.z);
-    float maxActivation = -999999.0f;
+    float* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
-
-        float sum = 0.0f;
-
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    std::fill(activations, activations + hiddenSize.z, 0.0f);
 
-            sum += vl.actionWeights.multiplyOHVs(*inputCsPrev[vli], hiddenIndex, vld.size.z);
-        }
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        sum /= std::max(1, count);
+        vl.actionWeights.multiplyOHVsColumn(inputCsPrev[vli], hiddenColumnIndex, vld.size.z, activations, scale);
+    }
 
-        activations[hc] = sum;
+    float maxActivation = -999999.0f;
 
-        maxActivation = std::max(maxActivation, sum);
-    }
+    for (int hc = 0; hc < hiddenSize.z; hc++)
+        maxActivation = std::max(maxActivation, activations[hc]);
 
     float total = 0.0f;
 
@@ -161,18 +168,16 @@ void Actor::learn(
         total += activations[hc];
     }
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
-
-        float deltaAction = (tdErrorValue > 0.0f ? beta : -beta) * ((hc == targetC ? 1.0f : 0.0f) - activations[hc] / std::max(0.0001f, total));
+    // Activations become action deltas
+    for (int hc = 0; hc < hiddenSize.z; hc++)
+        activations[hc] = (tdErrorValue > 0.0f ? beta : -beta) * ((hc == targetC ? 1.0f : 0.0f) - activations[hc] / std::max(0.0001f, total));
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    // For each visible layer
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            vl.actionWeights.deltaOHVs(*inputCsPrev[vli], deltaAction, hiddenIndex, vld.size.z);
-        }
+        vl.actionWeights.deltaOHVsColumn(inputCsPrev[vli], activations, hiddenColumnIndex, vld.size.z);
     }
 }
 
@@ -180,7 +185,8 @@ void Actor::initRandom(
     ComputeSystem &cs,
     const Int3 &hiddenSize,
     int historyCapacity,
-    const std::vector<VisibleLayerDesc> &visibleLayerDescs
+    const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+    ValueType valueType
 ) {
     this->visibleLayerDescs = visibleLayerDescs;
 
@@ -192,7 +198,6 @@ void Actor::initRandom(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    std::uniform_real_distribution<float> weightDist(-0.001f, 0.001f);
 
     // Create layers
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -204,19 +209,23 @@ void Actor::initRandom(
 
         // Create weight matrix for this visible layer and initialize randomly
         initSMLocalRF(vld.size, Int3(hiddenSize.x, hiddenSize.y, 1), vld.radius, vl.valueWeights);
-        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.actionWeights);
+        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.actionWeights, true);
 
-        for (int i = 0; i < vl.valueWeights.nonZeroValues.size(); i++)
-            vl.valueWeights.nonZeroValues[i] = 0.0f;
+        // Value weights start at zero (initSMLocalRF)
+        initSMUniform(cs, vl.actionWeights, -0.001f, 0.001f, cs.rng);
 
-        for (int i = 0; i < vl.actionWeights.nonZeroValues.size(); i++)
-            vl.actionWeights.nonZeroValues[i] = weightDist(cs.rng);
+        vl.valueWeights.setValueType(initValueType(valueType));
+        vl.actionWeights.setValueType(initValueType(valueType));
     }
 
     hiddenCs = IntBuffer(numHiddenColumns, 0);
 
     hiddenValues = FloatBuffer(numHiddenColumns, 0.0f);
 
+    hiddenActivations = FloatBuffer(numHidden);
+
+    initScales();
+
     // Create (pre-allocated) history samples
     historySize = 0;
     historySamples.resize(historyCapacity);
@@ -236,6 +245,8 @@ void Actor::initRandom(
 
         historySamples[i]->hiddenCsPrev = IntBuffer(numHiddenColumns);
     }
+
+    placeWeights(cs);
 }
 
 const Actor &Actor::operator=(
@@ -247,6 +258,10 @@ const Actor &Actor::operator=(
 
     hiddenValues = other.hiddenValues;
 
+    hiddenActivations = other.hiddenActivations;
+
+    hiddenScales = other.hiddenScales;
+
     visibleLayerDescs = other.visibleLayerDescs;
     visibleLayers = other.visibleLayers;
 
@@ -270,18 +285,24 @@ const Actor &Actor::operator=(
     return *this;
 }
 
+template <typename R>
 void Actor::step(
     ComputeSystem &cs,
     const std::vector<const IntBuffer*> &inputCs,
     const IntBuffer* hiddenCsPrev,
     float reward,
-    bool learnEnabled
+    bool learnEnabled,
+    R &rng
 ) {
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     // Forward kernel
-    runKernel2(cs, std::bind(Actor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { forward(pos, rng, inputCs); }, Int2(hiddenSize.x, hiddenSize.y), rng, cs.batchSize2, "Actor::forward");
+
+    // Quantized actors keep no history
+    if (historySamples.empty())
+        return;
 
     // Add sample
     if (historySize == historySamples.size()) {
@@ -308,11 +329,11 @@ void Actor::step(
             int numVisibleColumns = vld.size.x * vld.size.y;
 
             // Copy visible Cs
-            runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[vli], &s.inputCs[vli]), numVisibleColumns, cs.rng, cs.batchSize1);
+            std::memcpy(s.inputCs[vli].data(), inputCs[vli]->data(), numVisibleColumns * sizeof(int));
         }
 
         // Copy hidden Cs
-        runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, hiddenCsPrev, &s.hiddenCsPrev), numHiddenColumns, cs.rng, cs.batchSize1);
+        std::memcpy(s.hiddenCsPrev.data(), hiddenCsPrev->data(), numHiddenColumns * sizeof(int));
 
         s.reward = reward;
     }
@@ -321,8 +342,13 @@ void Actor::step(
     if (learnEnabled && historySize > minSteps) {
         std::uniform_int_distribution<int> historyDist(1, historySize - minSteps);
 
+        bool stochasticRounding = false;
+
+        for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+            stochasticRounding |= visibleLayers[vli].valueWeights.roundsStochastically() || visibleLayers[vli].actionWeights.roundsStochastically();
+
         for (int it = 0; it < historyIters; it++) {
-            int historyIndex = historyDist(cs.rng);
+            int historyIndex = historyDist(rng);
 
             const HistorySample &sPrev = *historySamples[historyIndex - 1];
             const HistorySample &s = *historySamples[historyIndex];
@@ -338,11 +364,53 @@ void Actor::step(
             }
 
             // Learn kernel
-            runKernel2(cs, std::bind(Actor::learnKernel, std::placeholders::_1, std::placeholders::_2, this, constGet(sPrev.inputCs), &s.hiddenCsPrev, q, g), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+            runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { learn(pos, rng, sPrev.inputCs, &s.hiddenCsPrev, q, g); }, Int2(hiddenSize.x, hiddenSize.y), rng, cs.batchSize2, "Actor::learn",
+                stochasticRounding);
         }
     }
 }
 
+template void Actor::step<std::mt19937>(ComputeSystem &cs, const std::vector<const IntBuffer*> &inputCs, const IntBuffer* hiddenCsPrev, float reward, bool learnEnabled, std::mt19937 &rng);
+template void Actor::step<PhiloxRNG>(ComputeSystem &cs, const std::vector<const IntBuffer*> &inputCs, const IntBuffer* hiddenCsPrev, float reward, bool learnEnabled, PhiloxRNG &rng);
+
+void Actor::quantize() {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        vl.valueWeights.setValueType(int8);
+        vl.actionWeights.setValueType(int8);
+    }
+
+    // History is only used for learning
+    historySize = 0;
+    historySamples.clear();
+    historySamples.shrink_to_fit();
+}
+
+void Actor::prune(
+    float threshold,
+    int keepPerGroup
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        vl.valueWeights.prune(threshold, vld.size.z, keepPerGroup);
+        vl.actionWeights.prune(threshold, vld.size.z, keepPerGroup);
+    }
+}
+
+void Actor::placeWeights(
+    ComputeSystem &cs
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        placeSMColumns(cs, vl.valueWeights, Int2(hiddenSize.x, hiddenSize.y));
+        placeSMColumns(cs, vl.actionWeights, Int2(hiddenSize.x, hiddenSize.y));
+    }
+}
+
 void Actor::writeToStream(
     std::ostream &os
 ) const {
@@ -414,7 +482,9 @@ void Actor::readFromStream(
 
     readBufferFromStream(is, &hiddenValues);
 
-    int numVisibleLayers;
+    hiddenActivations = FloatBuffer(numHidden);
+
+    int numVisibleLayers = 0;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
 
@@ -434,9 +504,11 @@ void Actor::readFromStream(
         readSMFromStream(is, vl.actionWeights);
     }
 
+    initScales();
+
     is.read(reinterpret_cast<char*>(&historySize), sizeof(int));
 
-    int numHistorySamples;
+    int numHistorySamples = 0;
 
     is.read(reinterpret_cast<char*>(&numHistorySamples), sizeof(int));
 
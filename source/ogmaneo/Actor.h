@@ -52,50 +52,38 @@ private:
 
     FloatBuffer hiddenValues; // Hidden value function output buffer
 
+    // Kernel scratch, a slice of hiddenSize.z per hidden column, allocated once so that steps don't allocate
+    FloatBuffer hiddenActivations;
+
+    // Normalization multiplier of each hidden column (1 / input columns in the receptive fields of all visible layers).
+    // Derived from the geometry at init and load time
+    FloatBuffer hiddenScales;
+
     std::vector<std::shared_ptr<HistorySample>> historySamples; // History buffer, fixed length
 
     // Visible layers and descriptors
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
 
+    void initScales();
+
     // --- Kernels ---
 
     void forward(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const std::vector<const IntBuffer*> &inputCs
     );
 
     void learn(
         const Int2 &pos,
-        std::mt19937 &rng,
-        const std::vector<const IntBuffer*> &inputCsPrev,
+        PhiloxRNG &rng,
+        const std::vector<IntBuffer> &inputCsPrev,
         const IntBuffer* hiddenCsPrev,
         float q,
         float g
     );
 
-    static void forwardKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        Actor* a,
-        const std::vector<const IntBuffer*> &inputCs
-    ) {
-        a->forward(pos, rng, inputCs);
-    }
-
-    static void learnKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        Actor* a,
-        const std::vector<const IntBuffer*> &inputCsPrev,
-        const IntBuffer* hiddenCsPrev,
-        float q,
-        float g
-    ) {
-        a->learn(pos, rng, inputCsPrev, hiddenCsPrev, q, g);
-    }
-
 public:
     float alpha; // Value learning rate
     float beta; // Action learning rate
@@ -129,7 +117,8 @@ public:
         ComputeSystem &cs,
         const Int3 &hiddenSize,
         int historyCapacity,
-        const std::vector<VisibleLayerDesc> &visibleLayerDescs
+        const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+        ValueType valueType = float32 // Storage type of the weights, not int8 (see quantize)
     );
 
     // Step (get actions and update)
@@ -139,8 +128,59 @@ public:
         const IntBuffer* hiddenCsPrev,
         float reward,
         bool learnEnabled
+    ) {
+        step(cs, inputCs, hiddenCsPrev, reward, learnEnabled, cs.rng);
+    }
+
+    // Step drawing launch keys and history samples from rng instead of cs.rng, e.g. the generator of a task (see runTasks)
+    template <typename R>
+    void step(
+        ComputeSystem &cs,
+        const std::vector<const IntBuffer*> &inputCs,
+        const IntBuffer* hiddenCsPrev,
+        float reward,
+        bool learnEnabled,
+        R &rng // Generator
+    );
+
+    // Convert the weights to int8 and drop learning-only data, the layer can only be used for inference afterwards
+    void quantize();
+
+    // Remove small weights (see SparseMatrix::prune), one-hot groups are the cells of a visible column. The layer can still learn afterwards
+    void prune(
+        float threshold, // Smallest weight magnitude to keep
+        int keepPerGroup // Weights to keep per visible column, 0 to keep all above threshold
+    );
+
+    // Move the weights to the NUMA nodes whose threads run their hidden columns (see ComputeSystem::setNUMA).
+    // Done by initRandom, call after reading, copying or pruning a layer
+    void placeWeights(
+        ComputeSystem &cs // Compute system
     );
 
+    // Call func on each buffer of layer state and weights, in the order a step uses them
+    template <typename F>
+    void visitBuffers(
+        const F &func // Called with each buffer
+    ) {
+        for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+            visibleLayers[vli].valueWeights.visitBuffers(func);
+            visibleLayers[vli].actionWeights.visitBuffers(func);
+        }
+
+        func(hiddenScales);
+        func(hiddenActivations);
+        func(hiddenValues);
+        func(hiddenCs);
+
+        for (std::size_t t = 0; t < historySamples.size(); t++) {
+            for (std::size_t vli = 0; vli < historySamples[t]->inputCs.size(); vli++)
+                func(historySamples[t]->inputCs[vli]);
+
+            func(historySamples[t]->hiddenCsPrev);
+        }
+    }
+
     // Write to stream
     void writeToStream(
         std::ostream &os // Stream to write to
@@ -170,6 +210,27 @@ public:
         return visibleLayerDescs[i];
     }
 
+    // Receptive field of a hidden column in a visible layer, clamped to the visible layer (inclusive bounds)
+    void getFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &hiddenPos, // Position of hidden column
+        Int2 &lowerBound, // Lower bound of the field
+        Int2 &upperBound // Upper bound of the field
+    ) const {
+        visibleLayers[vli].valueWeights.getFieldBounds(hiddenPos, lowerBound, upperBound);
+    }
+
+    // Range of hidden columns whose receptive fields in a visible layer contain a visible column
+    // (inclusive bounds, lower > upper if there are none)
+    void getReverseFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &visiblePos, // Position of visible column
+        Int2 &lowerBound, // Lower bound of the range
+        Int2 &upperBound // Upper bound of the range
+    ) const {
+        visibleLayers[vli].valueWeights.getReverseFieldBounds(visiblePos, lowerBound, upperBound);
+    }
+
     // Get hidden state/output/actions
     const IntBuffer &getHiddenCs() const {
         return hiddenCs;
@@ -0,0 +1,102 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "Arena.h"
+
+#include <cstdlib>
+#include <atomic>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+using namespace ogmaneo;
+
+// Blocks of at least this size are aligned to it and advised to use transparent huge pages
+static const std::size_t hugePageSize = 2 * 1024 * 1024;
+
+static std::atomic<long long> numAlignedAllocations(0);
+
+static std::atomic<bool> hugePageAdvice(true);
+
+void ogmaneo::setHugePageAdvice(
+    bool enabled
+) {
+    hugePageAdvice.store(enabled, std::memory_order_relaxed);
+}
+
+void* ogmaneo::allocateAligned(
+    std::size_t bytes
+) {
+    if (bytes == 0)
+        return nullptr;
+
+    std::size_t blockAlignment = bytes >= hugePageSize ? hugePageSize : Arena::alignment;
+
+    // Whole alignment units, so huge-page blocks consist of whole pages
+    std::size_t blockSize = (bytes + blockAlignment - 1) / blockAlignment * blockAlignment;
+
+    void* p = nullptr;
+
+#ifdef _WIN32
+    p = _aligned_malloc(blockSize, blockAlignment);
+#else
+    if (posix_memalign(&p, blockAlignment, blockSize) != 0)
+        p = nullptr;
+#endif
+
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    numAlignedAllocations.fetch_add(1, std::memory_order_relaxed);
+
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    if (blockAlignment == hugePageSize)
+        madvise(p, blockSize, hugePageAdvice.load(std::memory_order_relaxed) ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+#endif
+
+    return p;
+}
+
+long long ogmaneo::getNumAlignedAllocations() {
+    return numAlignedAllocations.load(std::memory_order_relaxed);
+}
+
+void ogmaneo::freeAligned(
+    void* p
+) {
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    std::free(p);
+#endif
+}
+
+Arena::Arena(
+    std::size_t capacity
+)
+:
+block(nullptr),
+capacity(capacity),
+used(0)
+{
+    if (capacity == 0)
+        return;
+
+    // Same rounding as allocateAligned, so all of the block can be used
+    if (capacity >= hugePageSize)
+        this->capacity = (capacity + hugePageSize - 1) / hugePageSize * hugePageSize;
+
+    block = static_cast<char*>(allocateAligned(this->capacity));
+}
+
+Arena::~Arena() {
+    freeAligned(block);
+}
\ No newline at end of file
@@ -0,0 +1,203 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+namespace ogmaneo {
+// Heap allocation aligned to Arena::alignment. Allocations of at least a huge page are aligned to it and advised to use transparent huge pages
+void* allocateAligned(
+    std::size_t bytes // Size in bytes
+);
+
+// Free memory from allocateAligned
+void freeAligned(
+    void* p
+);
+
+// Number of allocateAligned calls so far, e.g. to check that a code path does not allocate
+long long getNumAlignedAllocations();
+
+// Whether allocations of at least a huge page are advised to use transparent huge pages (the default).
+// Disabled, they are advised not to, e.g. to measure the difference (see HugePageBenchmark). Applies to later allocations
+void setHugePageAdvice(
+    bool enabled
+);
+
+// A single aligned (huge-page backed where available) block that buffers are carved out of in order.
+// Memory is only returned when the arena is destroyed, so it must outlive the buffers placed in it
+class Arena {
+private:
+    char* block;
+
+    std::size_t capacity;
+    std::size_t used;
+
+public:
+    // Alignment of the block and of every allocation (cache line)
+    static const std::size_t alignment = 64;
+
+    Arena(
+        std::size_t capacity // Size of the block in bytes
+    );
+
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Carve out an aligned range, nullptr if the arena is full
+    void* allocate(
+        std::size_t bytes // Size in bytes
+    ) {
+        std::size_t start = (used + alignment - 1) / alignment * alignment;
+
+        if (start + bytes > capacity)
+            return nullptr;
+
+        used = start + bytes;
+
+        return block + start;
+    }
+
+    bool contains(
+        const void* p
+    ) const {
+        return p >= block && p < block + capacity;
+    }
+
+    // Size of the block in bytes
+    std::size_t getCapacity() const {
+        return capacity;
+    }
+
+    // Bytes handed out so far (including alignment padding)
+    std::size_t getUsed() const {
+        return used;
+    }
+
+    // Bytes an arena needs for a buffer of the given size
+    static std::size_t getPaddedSize(
+        std::size_t bytes // Size in bytes
+    ) {
+        return (bytes + alignment - 1) / alignment * alignment;
+    }
+};
+
+// Allocator of the library buffers. Allocates from an arena if it has one (and it has room), from the heap (allocateAligned) otherwise,
+// so the data of every buffer is aligned to Arena::alignment. Copies of a buffer start out on the heap, moves and swaps take the allocator (arena) with them
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    typedef std::false_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    Arena* arena; // nullptr for the heap
+
+    ArenaAllocator()
+    :
+    arena(nullptr)
+    {}
+
+    ArenaAllocator(
+        Arena* arena
+    )
+    :
+    arena(arena)
+    {}
+
+    template <typename U>
+    ArenaAllocator(
+        const ArenaAllocator<U> &other
+    )
+    :
+    arena(other.arena)
+    {}
+
+    T* allocate(
+        std::size_t n
+    ) {
+        if (arena != nullptr) {
+            void* p = arena->allocate(n * sizeof(T));
+
+            if (p != nullptr)
+                return static_cast<T*>(p);
+        }
+
+        return static_cast<T*>(allocateAligned(n * sizeof(T)));
+    }
+
+    void deallocate(
+        T* p,
+        std::size_t /* n */
+    ) {
+        // Arena memory is released with the arena
+        if (arena != nullptr && arena->contains(p))
+            return;
+
+        freeAligned(p);
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const {
+        return ArenaAllocator();
+    }
+};
+
+template <typename T, typename U>
+bool operator==(
+    const ArenaAllocator<T> &left,
+    const ArenaAllocator<U> &right
+) {
+    return left.arena == right.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(
+    const ArenaAllocator<T> &left,
+    const ArenaAllocator<U> &right
+) {
+    return left.arena != right.arena;
+}
+
+// Tell the compiler a pointer is aligned to Arena::alignment (such as the data of a buffer), for vectorized loops
+template <typename T>
+inline T* assumeAligned(
+    T* p
+) {
+#if defined(__GNUC__) || defined(__clang__)
+    return static_cast<T*>(__builtin_assume_aligned(p, Arena::alignment));
+#else
+    return p;
+#endif
+}
+
+// Buffer type of all layer state and weights
+template <typename T>
+using Buffer = std::vector<T, ArenaAllocator<T>>;
+
+// Move a buffer's contents into an arena (heap if the arena is full)
+template <typename T>
+void placeInArena(
+    Buffer<T> &buffer, // Buffer to move
+    Arena* arena // Arena to move to
+) {
+    Buffer<T> placed((ArenaAllocator<T>(arena)));
+
+    placed.reserve(buffer.size());
+    placed.insert(placed.end(), buffer.begin(), buffer.end());
+
+    buffer.swap(placed);
+}
+} // namespace ogmaneo
\ No newline at end of file
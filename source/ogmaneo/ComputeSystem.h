@@ -8,12 +8,153 @@
 
 #pragma once
 
-#include "Helpers.h"
+#include "SparseMatrix.h"
+#include "ThreadPool.h"
+#include "NUMA.h"
 #include <omp.h>
 
 #include <random>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <tuple>
 
 namespace ogmaneo {
+// Parallel backend of the kernel executors
+enum ComputeBackend {
+	openMP = 0,
+	threadPool = 1
+};
+
+// Order in which the batches of a 2D kernel are distributed
+enum BatchOrder {
+	rowOrder = 0, // Flat batch index, x fastest
+	mortonOrder = 1 // Z-order curve, consecutive batches (and so each thread's range) form compact tiles
+};
+
+// Launch sizes are grouped into buckets of powers of two when learning the inline path: bucket b holds launches of [2^(b - 1), 2^b) items
+const int numSizeBuckets = 32;
+
+// Path a launch of a kernel takes
+enum KernelPath {
+	unlearnedPath = 0, // Still being learned
+	inlinePath = 1, // Calling thread
+	parallelPath = 2 // Backend
+};
+
+// Execution statistics and inline policy of a named kernel (snapshot, see ComputeSystem::getKernelStats)
+struct KernelStats {
+	int threshold; // Launches with fewer items run inline on the calling thread, -1 to learn the faster path by timing
+
+	long long inlineRuns; // Launches run on the calling thread
+	long long parallelRuns; // Launches run on the backend
+
+	std::vector<KernelPath> learnedPaths; // Path learned for each size bucket, if learning
+
+	KernelStats()
+	:
+	threshold(-1),
+	inlineRuns(0),
+	parallelRuns(0)
+	{}
+};
+
+// Live statistics and policy of a named kernel. The policy and counters are read and updated without the profile's mutex on every launch
+struct KernelRecord {
+	std::atomic<int> threshold;
+
+	std::atomic<long long> inlineRuns;
+	std::atomic<long long> parallelRuns;
+
+	std::atomic<int> learnedPaths[numSizeBuckets];
+
+	// Timings of the first launches of each size bucket while learning, guarded by the profile's mutex
+	double inlineTimes[numSizeBuckets], parallelTimes[numSizeBuckets]; // Total seconds
+	int inlineTimed[numSizeBuckets], parallelTimed[numSizeBuckets];
+
+	KernelRecord(
+		int threshold
+	) {
+		reset(threshold);
+	}
+
+	void reset(
+		int threshold
+	) {
+		this->threshold = threshold;
+
+		inlineRuns = 0;
+		parallelRuns = 0;
+
+		for (int b = 0; b < numSizeBuckets; b++) {
+			learnedPaths[b] = unlearnedPath;
+
+			inlineTimes[b] = parallelTimes[b] = 0.0;
+			inlineTimed[b] = parallelTimed[b] = 0;
+		}
+	}
+};
+
+// Launch configuration of a kernel call site (kernel, scope and extent), found by autotuning
+struct KernelTuning {
+	std::string name; // Kernel name
+	int scope; // Kernel scope (e.g. layer index) at the call site
+	Int2 size; // Launch extent
+
+	// Chosen configuration
+	Int2 batchSize;
+	LoopSchedule schedule;
+
+	bool locked; // Done tuning, the configuration is used for all launches
+
+	// Tuning state
+	int launches; // Launches that have reserved a candidate so far
+	std::vector<double> candidateTimes; // Total seconds per candidate
+	std::vector<int> candidateLaunches; // Timed launches per candidate
+
+	KernelTuning()
+	:
+	scope(0),
+	size(0, 0),
+	batchSize(2, 2),
+	schedule(defaultSchedule),
+	locked(false),
+	launches(0)
+	{}
+};
+
+// Statistics of all named kernels, shared between copies of a compute system
+struct KernelProfile {
+	std::mutex mutex;
+
+	// Records are never removed, so launches can keep pointers to them (see dispatchKernel)
+	std::map<std::string, KernelRecord, std::less<>> kernels;
+
+	std::map<unsigned long long, KernelTuning> tunings; // By call site key
+
+	std::atomic<bool> hasTunings; // Whether tunings is non-empty, readable without the mutex
+
+	// Bumped (under the mutex) whenever a tuning is locked or replaced, invalidates the tunings cached per thread (see tuneLaunch)
+	std::atomic<unsigned long long> tuningsVersion;
+
+	const unsigned long long id; // Unique for the lifetime of the program
+
+	KernelProfile()
+	:
+	hasTunings(false),
+	tuningsVersion(0),
+	id(nextId())
+	{}
+
+	static unsigned long long nextId() {
+		static std::atomic<unsigned long long> counter(0);
+
+		return ++counter;
+	}
+};
+
 class ComputeSystem {
 public:
 	// Default batch sizes for dimensions 1-3
@@ -24,15 +165,159 @@ public:
 	// Default RNG
 	std::mt19937 rng;
 
+	BatchOrder batchOrder2; // Traversal of 2D kernels
+
+	ComputeBackend backend;
+
+	std::shared_ptr<ThreadPool> pool; // Persistent pool, used if backend is threadPool. Shared between copies
+
+	std::shared_ptr<const NUMATopology> numa; // Node layout in NUMA mode, nullptr otherwise
+
+	// Inline threshold (items) of kernels without their own: launches with fewer items run on the calling thread.
+	// -1 learns the faster path by timing, per kernel and launch size (see numSizeBuckets)
+	int defaultThreshold;
+
+	std::shared_ptr<KernelProfile> profile; // Per-kernel statistics, thresholds and tunings
+
+	int autotuneSamples; // Timed launches per candidate configuration when autotuning a call site, 0 disables autotuning
+
+	int kernelScope; // Distinguishes call sites of the same kernel and extent (e.g. the layer index), set by the hierarchy
+
 	ComputeSystem()
 	:
 	batchSize1(1024),
 	batchSize2(2, 2),
-	batchSize3(2, 2, 2)
+	batchSize3(2, 2, 2),
+	batchOrder2(rowOrder),
+	backend(openMP),
+	defaultThreshold(32),
+	profile(std::make_shared<KernelProfile>()),
+	autotuneSamples(0),
+	kernelScope(0)
 	{}
 
 	static void setNumThreads(int numThreads) {
 		omp_set_num_threads(numThreads);
 	}
+
+	// Switch to a persistent work-stealing thread pool. Idle workers poll spinIterations times before parking, 0 parks immediately
+	void setThreadPool(int numThreads, int spinIterations = 4096) {
+		pool = std::make_shared<ThreadPool>(numThreads, spinIterations);
+
+		backend = threadPool;
+
+		numa = nullptr;
+	}
+
+	// Switch back to OpenMP, releases the pool
+	void setOpenMP() {
+		pool = nullptr;
+
+		backend = openMP;
+	}
+
+	// Switch to NUMA mode (OpenMP backend). Threads are pinned to nodes, and the batches of 2D kernels are split statically into
+	// one range per node, matching the weight placement of placeWeights. Tuning, batch orders and inline launches are disabled since they would change
+	// the partition. On single node machines this is the OpenMP backend
+	void setNUMA() {
+		setOpenMP();
+
+		std::shared_ptr<NUMATopology> topology = std::make_shared<NUMATopology>(readNUMATopology());
+
+		pinOpenMPThreads(*topology);
+
+		numa = topology;
+	}
+
+	// Set the inline threshold (items) of a kernel, -1 to learn it. Resets its statistics
+	void setKernelThreshold(const std::string &name, int threshold) {
+		std::lock_guard<std::mutex> lock(profile->mutex);
+
+		std::map<std::string, KernelRecord, std::less<>>::iterator it = profile->kernels.find(name);
+
+		if (it == profile->kernels.end())
+			profile->kernels.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(threshold));
+		else
+			it->second.reset(threshold);
+	}
+
+	// Snapshot of the per-kernel statistics (which path each kernel took)
+	std::map<std::string, KernelStats, std::less<>> getKernelStats() const {
+		std::lock_guard<std::mutex> lock(profile->mutex);
+
+		std::map<std::string, KernelStats, std::less<>> stats;
+
+		for (std::map<std::string, KernelRecord, std::less<>>::const_iterator it = profile->kernels.begin(); it != profile->kernels.end(); it++) {
+			KernelStats &kernelStats = stats[it->first];
+
+			kernelStats.threshold = it->second.threshold;
+			kernelStats.inlineRuns = it->second.inlineRuns;
+			kernelStats.parallelRuns = it->second.parallelRuns;
+
+			if (kernelStats.threshold < 0) {
+				kernelStats.learnedPaths.resize(numSizeBuckets);
+
+				for (int b = 0; b < numSizeBuckets; b++)
+					kernelStats.learnedPaths[b] = static_cast<KernelPath>(it->second.learnedPaths[b].load());
+			}
+		}
+
+		return stats;
+	}
+
+	// Tune the batch size and schedule of every named 2D call site over its first launches, then lock in the fastest
+	void setAutotune(int samples = 4) {
+		autotuneSamples = samples;
+	}
+
+	// Snapshot of the call site tunings
+	std::vector<KernelTuning> getKernelTunings() const {
+		std::lock_guard<std::mutex> lock(profile->mutex);
+
+		std::vector<KernelTuning> tunings;
+
+		for (std::map<unsigned long long, KernelTuning>::const_iterator it = profile->tunings.begin(); it != profile->tunings.end(); it++)
+			tunings.push_back(it->second);
+
+		return tunings;
+	}
 };
+
+// Write the locked tunings, e.g. to a file next to the model
+void writeKernelTuningsToStream(
+	std::ostream &os, // Stream to write to
+	const ComputeSystem &cs // Compute system
+);
+
+// Read tunings written by writeKernelTuningsToStream, launches of those call sites start tuned. Streams of another layout version,
+// truncated streams and invalid tunings (e.g. empty batches) are rejected: the failbit of the stream is set and no tuning is read
+void readKernelTuningsFromStream(
+	std::istream &is, // Stream to read from
+	ComputeSystem &cs // Compute system
+);
+
+// Run independent tasks (e.g. the kernel launches of several layers) concurrently and wait for them, func(task, taskRng) is called for each task.
+// Tasks share cs, but draw from their own counter-based generator keyed by a value drawn from cs.rng and the task index (pass it to the
+// layers instead of cs.rng), so results don't depend on how the tasks are scheduled. Tasks run one after another on the OpenMP backend
+template <typename F>
+void runTasks(
+	ComputeSystem &cs, // Compute system
+	int numTasks, // Number of tasks
+	const F &func // Task function
+) {
+	unsigned long long key = drawKey(cs.rng);
+
+	auto taskFunc = [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			PhiloxRNG taskRng(key, i);
+
+			func(i, taskRng);
+		}
+	};
+
+	if (cs.backend == threadPool && cs.pool != nullptr)
+		cs.pool->parallelFor(numTasks, taskFunc);
+	else
+		taskFunc(0, numTasks);
+}
 } // namespace ogmaneo
\ No newline at end of file
@@ -9,9 +9,446 @@
 #include "Helpers.h"
 
 #include "ComputeSystem.h"
+#include "SparseMatrix.h"
+
+#include <chrono>
 
 using namespace ogmaneo;
 
+void ogmaneo::parallelFor(
+    ComputeSystem &cs,
+    int count,
+    const RangeFunc &func,
+    LoopSchedule schedule
+) {
+    if (cs.backend == threadPool && cs.pool != nullptr) {
+        cs.pool->parallelFor(count, func, schedule);
+
+        return;
+    }
+
+    if (cs.numa != nullptr && cs.numa->getNumNodes() > 1) {
+        int numNodes = cs.numa->getNumNodes();
+
+        // One range per node, split statically between the node's threads (see getThreadNode and getItemNode)
+        #pragma omp parallel
+        {
+            int numThreads = omp_get_num_threads();
+            int thread = omp_get_thread_num();
+
+            // With fewer threads than nodes, fall back to one range per thread
+            int numRegions = numThreads < numNodes ? 1 : numNodes;
+
+            int node = getThreadNode(thread, numThreads, numRegions);
+
+            int firstThread = (static_cast<long long>(node) * numThreads + numRegions - 1) / numRegions;
+            int endThread = (static_cast<long long>(node + 1) * numThreads + numRegions - 1) / numRegions;
+
+            int nodeBegin = static_cast<long long>(count) * node / numRegions;
+            int nodeEnd = static_cast<long long>(count) * (node + 1) / numRegions;
+
+            int rank = thread - firstThread;
+            int numRanks = endThread - firstThread;
+
+            int begin = nodeBegin + static_cast<long long>(nodeEnd - nodeBegin) * rank / numRanks;
+            int end = nodeBegin + static_cast<long long>(nodeEnd - nodeBegin) * (rank + 1) / numRanks;
+
+            if (begin < end)
+                func(begin, end);
+        }
+
+        return;
+    }
+
+    switch (schedule) {
+    case dynamicSchedule:
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < count; i++)
+            func(i, i + 1);
+
+        break;
+    case guidedSchedule:
+        #pragma omp parallel for schedule(guided)
+        for (int i = 0; i < count; i++)
+            func(i, i + 1);
+
+        break;
+    default:
+        // One contiguous range per thread (static schedule)
+        #pragma omp parallel
+        {
+            int numThreads = omp_get_num_threads();
+            int thread = omp_get_thread_num();
+
+            int begin = static_cast<long long>(count) * thread / numThreads;
+            int end = static_cast<long long>(count) * (thread + 1) / numThreads;
+
+            if (begin < end)
+                func(begin, end);
+        }
+    }
+}
+
+const Int2* ogmaneo::getBatchOrder2(
+    const ComputeSystem &cs,
+    const Int2 &batches
+) {
+    if (cs.batchOrder2 != mortonOrder || cs.numa != nullptr)
+        return nullptr;
+
+    // Orders are small and never change once built, so they are kept for the lifetime of the program
+    typedef std::pair<int, int> Key;
+
+    static std::mutex cacheMutex;
+    static std::map<Key, std::vector<Int2>> cache;
+
+    Key key(batches.x, batches.y);
+
+    // Launches of a layer repeat the same grid, look the last one up without the mutex
+    static thread_local Key lastKey(0, 0);
+    static thread_local const Int2* lastOrder = nullptr;
+
+    if (lastOrder != nullptr && key == lastKey)
+        return lastOrder;
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+
+    std::map<Key, std::vector<Int2>>::iterator it = cache.find(key);
+
+    if (it != cache.end()) {
+        lastKey = key;
+        lastOrder = it->second.data();
+
+        return lastOrder;
+    }
+
+    std::vector<Int2> &order = cache[key];
+
+    std::size_t numBatches = static_cast<std::size_t>(batches.x) * batches.y;
+
+    order.reserve(numBatches);
+
+    // Walk the Z-order curve of the enclosing power of two square, keeping the positions inside the grid.
+    // y takes the low bit, since columns are contiguous along y (see address2)
+    for (unsigned int code = 0; order.size() < numBatches; code++) {
+        Int2 pos(0, 0);
+
+        for (int b = 0; b < 16; b++) {
+            pos.y |= ((code >> (2 * b)) & 1) << b;
+            pos.x |= ((code >> (2 * b + 1)) & 1) << b;
+        }
+
+        if (pos.x < batches.x && pos.y < batches.y)
+            order.push_back(pos);
+    }
+
+    lastKey = key;
+    lastOrder = order.data();
+
+    return lastOrder;
+}
+
+// Candidate batch sizes and schedules tried by the autotuner
+static const Int2 tuneBatchSizes[] = { Int2(1, 1), Int2(2, 2), Int2(4, 4), Int2(8, 8), Int2(1, 8), Int2(1, 32) };
+static const LoopSchedule tuneSchedules[] = { staticSchedule, dynamicSchedule, guidedSchedule };
+
+static const int numTuneBatchSizes = sizeof(tuneBatchSizes) / sizeof(Int2);
+static const int numTuneCandidates = numTuneBatchSizes * sizeof(tuneSchedules) / sizeof(LoopSchedule);
+
+// Key of a call site (FNV-1a of the name, scope and extent), avoids building a string per launch
+static unsigned long long callSiteKey(
+    const char* name,
+    int scope,
+    const Int2 &size
+) {
+    unsigned long long key = 14695981039346656037ull;
+
+    for (const char* c = name; *c != '\0'; c++)
+        key = (key ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+
+    int values[3] = { scope, size.x, size.y };
+
+    for (int i = 0; i < 3; i++)
+        key = (key ^ static_cast<unsigned int>(values[i])) * 1099511628211ull;
+
+    return key;
+}
+
+KernelTuning* ogmaneo::tuneLaunch(
+    ComputeSystem &cs,
+    const char* name,
+    const Int2 &size,
+    Int2 &batchSize,
+    LoopSchedule &schedule,
+    int &candidate
+) {
+    // Keep the partition of the weight placement
+    if (cs.numa != nullptr)
+        return nullptr;
+
+    // Nothing to tune or apply, don't take the mutex
+    if (cs.autotuneSamples <= 0 && !cs.profile->hasTunings.load(std::memory_order_relaxed))
+        return nullptr;
+
+    struct CacheEntry {
+        unsigned long long profileId;
+        unsigned long long version; // Tunings version of the profile when cached
+        const char* name;
+        int scope;
+        Int2 size;
+        bool tuned; // Whether the call site has a locked tuning, otherwise it has none (and isn't being tuned)
+        Int2 batchSize;
+        LoopSchedule schedule;
+    };
+
+    // Settled call sites per thread, so that launches of tuned kernels don't take the mutex. Direct mapped by call site
+    // (names are string literals, so they are matched by pointer), entries of another profile or tunings version are stale
+    const int numCacheEntries = 256;
+
+    static thread_local CacheEntry cache[numCacheEntries] = {};
+
+    std::size_t slot = (reinterpret_cast<std::size_t>(name) / 8 + static_cast<std::size_t>(cs.kernelScope) * 31 + size.x * 1021 + size.y * 65521) % numCacheEntries;
+
+    CacheEntry &entry = cache[slot];
+
+    unsigned long long version = cs.profile->tuningsVersion.load(std::memory_order_acquire);
+
+    // Call sites without a tuning only stay settled while not autotuning
+    if (entry.name == name && entry.profileId == cs.profile->id && entry.version == version && entry.scope == cs.kernelScope &&
+        entry.size.x == size.x && entry.size.y == size.y && (entry.tuned || cs.autotuneSamples <= 0)) {
+        if (entry.tuned) {
+            batchSize = entry.batchSize;
+            schedule = entry.schedule;
+        }
+
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+    unsigned long long key = callSiteKey(name, cs.kernelScope, size);
+
+    std::map<unsigned long long, KernelTuning>::iterator it = cs.profile->tunings.find(key);
+
+    if (it == cs.profile->tunings.end()) {
+        if (cs.autotuneSamples <= 0) {
+            entry = { cs.profile->id, cs.profile->tuningsVersion.load(std::memory_order_relaxed), name, cs.kernelScope, size, false, batchSize, schedule };
+
+            return nullptr;
+        }
+
+        KernelTuning tuning;
+        tuning.name = name;
+        tuning.scope = cs.kernelScope;
+        tuning.size = size;
+        tuning.candidateTimes.resize(numTuneCandidates, 0.0);
+        tuning.candidateLaunches.resize(numTuneCandidates, 0);
+
+        it = cs.profile->tunings.emplace(key, tuning).first;
+
+        cs.profile->hasTunings = true;
+    }
+
+    KernelTuning &tuning = it->second;
+
+    if (tuning.locked) {
+        batchSize = tuning.batchSize;
+        schedule = tuning.schedule;
+
+        entry = { cs.profile->id, cs.profile->tuningsVersion.load(std::memory_order_relaxed), name, cs.kernelScope, size, true, batchSize, schedule };
+
+        return nullptr;
+    }
+
+    // Cycle through the candidates so that each one sees a similar mix of launches. Reserved here rather than when the
+    // time is recorded, since concurrent launches of the call site (e.g. the predictors of a layer) record in any order
+    candidate = tuning.launches % numTuneCandidates;
+
+    tuning.launches++;
+
+    batchSize = tuneBatchSizes[candidate % numTuneBatchSizes];
+    schedule = tuneSchedules[candidate / numTuneBatchSizes];
+
+    return &tuning;
+}
+
+// Record the time of a launch made while tuning, lock in the fastest candidate once all have enough samples
+static void recordTunedLaunch(
+    ComputeSystem &cs,
+    KernelTuning* tuning,
+    int candidate,
+    double seconds
+) {
+    std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+    // May have been locked by a concurrent launch of the same call site
+    if (tuning->locked)
+        return;
+
+    tuning->candidateTimes[candidate] += seconds;
+    tuning->candidateLaunches[candidate]++;
+
+    // Wait for every candidate to have its samples, launches still running may not have recorded yet
+    int samples = std::max(1, cs.autotuneSamples);
+
+    for (int c = 0; c < numTuneCandidates; c++) {
+        if (tuning->candidateLaunches[c] < samples)
+            return;
+    }
+
+    // Fastest on average, candidates may have a few more samples than others
+    int best = 0;
+
+    for (int c = 1; c < numTuneCandidates; c++) {
+        if (tuning->candidateTimes[c] * tuning->candidateLaunches[best] < tuning->candidateTimes[best] * tuning->candidateLaunches[c])
+            best = c;
+    }
+
+    tuning->batchSize = tuneBatchSizes[best % numTuneBatchSizes];
+    tuning->schedule = tuneSchedules[best / numTuneBatchSizes];
+    tuning->locked = true;
+
+    cs.profile->tuningsVersion.fetch_add(1, std::memory_order_release);
+}
+
+// Record of a named kernel. Looked up in a per-thread cache first, so launches do not take the profile's mutex once a kernel is known
+static KernelRecord* findKernelRecord(
+    ComputeSystem &cs,
+    const char* name
+) {
+    struct CacheEntry {
+        unsigned long long profileId;
+        const char* name;
+        KernelRecord* record;
+    };
+
+    // Kernel names are string literals, so entries are matched by pointer. Fixed size, so that workers seeing a kernel for the
+    // first time do not allocate
+    const int maxCacheEntries = 64;
+
+    static thread_local CacheEntry cache[maxCacheEntries];
+    static thread_local int numCached = 0;
+    static thread_local int nextCached = 0;
+
+    for (int i = 0; i < numCached; i++) {
+        if (cache[i].name == name && cache[i].profileId == cs.profile->id)
+            return cache[i].record;
+    }
+
+    std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+    std::map<std::string, KernelRecord, std::less<>>::iterator it = cs.profile->kernels.find(name);
+
+    if (it == cs.profile->kernels.end())
+        it = cs.profile->kernels.emplace(std::piecewise_construct, std::forward_as_tuple(name), std::forward_as_tuple(cs.defaultThreshold)).first;
+
+    // Replace the oldest entry once full (e.g. entries of profiles that no longer exist)
+    cache[nextCached] = { cs.profile->id, name, &it->second };
+
+    nextCached = (nextCached + 1) % maxCacheEntries;
+    numCached = std::min(numCached + 1, maxCacheEntries);
+
+    return &it->second;
+}
+
+void ogmaneo::dispatchKernel(
+    ComputeSystem &cs,
+    const char* name,
+    int numItems,
+    int count,
+    const RangeFunc &func,
+    LoopSchedule schedule,
+    KernelTuning* tuning,
+    int tuningCandidate
+) {
+    // Launches per path timed before a learned size bucket settles on the faster one
+    const int learnLaunches = 4;
+
+    // Small launches also follow the node partition of the weight placement, so their weights are only touched from their own node
+    bool allowInline = cs.numa == nullptr || cs.numa->getNumNodes() <= 1;
+
+    if (name == nullptr) {
+        if (allowInline && numItems < cs.defaultThreshold)
+            func(0, count);
+        else
+            parallelFor(cs, count, func);
+
+        return;
+    }
+
+    KernelRecord* record = findKernelRecord(cs, name);
+
+    int threshold = record->threshold.load(std::memory_order_relaxed);
+
+    bool runInline;
+    bool timed = false;
+
+    int bucket = 0;
+
+    if (!allowInline)
+        runInline = false;
+    else if (threshold >= 0)
+        runInline = numItems < threshold;
+    else {
+        // Floor of log2 plus one
+        for (int n = numItems; n > 0 && bucket < numSizeBuckets - 1; n >>= 1)
+            bucket++;
+
+        int path = record->learnedPaths[bucket].load(std::memory_order_acquire);
+
+        if (path != unlearnedPath)
+            runInline = path == inlinePath;
+        else {
+            std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+            // Alternate between the paths while learning
+            runInline = record->inlineTimed[bucket] <= record->parallelTimed[bucket];
+
+            timed = true;
+        }
+    }
+
+    if (runInline)
+        record->inlineRuns.fetch_add(1, std::memory_order_relaxed);
+    else
+        record->parallelRuns.fetch_add(1, std::memory_order_relaxed);
+
+    std::chrono::steady_clock::time_point start;
+
+    if (timed || tuning != nullptr)
+        start = std::chrono::steady_clock::now();
+
+    if (runInline)
+        func(0, count);
+    else
+        parallelFor(cs, count, func, schedule);
+
+    if (timed || tuning != nullptr) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (tuning != nullptr)
+            recordTunedLaunch(cs, tuning, tuningCandidate, seconds);
+
+        if (timed) {
+            std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+            if (runInline) {
+                record->inlineTimes[bucket] += seconds;
+                record->inlineTimed[bucket]++;
+            }
+            else {
+                record->parallelTimes[bucket] += seconds;
+                record->parallelTimed[bucket]++;
+            }
+
+            // Settle once both paths have enough samples (may already have been settled by a concurrent launch)
+            if (record->learnedPaths[bucket].load(std::memory_order_relaxed) == unlearnedPath &&
+                record->inlineTimed[bucket] >= learnLaunches && record->parallelTimed[bucket] >= learnLaunches)
+                record->learnedPaths[bucket].store(record->inlineTimes[bucket] <= record->parallelTimes[bucket] ? inlinePath : parallelPath, std::memory_order_release);
+        }
+    }
+}
+
 void ogmaneo::runKernel1(
     ComputeSystem &cs,
     const std::function<void(int, std::mt19937 &)> &func,
@@ -19,22 +456,28 @@ void ogmaneo::runKernel1(
     std::mt19937 &rng,
     int batchSize
 ) {
-    std::uniform_int_distribution<int> seedDist(0, 999999);
+    unsigned int seed = rng();
 
     // Ceil divide
     int batches = (size + batchSize - 1) / batchSize;
 
-    #pragma omp parallel for
-    for (int i = 0; i < batches; i++) {
-        int itemBatchSize = std::min(size - i * batchSize, batchSize);
-        
-        std::mt19937 subRng(seedDist(rng));
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int itemBatchSize = std::min(size - i * batchSize, batchSize);
 
-        int pos = i * batchSize;
+            std::mt19937 subRng(seed + i);
 
-        for (int x = 0; x < itemBatchSize; x++)
-            func(pos + x, subRng);
-    }
+            int pos = i * batchSize;
+
+            for (int x = 0; x < itemBatchSize; x++) {
+                seedRounding(seed, pos + x);
+
+                func(pos + x, subRng);
+            }
+        }
+    };
+
+    dispatchKernel(cs, nullptr, size, batches, batchFunc);
 }
 
 void ogmaneo::runKernel2(
@@ -43,32 +486,37 @@ void ogmaneo::runKernel2(
     const Int2 &size, std::mt19937 &rng,
     const Int2 &batchSize
 ) {
-    std::uniform_int_distribution<int> seedDist(0, 999999);
+    unsigned int seed = rng();
 
     // Ceil divide
     Int2 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y);
 
     int totalBatches = batches.x * batches.y;
 
-    #pragma omp parallel for
-    for (int i = 0; i < totalBatches; i++) {
-        int bx = i % batches.x;
-        int by = (i / batches.x) % batches.y;
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int bx = i % batches.x;
+            int by = (i / batches.x) % batches.y;
 
-        Int2 itemBatchSize = Int2(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y));
+            Int2 itemBatchSize = Int2(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y));
 
-        std::mt19937 subRng(seedDist(rng));
-        Int2 pos(bx * batchSize.x, by * batchSize.y);
+            std::mt19937 subRng(seed + i);
+            Int2 pos(bx * batchSize.x, by * batchSize.y);
 
-        for (int x = 0; x < itemBatchSize.x; x++)
-            for (int y = 0; y < itemBatchSize.y; y++) {
-                Int2 bPos;
-                bPos.x = pos.x + x;
-                bPos.y = pos.y + y;
+            for (int x = 0; x < itemBatchSize.x; x++)
+                for (int y = 0; y < itemBatchSize.y; y++) {
+                    Int2 bPos;
+                    bPos.x = pos.x + x;
+                    bPos.y = pos.y + y;
 
-                func(bPos, subRng);
-            }
-    }
+                    seedRounding(seed, bPos.x, bPos.y);
+
+                    func(bPos, subRng);
+                }
+        }
+    };
+
+    dispatchKernel(cs, nullptr, size.x * size.y, totalBatches, batchFunc);
 }
 
 void ogmaneo::runKernel3(
@@ -78,35 +526,40 @@ void ogmaneo::runKernel3(
     std::mt19937 &rng,
     const Int3 &batchSize
 ) {
-    std::uniform_int_distribution<int> seedDist(0, 999999);
+    unsigned int seed = rng();
 
     // Ceil divide
     Int3 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y, (size.z + batchSize.z - 1) / batchSize.z);
 
     int totalBatches = batches.x * batches.y * batches.z;
-    
-    #pragma omp parallel for
-    for (int i = 0; i < totalBatches; i++) {
-        int bx = i % batches.x;
-        int by = (i / batches.x) % batches.y;
-        int bz = (i / (batches.x * batches.y)) % batches.z;
-
-        Int3 itemBatchSize = Int3(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y), std::min(size.z - bz * batchSize.z, batchSize.z));
-
-        std::mt19937 subRng(seedDist(rng));
-        Int3 pos(bx * batchSize.x, by * batchSize.y, bz * batchSize.z);
-
-        for (int x = 0; x < itemBatchSize.x; x++)
-            for (int y = 0; y < itemBatchSize.y; y++)
-                for (int z = 0; z < itemBatchSize.z; z++) {
-                    Int3 bPos;
-                    bPos.x = pos.x + x;
-                    bPos.y = pos.y + y;
-                    bPos.z = pos.z + z;
 
-                    func(bPos, subRng);
-                }
-    }
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int bx = i % batches.x;
+            int by = (i / batches.x) % batches.y;
+            int bz = (i / (batches.x * batches.y)) % batches.z;
+
+            Int3 itemBatchSize = Int3(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y), std::min(size.z - bz * batchSize.z, batchSize.z));
+
+            std::mt19937 subRng(seed + i);
+            Int3 pos(bx * batchSize.x, by * batchSize.y, bz * batchSize.z);
+
+            for (int x = 0; x < itemBatchSize.x; x++)
+                for (int y = 0; y < itemBatchSize.y; y++)
+                    for (int z = 0; z < itemBatchSize.z; z++) {
+                        Int3 bPos;
+                        bPos.x = pos.x + x;
+                        bPos.y = pos.y + y;
+                        bPos.z = pos.z + z;
+
+                        seedRounding(seed, bPos.x, bPos.y, bPos.z);
+
+                        func(bPos, subRng);
+                    }
+        }
+    };
+
+    dispatchKernel(cs, nullptr, size.x * size.y * size.z, totalBatches, batchFunc);
 }
 
 void ogmaneo::fillInt(
@@ -237,107 +690,419 @@ void ogmaneo::initSMLocalRF(
     const Int3 &inSize,
     const Int3 &outSize,
     int radius,
-    SparseMatrix &mat
+    SparseMatrix &mat,
+    bool columnBlocked
 ) {
-    int numOut = outSize.x * outSize.y * outSize.z;
-
-    // Projection constant
-    Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
-        static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+    // Topology is implicit, only the geometry and row offsets are stored (shared with all matrices of the same geometry)
+    mat.inSize = inSize;
+    mat.outSize = outSize;
+    mat.radius = radius;
+    mat.columnBlocked = columnBlocked;
+    mat.pruned = false;
 
-    int diam = radius * 2 + 1;
+    mat.initLocalRFTopology(false);
 
-    int numWeightsPerOutput = diam * diam * inSize.z;
+    mat.valueType = float32;
 
-    int weightsSize = numOut * numWeightsPerOutput;
+    mat.clearExternalValues();
 
-    mat.nonZeroValues.reserve(weightsSize);
+    mat.nonZeroValues.assign(mat.topology->rowRanges.back(), 0.0f);
+    mat.nonZeroValues16.clear();
+    mat.nonZeroValues8.clear();
+    mat.rowScales.clear();
 
-    mat.rowRanges.resize(numOut + 1);
-
-    mat.columnIndices.reserve(weightsSize);
+    mat.rows = outSize.x * outSize.y * outSize.z;
+    mat.columns = inSize.x * inSize.y * inSize.z;
+}
 
-    // Initialize weight matrix
-    for (int ox = 0; ox < outSize.x; ox++)
-        for (int oy = 0; oy < outSize.y; oy++) {
-            Int2 visiblePositionCenter = project(Int2(ox, oy), outToIn);
+void ogmaneo::initSMUniform(
+    ComputeSystem &cs,
+    SparseMatrix &mat,
+    float low,
+    float high,
+    std::mt19937 &rng
+) {
+    // Values per generator stream
+    const int chunkSize = 4096;
 
-            // Lower corner
-            Int2 fieldLowerBound(visiblePositionCenter.x - radius, visiblePositionCenter.y - radius);
+    unsigned long long key = drawKey(rng);
 
-            // Bounds of receptive field, clamped to input size
-            Int2 iterLowerBound(std::max(0, fieldLowerBound.x), std::max(0, fieldLowerBound.y));
-            Int2 iterUpperBound(std::min(inSize.x - 1, visiblePositionCenter.x + radius), std::min(inSize.y - 1, visiblePositionCenter.y + radius));
+    SparseOffset numValues = mat.nonZeroValues.size();
 
-            for (int oz = 0; oz < outSize.z; oz++) {
-                Int3 outPos(ox, oy, oz);
+    int numChunks = (numValues + chunkSize - 1) / chunkSize;
 
-                int nonZeroInRow = 0;
+    float* values = mat.nonZeroValues.data();
 
-                for (int ix = iterLowerBound.x; ix <= iterUpperBound.x; ix++)
-                    for (int iy = iterLowerBound.y; iy <= iterUpperBound.y; iy++) {
-                        for (int iz = 0; iz < inSize.z; iz++) {
-                            Int3 inPos(ix, iy, iz);
+    float range = high - low;
 
-                            int inIndex = address3(inPos, inSize);
+    auto chunkFunc = [&](int begin, int end) {
+        for (int c = begin; c < end; c++) {
+            PhiloxRNG chunkRng(key, c);
 
-                            mat.nonZeroValues.push_back(0.0f);
-                            mat.columnIndices.push_back(inIndex);
-                            
-                            nonZeroInRow++;
-                        }
-                    }
+            SparseOffset chunkEnd = std::min(numValues, static_cast<SparseOffset>(c + 1) * chunkSize);
 
-                mat.rowRanges[address3(outPos, outSize)] = nonZeroInRow;
-            }
+            // 24 random bits per value
+            for (SparseOffset i = static_cast<SparseOffset>(c) * chunkSize; i < chunkEnd; i++)
+                values[i] = low + range * ((chunkRng() >> 8) * (1.0f / 16777216.0f));
         }
+    };
 
-    mat.nonZeroValues.shrink_to_fit();
-    mat.columnIndices.shrink_to_fit();
-
-    // Convert rowRanges from counts to cumulative counts
-    int offset = 0;
+    dispatchKernel(cs, "initSMUniform", std::min<SparseOffset>(numValues, std::numeric_limits<int>::max()), numChunks, chunkFunc);
+}
 
-	for (int i = 0; i < numOut; i++) {
-		int temp = mat.rowRanges[i];
+// Written before each matrix, followed by the layout version. The version is bumped on every change of the layout:
+// 1: local receptive field geometry, with the topology left implicit
+// 2: 64-bit value offsets (64-bit ranges and the index width of explicit topologies, long buffers sized by -1 and a 64-bit size)
+// 3: transposes left out (transpose flag 0, empty transpose buffers), they are rebuilt on first use
+// 4: pruned flag, pruned matrices are written with their explicit topology and keep their geometry
+// 5: pruned local receptive fields are written with the masks of their kept entries instead of an explicit topology
+static const int smStreamTag = 0x4d534f4f; // "OOSM"
+static const int smStreamVersion = 5;
 
-		mat.rowRanges[i] = offset;
+// Index of the stream slot holding attached sections
+static int streamSectionsIndex() {
+    static int index = std::ios_base::xalloc();
 
-		offset += temp;
-	}
+    return index;
+}
 
-    mat.rowRanges[numOut] = offset;
+void ogmaneo::setStreamSections(
+    std::ios_base &s,
+    FileSections* sections
+) {
+    s.pword(streamSectionsIndex()) = sections;
+}
 
-    mat.rows = numOut;
-    mat.columns = inSize.x * inSize.y * inSize.z;
+FileSections* ogmaneo::getStreamSections(
+    std::ios_base &s
+) {
+    return static_cast<FileSections*>(s.pword(streamSectionsIndex()));
 }
 
 void ogmaneo::writeSMToStream(
     std::ostream &os,
     const SparseMatrix &mat
 ) {
+    FileSections* sections = getStreamSections(os);
+
+    // Views are written like owned matrices, unless their values go to sections
+    if (mat.isView() && sections == nullptr) {
+        SparseMatrix owned = mat;
+
+        owned.ownValues();
+
+        writeSMToStream(os, owned);
+
+        return;
+    }
+
+    os.write(reinterpret_cast<const char*>(&smStreamTag), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&smStreamVersion), sizeof(int));
+
     os.write(reinterpret_cast<const char*>(&mat.rows), sizeof(int));
     os.write(reinterpret_cast<const char*>(&mat.columns), sizeof(int));
 
-    writeBufferToStream(os, &mat.nonZeroValues);
-    writeBufferToStream(os, &mat.nonZeroValueIndices);
-    writeBufferToStream(os, &mat.rowRanges);
-    writeBufferToStream(os, &mat.columnIndices);
-    writeBufferToStream(os, &mat.columnRanges);
-    writeBufferToStream(os, &mat.rowIndices);
+    int valueType = mat.valueType;
+
+    os.write(reinterpret_cast<const char*>(&valueType), sizeof(int));
+
+    os.write(reinterpret_cast<const char*>(&mat.radius), sizeof(int));
+
+    char pruned = mat.pruned;
+
+    os.write(&pruned, sizeof(char));
+
+    // Pruned local receptive fields keep their geometry, and add the masks of their kept entries
+    if (mat.radius >= 0) {
+        os.write(reinterpret_cast<const char*>(&mat.inSize), sizeof(Int3));
+        os.write(reinterpret_cast<const char*>(&mat.outSize), sizeof(Int3));
+
+        char columnBlocked = mat.columnBlocked;
+
+        os.write(&columnBlocked, sizeof(char));
+
+        // Topology is rebuilt (and shared) from the geometry on read. Transposes are not stored, they are rebuilt on first use
+        char transpose = 0;
+
+        os.write(&transpose, sizeof(char));
+    }
+
+    if (sections != nullptr) {
+        int valuesSection = sections->add(mat.getValueData(), static_cast<long long>(mat.getNumNonZeroValues()) * mat.getValueSize());
+        int rowScalesSection = mat.valueType == int8 ? sections->add(mat.getRowScaleData(), static_cast<long long>(mat.rows) * sizeof(float)) : -1;
+
+        os.write(reinterpret_cast<const char*>(&valuesSection), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&rowScalesSection), sizeof(int));
+    }
+    else {
+        writeBufferToStream(os, &mat.nonZeroValues);
+        writeBufferToStream(os, &mat.nonZeroValues16);
+        writeBufferToStream(os, &mat.nonZeroValues8);
+        writeBufferToStream(os, &mat.rowScales);
+    }
+
+    if (mat.isMasked()) {
+        writeBufferToStream(os, &mat.topology->keptRanges);
+        writeBufferToStream(os, &mat.topology->cellMasks);
+    }
+    else if (!mat.isLocalRF()) {
+        // Width in bytes of the value indices of the transpose
+        int indexWidth = mat.topology->nonZeroValueIndices64.empty() ? sizeof(int) : sizeof(SparseOffset);
+
+        os.write(reinterpret_cast<const char*>(&indexWidth), sizeof(int));
+
+        writeBufferToStream(os, &mat.topology->rowRanges);
+        writeBufferToStream(os, &mat.topology->columnIndices);
+
+        // The transpose is written empty, it is rebuilt on first use
+        IntBuffer empty;
+
+        writeBufferToStream(os, &empty);
+        writeBufferToStream(os, &empty);
+        writeBufferToStream(os, &empty);
+    }
 }
 
 void ogmaneo::readSMFromStream(
     std::istream &is,
     SparseMatrix &mat
 ) {
+    int tag = 0;
+    int version = 0;
+
+    is.read(reinterpret_cast<char*>(&tag), sizeof(int));
+    is.read(reinterpret_cast<char*>(&version), sizeof(int));
+
+    // Unversioned (older) or other layouts can't be read
+    if (tag != smStreamTag || version != smStreamVersion) {
+        is.setstate(std::ios::failbit);
+
+        return;
+    }
+
     is.read(reinterpret_cast<char*>(&mat.rows), sizeof(int));
     is.read(reinterpret_cast<char*>(&mat.columns), sizeof(int));
 
-    readBufferFromStream(is, &mat.nonZeroValues);
-    readBufferFromStream(is, &mat.nonZeroValueIndices);
-    readBufferFromStream(is, &mat.rowRanges);
-    readBufferFromStream(is, &mat.columnIndices);
-    readBufferFromStream(is, &mat.columnRanges);
-    readBufferFromStream(is, &mat.rowIndices);
+    int valueType;
+
+    is.read(reinterpret_cast<char*>(&valueType), sizeof(int));
+
+    mat.valueType = static_cast<ValueType>(valueType);
+
+    is.read(reinterpret_cast<char*>(&mat.radius), sizeof(int));
+
+    char pruned;
+
+    is.read(&pruned, sizeof(char));
+
+    mat.pruned = pruned;
+
+    if (mat.radius >= 0) {
+        is.read(reinterpret_cast<char*>(&mat.inSize), sizeof(Int3));
+        is.read(reinterpret_cast<char*>(&mat.outSize), sizeof(Int3));
+
+        char columnBlocked;
+
+        is.read(&columnBlocked, sizeof(char));
+
+        mat.columnBlocked = columnBlocked;
+
+        // Ignored, transposes are built on first use (see requireT)
+        char transpose;
+
+        is.read(&transpose, sizeof(char));
+
+        mat.initLocalRFTopology(false);
+    }
+    else
+        mat.columnBlocked = false;
+
+    mat.clearExternalValues();
+
+    FileSections* sections = getStreamSections(is);
+
+    // The values are attached once the topology has been read, so the sections can be checked against it
+    int valuesSection = -1;
+    int rowScalesSection = -1;
+
+    if (sections != nullptr) {
+        is.read(reinterpret_cast<char*>(&valuesSection), sizeof(int));
+        is.read(reinterpret_cast<char*>(&rowScalesSection), sizeof(int));
+    }
+    else {
+        readBufferFromStream(is, &mat.nonZeroValues);
+        readBufferFromStream(is, &mat.nonZeroValues16);
+        readBufferFromStream(is, &mat.nonZeroValues8);
+        readBufferFromStream(is, &mat.rowScales);
+    }
+
+    if (mat.isMasked()) {
+        std::shared_ptr<SparseTopology> topology = std::make_shared<SparseTopology>(*mat.topology);
+
+        readBufferFromStream(is, &topology->keptRanges);
+        readBufferFromStream(is, &topology->cellMasks);
+
+        mat.topology = topology;
+    }
+    else if (!mat.isLocalRF()) {
+        std::shared_ptr<SparseTopology> topology = std::make_shared<SparseTopology>();
+
+        int indexWidth;
+
+        is.read(reinterpret_cast<char*>(&indexWidth), sizeof(int));
+
+        readBufferFromStream(is, &topology->rowRanges);
+        readBufferFromStream(is, &topology->columnIndices);
+
+        if (indexWidth == sizeof(int))
+            readBufferFromStream(is, &topology->nonZeroValueIndices);
+        else
+            readBufferFromStream(is, &topology->nonZeroValueIndices64);
+
+        readBufferFromStream(is, &topology->columnRanges);
+        readBufferFromStream(is, &topology->rowIndices);
+
+        mat.topology = topology;
+    }
+
+    if (sections != nullptr) {
+        int numSections = sections->data.size();
+
+        // The topology must be complete and the sections must hold exactly its values (and a scale per row for int8)
+        bool valid = is && mat.valueType >= float32 && mat.valueType <= int8 && mat.rows >= 0 &&
+            mat.topology != nullptr && mat.topology->rowRanges.size() == static_cast<std::size_t>(mat.rows) + 1 &&
+            valuesSection >= 0 && valuesSection < numSections &&
+            sections->sizes[valuesSection] == mat.topology->getNumEntries() * mat.getValueSize() &&
+            (mat.valueType == int8 ? rowScalesSection >= 0 && rowScalesSection < numSections &&
+                sections->sizes[rowScalesSection] == mat.rows * static_cast<long long>(sizeof(float)) : rowScalesSection == -1);
+
+        if (!valid) {
+            is.setstate(std::ios::failbit);
+
+            return;
+        }
+
+        const float* rowScales = rowScalesSection == -1 ? nullptr : reinterpret_cast<const float*>(sections->data[rowScalesSection]);
+
+        // Releases the buffers of previous contents
+        mat.setExternalValues(sections->data[valuesSection], mat.topology->getNumEntries(), rowScales, sections->immutable);
+    }
+}
+
+// Written before the tunings, followed by the layout version. The version is bumped on every change of the layout:
+// 1: first versioned layout
+static const int tuningsStreamTag = 0x544b4f4f; // "OOKT"
+static const int tuningsStreamVersion = 1;
+
+// Longest kernel name accepted when reading tunings (names are short string literals)
+static const int maxKernelNameLength = 1024;
+
+void ogmaneo::writeKernelTuningsToStream(
+    std::ostream &os,
+    const ComputeSystem &cs
+) {
+    std::vector<KernelTuning> tunings = cs.getKernelTunings();
+
+    os.write(reinterpret_cast<const char*>(&tuningsStreamTag), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&tuningsStreamVersion), sizeof(int));
+
+    int numLocked = 0;
+
+    for (std::size_t i = 0; i < tunings.size(); i++)
+        numLocked += tunings[i].locked;
+
+    os.write(reinterpret_cast<const char*>(&numLocked), sizeof(int));
+
+    for (std::size_t i = 0; i < tunings.size(); i++) {
+        const KernelTuning &tuning = tunings[i];
+
+        if (!tuning.locked)
+            continue;
+
+        int nameLength = tuning.name.length();
+
+        os.write(reinterpret_cast<const char*>(&nameLength), sizeof(int));
+        os.write(tuning.name.data(), nameLength);
+
+        os.write(reinterpret_cast<const char*>(&tuning.scope), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&tuning.size), sizeof(Int2));
+        os.write(reinterpret_cast<const char*>(&tuning.batchSize), sizeof(Int2));
+
+        int schedule = tuning.schedule;
+
+        os.write(reinterpret_cast<const char*>(&schedule), sizeof(int));
+    }
+}
+
+void ogmaneo::readKernelTuningsFromStream(
+    std::istream &is,
+    ComputeSystem &cs
+) {
+    int tag = 0;
+    int version = 0;
+
+    is.read(reinterpret_cast<char*>(&tag), sizeof(int));
+    is.read(reinterpret_cast<char*>(&version), sizeof(int));
+
+    int numLocked = 0;
+
+    is.read(reinterpret_cast<char*>(&numLocked), sizeof(int));
+
+    if (!is || tag != tuningsStreamTag || version != tuningsStreamVersion || numLocked < 0) {
+        is.setstate(std::ios::failbit);
+
+        return;
+    }
+
+    // Read all tunings before applying any, so that a bad stream leaves the profile unchanged
+    std::vector<KernelTuning> tunings;
+
+    for (int i = 0; i < numLocked; i++) {
+        KernelTuning tuning;
+
+        int nameLength = 0;
+
+        is.read(reinterpret_cast<char*>(&nameLength), sizeof(int));
+
+        if (!is || nameLength <= 0 || nameLength > maxKernelNameLength) {
+            is.setstate(std::ios::failbit);
+
+            return;
+        }
+
+        tuning.name.resize(nameLength);
+
+        is.read(&tuning.name[0], nameLength);
+
+        is.read(reinterpret_cast<char*>(&tuning.scope), sizeof(int));
+        is.read(reinterpret_cast<char*>(&tuning.size), sizeof(Int2));
+        is.read(reinterpret_cast<char*>(&tuning.batchSize), sizeof(Int2));
+
+        int schedule = defaultSchedule;
+
+        is.read(reinterpret_cast<char*>(&schedule), sizeof(int));
+
+        // Empty batches would divide by zero when launching
+        if (!is || tuning.size.x <= 0 || tuning.size.y <= 0 || tuning.batchSize.x <= 0 || tuning.batchSize.y <= 0 ||
+            schedule < defaultSchedule || schedule > guidedSchedule) {
+            is.setstate(std::ios::failbit);
+
+            return;
+        }
+
+        tuning.schedule = static_cast<LoopSchedule>(schedule);
+        tuning.locked = true;
+
+        tunings.push_back(tuning);
+    }
+
+    std::lock_guard<std::mutex> lock(cs.profile->mutex);
+
+    for (std::size_t i = 0; i < tunings.size(); i++)
+        cs.profile->tunings[callSiteKey(tunings[i].name.c_str(), tunings[i].scope, tunings[i].size)] = tunings[i];
+
+    if (!tunings.empty())
+        cs.profile->hasTunings = true;
+
+    cs.profile->tuningsVersion.fetch_add(1, std::memory_order_release);
 }
\ No newline at end of file
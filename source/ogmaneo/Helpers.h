@@ -8,19 +8,24 @@
 
 #pragma once
 
-#include "SparseMatrix.h"
+#include "ThreadPool.h"
+#include "Arena.h"
 
 #include <random>
 #include <future>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <functional>
 #include <ostream>
 #include <istream>
+#include <limits>
 #include <assert.h>
 
 namespace ogmaneo {
 class ComputeSystem;
+struct SparseMatrix;
+struct KernelTuning;
 
 // Vector types
 template <typename T> 
@@ -79,11 +84,315 @@ typedef Vec2<float> Float2;
 typedef Vec3<float> Float3;
 typedef Vec4<float> Float4;
 
-typedef std::vector<int> IntBuffer;
-typedef std::vector<float> FloatBuffer;
+typedef Buffer<int> IntBuffer;
+typedef Buffer<float> FloatBuffer;
+
+// --- Counter-Based RNG ---
+
+// Philox4x32-10 counter-based generator. The output is a pure function of the key and counter, so a generator
+// can be created per kernel item for free and results don't depend on the thread count or schedule.
+// Satisfies UniformRandomBitGenerator, so it can be used with the std distributions
+class PhiloxRNG {
+private:
+    unsigned int key[2];
+    unsigned int counter[4];
+    unsigned int block[4];
+
+    int blockIndex;
+
+    static void mulHiLo(
+        unsigned int a,
+        unsigned int b,
+        unsigned int &hi,
+        unsigned int &lo
+    ) {
+        unsigned long long product = static_cast<unsigned long long>(a) * b;
+
+        hi = product >> 32;
+        lo = static_cast<unsigned int>(product);
+    }
+
+    void generateBlock() {
+        unsigned int c[4] = { counter[0], counter[1], counter[2], counter[3] };
+        unsigned int k[2] = { key[0], key[1] };
+
+        for (int r = 0; r < 10; r++) {
+            unsigned int hi0, lo0, hi1, lo1;
+
+            mulHiLo(0xd2511f53u, c[0], hi0, lo0);
+            mulHiLo(0xcd9e8d57u, c[2], hi1, lo1);
+
+            c[0] = hi1 ^ c[1] ^ k[0];
+            c[1] = lo1;
+            c[2] = hi0 ^ c[3] ^ k[1];
+            c[3] = lo0;
+
+            k[0] += 0x9e3779b9u;
+            k[1] += 0xbb67ae85u;
+        }
+
+        for (int i = 0; i < 4; i++)
+            block[i] = c[i];
+
+        blockIndex = 0;
+
+        counter[3]++;
+    }
+
+public:
+    typedef unsigned int result_type;
+
+    PhiloxRNG(
+        unsigned long long seed, // Key, e.g. drawn once per kernel launch
+        unsigned int c0, // Counter (item position)
+        unsigned int c1 = 0,
+        unsigned int c2 = 0
+    )
+    :
+    blockIndex(4)
+    {
+        key[0] = static_cast<unsigned int>(seed);
+        key[1] = static_cast<unsigned int>(seed >> 32);
+
+        counter[0] = c0;
+        counter[1] = c1;
+        counter[2] = c2;
+        counter[3] = 0;
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return 0xffffffffu;
+    }
+
+    result_type operator()() {
+        if (blockIndex == 4)
+            generateBlock();
+
+        return block[blockIndex++];
+    }
+};
+
+// Restart the noise of the stochastic rounding of 16-bit weight updates (see SparseMatrix) on the calling thread.
+// Executors of kernels that update 16-bit weights call it for each item with the launch key and the item position,
+// so rounding doesn't depend on the thread count or schedule
+void seedRounding(
+    unsigned long long key, // Launch key
+    unsigned int c0, // Item position
+    unsigned int c1 = 0,
+    unsigned int c2 = 0
+);
+
+// Draw a kernel launch key from a generator (std::mt19937, or the PhiloxRNG of a task, see runTasks)
+template <typename R>
+unsigned long long drawKey(
+    R &rng
+) {
+    unsigned long long high = rng();
+
+    return (high << 32) | rng();
+}
 
 // --- Kernel Executors ---
 
+// Run func over [0, count) on the parallel backend of the compute system (OpenMP or its thread pool)
+void parallelFor(
+    ComputeSystem &cs, // Compute system
+    int count, // Number of items
+    const RangeFunc &func, // Called with sub-ranges of items
+    LoopSchedule schedule = defaultSchedule // How the items are split between threads
+);
+
+// Run func over [0, count) on the calling thread or the backend, depending on the number of items and the kernel's
+// threshold (see ComputeSystem::defaultThreshold). Named launches are counted in the compute system's profile without taking its mutex
+void dispatchKernel(
+    ComputeSystem &cs, // Compute system
+    const char* name, // Kernel name, nullptr for unnamed
+    int numItems, // Total number of items (work)
+    int count, // Number of batches
+    const RangeFunc &func, // Called with sub-ranges of batches
+    LoopSchedule schedule = defaultSchedule, // How the batches are split between threads
+    KernelTuning* tuning = nullptr, // If set, the launch is timed for this tuning (see tuneLaunch)
+    int tuningCandidate = -1 // Candidate of the tuning the launch runs, as reserved by tuneLaunch
+);
+
+// Look up the configuration of a 2D call site, overriding batchSize and schedule if it is tuned.
+// Returns the tuning to time the launch for while autotuning, nullptr otherwise. Settled call sites are looked up without locking.
+// While autotuning, the candidate configuration is reserved under the profile's mutex, so that concurrent launches of the
+// call site are charged to the candidate they actually ran
+KernelTuning* tuneLaunch(
+    ComputeSystem &cs, // Compute system
+    const char* name, // Kernel name
+    const Int2 &size, // Execution extent size
+    Int2 &batchSize, // Batch size, overridden if tuned
+    LoopSchedule &schedule, // Schedule, overridden if tuned
+    int &candidate // Candidate to time the launch for, set if a tuning is returned
+);
+
+// Batch positions of a 2D launch in the traversal order of the compute system, nullptr for row order.
+// Orders are built once per batch grid and cached
+const Int2* getBatchOrder2(
+    const ComputeSystem &cs, // Compute system
+    const Int2 &batches // Number of batches in each dimension
+);
+
+// Templated executors take any callable with signature void(position, PhiloxRNG &).
+// The kernel is inlined into the (OpenMP) loop, avoiding an indirect call per item.
+// Each item gets its own counter-based generator keyed by a value drawn once per launch from rng and its position.
+// Kernels that update 16-bit weights pass stochasticRounding (see SparseMatrix::roundsStochastically), only their items seed the rounding noise
+
+template <typename F, typename R>
+void runKernel1(
+    ComputeSystem &cs, // Compute system
+    const F &func, // Kernel function
+    int size, // Execution extent size
+    R &rng, // Generator the launch key is drawn from
+    int batchSize, // Batch size
+    const char* name = nullptr, // Kernel name for the profile
+    bool stochasticRounding = false // Whether the kernel updates weights with stochastic rounding
+) {
+    unsigned long long key = drawKey(rng);
+
+    // Ceil divide
+    int batches = (size + batchSize - 1) / batchSize;
+
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int itemBatchSize = std::min(size - i * batchSize, batchSize);
+        
+            int pos = i * batchSize;
+
+            for (int x = 0; x < itemBatchSize; x++) {
+                PhiloxRNG itemRng(key, pos + x);
+
+                if (stochasticRounding)
+                    seedRounding(key, pos + x);
+
+                func(pos + x, itemRng);
+            }
+        }
+    };
+
+    dispatchKernel(cs, name, size, batches, batchFunc);
+}
+
+template <typename F, typename R>
+void runKernel2(
+    ComputeSystem &cs, // Compute system
+    const F &func, // Kernel function
+    const Int2 &size, // Execution extent size
+    R &rng, // Generator the launch key is drawn from
+    const Int2 &defaultBatchSize, // Batch size, unless the call site is tuned
+    const char* name = nullptr, // Kernel name for the profile, named call sites can be autotuned
+    bool stochasticRounding = false // Whether the kernel updates weights with stochastic rounding
+) {
+    unsigned long long key = drawKey(rng);
+
+    Int2 batchSize = defaultBatchSize;
+    LoopSchedule schedule = defaultSchedule;
+
+    int candidate = -1;
+
+    KernelTuning* tuning = name != nullptr ? tuneLaunch(cs, name, size, batchSize, schedule, candidate) : nullptr;
+
+    // Ceil divide
+    Int2 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y);
+
+    int totalBatches = batches.x * batches.y;
+
+    const Int2* order = getBatchOrder2(cs, batches);
+
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int bx, by;
+
+            if (order != nullptr) {
+                bx = order[i].x;
+                by = order[i].y;
+            }
+            else {
+                bx = i % batches.x;
+                by = (i / batches.x) % batches.y;
+            }
+
+            Int2 itemBatchSize = Int2(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y));
+
+            Int2 pos(bx * batchSize.x, by * batchSize.y);
+
+            for (int x = 0; x < itemBatchSize.x; x++)
+                for (int y = 0; y < itemBatchSize.y; y++) {
+                    Int2 bPos;
+                    bPos.x = pos.x + x;
+                    bPos.y = pos.y + y;
+
+                    PhiloxRNG itemRng(key, bPos.x, bPos.y);
+
+                    if (stochasticRounding)
+                        seedRounding(key, bPos.x, bPos.y);
+
+                    func(bPos, itemRng);
+                }
+        }
+    };
+
+    dispatchKernel(cs, name, size.x * size.y, totalBatches, batchFunc, schedule, tuning, candidate);
+}
+
+template <typename F, typename R>
+void runKernel3(
+    ComputeSystem &cs, // Compute system
+    const F &func, // Kernel function
+    const Int3 &size, // Execution extent size
+    R &rng, // Generator the launch key is drawn from
+    const Int3 &batchSize, // Batch size
+    const char* name = nullptr, // Kernel name for the profile
+    bool stochasticRounding = false // Whether the kernel updates weights with stochastic rounding
+) {
+    unsigned long long key = drawKey(rng);
+
+    // Ceil divide
+    Int3 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y, (size.z + batchSize.z - 1) / batchSize.z);
+
+    int totalBatches = batches.x * batches.y * batches.z;
+    
+    auto batchFunc = [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int bx = i % batches.x;
+            int by = (i / batches.x) % batches.y;
+            int bz = (i / (batches.x * batches.y)) % batches.z;
+
+            Int3 itemBatchSize = Int3(std::min(size.x - bx * batchSize.x, batchSize.x), std::min(size.y - by * batchSize.y, batchSize.y), std::min(size.z - bz * batchSize.z, batchSize.z));
+
+            Int3 pos(bx * batchSize.x, by * batchSize.y, bz * batchSize.z);
+
+            for (int x = 0; x < itemBatchSize.x; x++)
+                for (int y = 0; y < itemBatchSize.y; y++)
+                    for (int z = 0; z < itemBatchSize.z; z++) {
+                        Int3 bPos;
+                        bPos.x = pos.x + x;
+                        bPos.y = pos.y + y;
+                        bPos.z = pos.z + z;
+
+                        PhiloxRNG itemRng(key, bPos.x, bPos.y, bPos.z);
+
+                        if (stochasticRounding)
+                            seedRounding(key, bPos.x, bPos.y, bPos.z);
+
+                        func(bPos, itemRng);
+                    }
+        }
+    };
+
+    dispatchKernel(cs, name, size.x * size.y * size.z, totalBatches, batchFunc);
+}
+
+// std::function versions, for callers outside the library. Each batch gets a std::mt19937 seeded from a per-launch seed and the batch index.
+// Launched like unnamed templated kernels, on the backend of the compute system (see dispatchKernel). Every item seeds the rounding noise,
+// since the weights the kernel updates are not known
+
 void runKernel1(
     ComputeSystem &cs, // Compute system
     const std::function<void(int, std::mt19937 &rng)> &func, // Kernel function
@@ -246,32 +555,52 @@ inline float sigmoid(
 
 // --- Serialization ---
 
-template <class T>
+// Sizes are written as an int, sizes that don't fit one as -1 followed by a 64-bit size
+template <class T, class A>
 void writeBufferToStream(
     std::ostream &os, // Stream
-    const std::vector<T>* buf // Buffer to write
+    const std::vector<T, A>* buf // Buffer to write
 ) {
-    int size = buf->size();
+    long long size = buf->size();
 
-    os.write(reinterpret_cast<const char*>(&size), sizeof(int));
+    if (size <= std::numeric_limits<int>::max()) {
+        int size32 = size;
+
+        os.write(reinterpret_cast<const char*>(&size32), sizeof(int));
+    }
+    else {
+        int wide = -1;
+
+        os.write(reinterpret_cast<const char*>(&wide), sizeof(int));
+        os.write(reinterpret_cast<const char*>(&size), sizeof(long long));
+    }
 
     if (size > 0)
         os.write(reinterpret_cast<const char*>(buf->data()), size * sizeof(T));
 }
 
-template <class T>
+template <class T, class A>
 void readBufferFromStream(
     std::istream &is, // Stream
-    std::vector<T>* buf // Buffer to write
+    std::vector<T, A>* buf // Buffer to write
 ) {
-    int size;
+    int size32;
+
+    is.read(reinterpret_cast<char*>(&size32), sizeof(int));
 
-    is.read(reinterpret_cast<char*>(&size), sizeof(int));
+    long long size = size32;
+
+    if (size32 == -1)
+        is.read(reinterpret_cast<char*>(&size), sizeof(long long));
+
+    // Leave the buffer as is if the stream has failed (e.g. a rejected layout)
+    if (!is)
+        return;
 
     if (size == 0)
         buf->clear();
     else {
-        if (buf->size() != size)
+        if (static_cast<long long>(buf->size()) != size)
             buf->resize(size);
 
         is.read(reinterpret_cast<char*>(buf->data()), size * sizeof(T));
@@ -285,16 +614,67 @@ void initSMLocalRF(
     const Int3 &inSize, // Size of input field
     const Int3 &outSize, // Size of output field
     int radius, // Radius of output onto input
-    SparseMatrix &mat // Matrix to fill
+    SparseMatrix &mat, // Matrix to fill
+    bool columnBlocked = false // Store all cells of an output column together
+);
+
+// Fill the (fp32) values of a matrix uniformly in [low, high), in parallel. The values come from a counter-based generator
+// keyed once from rng, so they are the same at any thread count
+void initSMUniform(
+    ComputeSystem &cs, // Compute system
+    SparseMatrix &mat, // Matrix to fill
+    float low, // Lower bound
+    float high, // Upper bound
+    std::mt19937 &rng // Generator
 );
 
 // --- Sparse Matrix Serialization ---
 
+// Sections of a mappable file (see Hierarchy::writeToFile). While attached to a stream, matrix values are written
+// as sections instead of inline, and matrices are read as views of the sections (see SparseMatrix::setExternalValues)
+struct FileSections {
+    std::vector<const char*> data; // Start of each section
+    std::vector<long long> sizes; // Size of each section in bytes
+
+    bool immutable; // Whether matrices read from the sections are immutable
+
+    FileSections()
+    :
+    immutable(true)
+    {}
+
+    // Add a section, returns its index
+    int add(
+        const void* p, // Start of section
+        long long size // Size in bytes
+    ) {
+        data.push_back(static_cast<const char*>(p));
+        sizes.push_back(size);
+
+        return data.size() - 1;
+    }
+};
+
+// Attach sections to a stream, nullptr detaches
+void setStreamSections(
+    std::ios_base &s, // Stream
+    FileSections* sections // Sections to attach
+);
+
+// Sections attached to a stream, nullptr if none
+FileSections* getStreamSections(
+    std::ios_base &s // Stream
+);
+
+// Write a matrix, tagged with the version of the layout
 void writeSMToStream(
     std::ostream &os, // Stream to write to
     const SparseMatrix &mat // Matrix to write to stream
 );
 
+// Read a matrix written by writeSMToStream. Matrices of another layout version are rejected:
+// the failbit of the stream is set and the matrix is left unchanged. With sections attached, the failbit is also set
+// if the value or row scale sections don't exist or don't match the size of the topology
 void readSMFromStream(
     std::istream &is, // Stream to read from
     SparseMatrix &mat // Matrix to read from stream
@@ -9,10 +9,51 @@
 #include "Hierarchy.h"
 
 #include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
 #include <assert.h>
 
 using namespace ogmaneo;
 
+// Mappable file layout (see Hierarchy::writeToFile): the header, the section directory, then the sections, each aligned to Arena::alignment.
+// Stored in native byte order
+static const char fileMagic[8] = { 'O', 'G', 'M', 'A', 'N', 'E', 'O', 'M' };
+static const int fileVersion = 1;
+
+// Written at the start of writeToStream, followed by the layout version. The version is bumped on every change of the layout
+// of the hierarchy itself (the layers' matrices carry their own version, see writeSMToStream):
+// 1: first versioned layout
+static const int streamMagic = 0x484d4f4f; // "OOMH"
+static const int streamVersion = 1;
+
+struct FileHeader {
+    char magic[8];
+    int version;
+    int numSections;
+    int structureSection; // Section holding the rest of the hierarchy, as written by writeToStream
+    int reserved;
+    long long directoryOffset;
+};
+
+struct FileSectionEntry {
+    long long offset; // From the start of the file
+    long long size; // In bytes
+};
+
+// Reads straight from memory, so the structure section is parsed in place
+struct MemoryStreamBuf : public std::streambuf {
+    MemoryStreamBuf(
+        const char* data,
+        long long size
+    ) {
+        char* begin = const_cast<char*>(data);
+
+        setg(begin, begin, begin + size);
+    }
+};
+
 void Hierarchy::initRandom(
     ComputeSystem &cs,
     const std::vector<Int3> &inputSizes,
@@ -101,12 +142,12 @@ void Hierarchy::initRandom(
                 if (inputTypes[p] == InputType::prediction) {
                     pLayers[l][p] = std::make_unique<Predictor>();
 
-                    pLayers[l][p]->initRandom(cs, inputSizes[p], pVisibleLayerDescs);
+                    pLayers[l][p]->initRandom(cs, inputSizes[p], pVisibleLayerDescs, layerDescs[l].valueType);
                 }
                 else if (inputTypes[p] == InputType::action) {
                     aLayers[p] = std::make_unique<Actor>();
 
-                    aLayers[p]->initRandom(cs, inputSizes[p], layerDescs[l].historyCapacity, aVisibleLayerDescs);
+                    aLayers[p]->initRandom(cs, inputSizes[p], layerDescs[l].historyCapacity, aVisibleLayerDescs, layerDescs[l].valueType);
                 }
             }
         }
@@ -141,13 +182,18 @@ void Hierarchy::initRandom(
             for (int p = 0; p < pLayers[l].size(); p++) {
                 pLayers[l][p] = std::make_unique<Predictor>();
 
-                pLayers[l][p]->initRandom(cs, layerDescs[l - 1].hiddenSize, pVisibleLayerDescs);
+                pLayers[l][p]->initRandom(cs, layerDescs[l - 1].hiddenSize, pVisibleLayerDescs, layerDescs[l].valueType);
             }
         }
 		
         // Create the sparse coding layer
-        scLayers[l].initRandom(cs, layerDescs[l].hiddenSize, scVisibleLayerDescs);
+        scLayers[l].initRandom(cs, layerDescs[l].hiddenSize, scVisibleLayerDescs, layerDescs[l].valueType);
     }
+
+    if (arenaMode)
+        packArena();
+
+    mappedFile = nullptr;
 }
 
 const Hierarchy &Hierarchy::operator=(
@@ -170,7 +216,8 @@ const Hierarchy &Hierarchy::operator=(
 
         for (int v = 0; v < pLayers[l].size(); v++) {
             if (other.pLayers[l][v] != nullptr) {
-                pLayers[l][v] = std::make_unique<Predictor>();
+                if (pLayers[l][v] == nullptr)
+                    pLayers[l][v] = std::make_unique<Predictor>();
 
                 (*pLayers[l][v]) = (*other.pLayers[l][v]);
             }
@@ -181,7 +228,8 @@ const Hierarchy &Hierarchy::operator=(
         histories[l].resize(other.histories[l].size());
 
         for (int v = 0; v < histories[l].size(); v++) {
-            histories[l][v] = std::make_unique<IntBuffer>();
+            if (histories[l][v] == nullptr)
+                histories[l][v] = std::make_shared<IntBuffer>();
             
             (*histories[l][v]) = (*other.histories[l][v]);
         }
@@ -191,7 +239,8 @@ const Hierarchy &Hierarchy::operator=(
     
     for (int v = 0; v < aLayers.size(); v++) {
         if (other.aLayers[v] != nullptr) {
-            aLayers[v] = std::make_unique<Actor>();
+            if (aLayers[v] == nullptr)
+                aLayers[v] = std::make_unique<Actor>();
 
             (*aLayers[v]) = (*other.aLayers[v]);
         }
@@ -199,6 +248,21 @@ const Hierarchy &Hierarchy::operator=(
             aLayers[v] = nullptr;
     }
 
+    // Copy assignment keeps the allocators of existing buffers, so buffers may still be (partly) placed in the previous arena.
+    // Move all of them out before the previous arena is released
+    arenaMode = other.arenaMode;
+
+    if (arenaMode)
+        packArena();
+    else if (arena != nullptr) {
+        visitBuffers([&](auto &buffer) { placeInArena(buffer, nullptr); });
+
+        arena = nullptr;
+    }
+
+    // Weights of immutable mappings were shared by the copy
+    mappedFile = other.mappedFile;
+
     return *this;
 }
 
@@ -210,32 +274,29 @@ void Hierarchy::step(
 ) {
     assert(inputCs.size() == inputSizes.size());
 
+    // Quantized and immutably mapped hierarchies are inference only
+    learnEnabled = learnEnabled && !isQuantized() && !isImmutable();
+
     // First tick is always 0
     ticks[0] = 0;
 
+    // Kernel launches are tuned per layer
+    int kernelScopePrev = cs.kernelScope;
+
     // Add input to first layer history   
     {
         int temporalHorizon = histories.front().size() / inputSizes.size();
 
-        std::vector<std::shared_ptr<IntBuffer>> lasts(inputSizes.size());
-        
-        for (int i = 0; i < inputSizes.size(); i++)
-            lasts[i] = histories.front()[temporalHorizon - 1 + temporalHorizon * i];
-  
-        for (int t = temporalHorizon - 1; t > 0; t--) {
-            for (int i = 0; i < inputSizes.size(); i++) {
-                // Shift
-                histories.front()[t + temporalHorizon * i] = histories.front()[(t - 1) + temporalHorizon * i];
-            }
-        }
-
         for (int i = 0; i < inputSizes.size(); i++) {
             assert(inputSizes[i].x * inputSizes[i].y == inputCs[i]->size());
             
-            // Copy
-            runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[i], lasts[i].get()), inputCs[i]->size(), cs.rng, cs.batchSize1);
+            std::vector<std::shared_ptr<IntBuffer>>::iterator first = histories.front().begin() + temporalHorizon * i;
+
+            // Shift, the oldest buffer becomes the newest
+            std::rotate(first, first + temporalHorizon - 1, first + temporalHorizon);
 
-            histories.front()[0 + temporalHorizon * i] = lasts[i];
+            // Copy
+            std::memcpy((*first)->data(), inputCs[i]->data(), inputCs[i]->size() * sizeof(int));
         }
     }
 
@@ -253,24 +314,25 @@ void Hierarchy::step(
             // Updated
             updates[l] = true;
 
+            cs.kernelScope = l;
+
             // Activate sparse coder
-            scLayers[l].step(cs, constGet(histories[l]), learnEnabled);
+            layerInputCs.resize(histories[l].size());
+
+            for (std::size_t i = 0; i < histories[l].size(); i++)
+                layerInputCs[i] = histories[l][i].get();
+
+            scLayers[l].step(cs, layerInputCs, learnEnabled);
 
             // Add to next layer's history
             if (l < scLayers.size() - 1) {
                 int lNext = l + 1;
 
-                int temporalHorizon = histories[lNext].size();
-
-                std::shared_ptr<IntBuffer> last = histories[lNext].back();
-
-                for (int t = temporalHorizon - 1; t > 0; t--)
-                    histories[lNext][t] = histories[lNext][t - 1];
+                // Shift, the oldest buffer becomes the newest
+                std::rotate(histories[lNext].begin(), histories[lNext].end() - 1, histories[lNext].end());
 
                 // Copy
-                runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, &scLayers[l].getHiddenCs(), last.get()), scLayers[l].getHiddenCs().size(), cs.rng, cs.batchSize1);
-
-                histories[lNext].front() = last;
+                std::memcpy(histories[lNext].front()->data(), scLayers[l].getHiddenCs().data(), scLayers[l].getHiddenCs().size() * sizeof(int));
 
                 ticks[lNext]++;
             }
@@ -281,40 +343,167 @@ void Hierarchy::step(
     for (int l = scLayers.size() - 1; l >= 0; l--) {
         if (updates[l]) {
             // Feed back is current layer state and next higher layer prediction
-            std::vector<const IntBuffer*> feedBackCs(l < scLayers.size() - 1 ? 2 : 1);
+            bool hasNext = l < static_cast<int>(scLayers.size()) - 1;
+
+            feedBackCs.resize(hasNext ? 2 : 1);
 
             feedBackCs[0] = &scLayers[l].getHiddenCs();
 
-            if (l < scLayers.size() - 1) {
+            if (hasNext) {
                 assert(pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]] != nullptr);
 
                 feedBackCs[1] = &pLayers[l + 1][ticksPerUpdate[l + 1] - 1 - ticks[l + 1]]->getHiddenCs();
             }
 
-            // Step actor layers
-            for (int p = 0; p < pLayers[l].size(); p++) {
-                if (pLayers[l][p] != nullptr) {
+            // Predictors and actors of a layer are independent, run them together. Tasks are the predictors, then the actors (first layer)
+            int numPredictors = pLayers[l].size();
+            int numActors = l == 0 ? aLayers.size() : 0;
+
+            cs.kernelScope = l;
+
+            runTasks(cs, numPredictors + numActors, [&](int task, PhiloxRNG &taskRng) {
+                if (task < numPredictors) {
+                    int p = task;
+
+                    if (pLayers[l][p] == nullptr)
+                        return;
+
                     if (learnEnabled)
-                        pLayers[l][p]->learn(cs, l == 0 ? inputCs[p] : histories[l][p].get());
+                        pLayers[l][p]->learn(cs, l == 0 ? inputCs[p] : histories[l][p].get(), taskRng);
 
-                    pLayers[l][p]->activate(cs, feedBackCs);
+                    pLayers[l][p]->activate(cs, feedBackCs, taskRng);
                 }
-            }
+                else {
+                    int p = task - numPredictors;
 
-            if (l == 0) {
-                // Step actors
-                for (int p = 0; p < aLayers.size(); p++) {
                     if (aLayers[p] != nullptr)
-                        aLayers[p]->step(cs, feedBackCs, inputCs[p], reward, learnEnabled);
+                        aLayers[p]->step(cs, feedBackCs, inputCs[p], reward, learnEnabled, taskRng);
                 }
-            }
+            });
         }
     }
+
+    cs.kernelScope = kernelScopePrev;
+}
+
+template <typename F>
+void Hierarchy::visitBuffers(
+    const F &func
+) {
+    // Forward pass, bottom up
+    for (std::size_t l = 0; l < scLayers.size(); l++) {
+        for (std::size_t v = 0; v < histories[l].size(); v++)
+            func(*histories[l][v]);
+
+        scLayers[l].visitBuffers(func);
+    }
+
+    // Backward pass, top down
+    for (int l = scLayers.size() - 1; l >= 0; l--) {
+        for (std::size_t p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr)
+                pLayers[l][p]->visitBuffers(func);
+        }
+    }
+
+    for (std::size_t p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr)
+            aLayers[p]->visitBuffers(func);
+    }
+}
+
+void Hierarchy::setArenaMode(
+    bool enabled
+) {
+    arenaMode = enabled;
+
+    if (arenaMode)
+        packArena();
+    else if (arena != nullptr) {
+        visitBuffers([&](auto &buffer) { placeInArena(buffer, nullptr); });
+
+        arena = nullptr;
+    }
+}
+
+void Hierarchy::packArena(
+    size_t headroom
+) {
+    size_t size = headroom;
+
+    visitBuffers([&](auto &buffer) { size += Arena::getPaddedSize(buffer.size() * sizeof(buffer[0])); });
+
+    std::shared_ptr<Arena> packed = std::make_shared<Arena>(size);
+
+    visitBuffers([&](auto &buffer) { placeInArena(buffer, packed.get()); });
+
+    // Releases the previous arena, nothing is placed in it anymore
+    arena = packed;
+}
+
+void Hierarchy::quantize() {
+    for (std::size_t l = 0; l < scLayers.size(); l++) {
+        scLayers[l].quantize();
+
+        for (std::size_t p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr)
+                pLayers[l][p]->quantize();
+        }
+    }
+
+    for (std::size_t p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr)
+            aLayers[p]->quantize();
+    }
+}
+
+void Hierarchy::prune(
+    float threshold,
+    int keepPerGroup
+) {
+    for (std::size_t l = 0; l < scLayers.size(); l++) {
+        scLayers[l].prune(threshold, keepPerGroup);
+
+        for (std::size_t p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr)
+                pLayers[l][p]->prune(threshold, keepPerGroup);
+        }
+    }
+
+    for (std::size_t p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr)
+            aLayers[p]->prune(threshold, keepPerGroup);
+    }
+
+    // The compacted weights were allocated off the arena
+    if (arenaMode)
+        packArena();
+}
+
+void Hierarchy::placeWeights(
+    ComputeSystem &cs
+) {
+    for (std::size_t l = 0; l < scLayers.size(); l++) {
+        scLayers[l].placeWeights(cs);
+
+        for (std::size_t p = 0; p < pLayers[l].size(); p++) {
+            if (pLayers[l][p] != nullptr)
+                pLayers[l][p]->placeWeights(cs);
+        }
+    }
+
+    for (std::size_t p = 0; p < aLayers.size(); p++) {
+        if (aLayers[p] != nullptr)
+            aLayers[p]->placeWeights(cs);
+    }
 }
 
 void Hierarchy::writeToStream(
     std::ostream &os
 ) const {
+    os.write(reinterpret_cast<const char*>(&streamMagic), sizeof(int));
+    os.write(reinterpret_cast<const char*>(&streamVersion), sizeof(int));
+
     int numLayers = scLayers.size();
 
     os.write(reinterpret_cast<const char*>(&numLayers), sizeof(int));
@@ -363,13 +552,14 @@ void Hierarchy::writeToStream(
     }
 }
 
-void Hierarchy::readFromStream(
+void Hierarchy::readLayersFromStream(
     std::istream &is
 ) {
-    int numLayers;
+    int numLayers = 0;
+
     is.read(reinterpret_cast<char*>(&numLayers), sizeof(int));
 
-    int numInputs;
+    int numInputs = 0;
 
     is.read(reinterpret_cast<char*>(&numInputs), sizeof(int));
 
@@ -394,7 +584,10 @@ void Hierarchy::readFromStream(
     is.read(reinterpret_cast<char*>(ticksPerUpdate.data()), ticksPerUpdate.size() * sizeof(int));
     
     for (int l = 0; l < numLayers; l++) {
-        int numHistorySizes;
+        if (!is)
+            return;
+
+        int numHistorySizes = 0;
         
         is.read(reinterpret_cast<char*>(&numHistorySizes), sizeof(int));
         historySizes[l].resize(numHistorySizes);
@@ -414,7 +607,7 @@ void Hierarchy::readFromStream(
 
         // Predictors
         for (int v = 0; v < pLayers[l].size(); v++) {
-            char exists;
+            char exists = 0;
 
             is.read(reinterpret_cast<char*>(&exists), sizeof(char));
 
@@ -431,7 +624,7 @@ void Hierarchy::readFromStream(
     aLayers.resize(inputSizes.size());
 
     for (int v = 0; v < aLayers.size(); v++) {
-        char exists;
+        char exists = 0;
 
         is.read(reinterpret_cast<char*>(&exists), sizeof(char));
 
@@ -442,6 +635,169 @@ void Hierarchy::readFromStream(
         else
             aLayers[v] = nullptr;
     }
+
+}
+
+void Hierarchy::readFromStream(
+    std::istream &is
+) {
+    int magic = 0;
+    int version = 0;
+
+    is.read(reinterpret_cast<char*>(&magic), sizeof(int));
+    is.read(reinterpret_cast<char*>(&version), sizeof(int));
+
+    if (magic != streamMagic || version != streamVersion) {
+        is.setstate(std::ios::failbit);
+
+        return;
+    }
+
+    // Read into a separate hierarchy, so that this one is only changed once the whole stream has been read
+    {
+        Hierarchy read;
+
+        read.readLayersFromStream(is);
+
+        if (!is)
+            return;
+
+        scLayers = std::move(read.scLayers);
+        pLayers = std::move(read.pLayers);
+        aLayers = std::move(read.aLayers);
+        histories = std::move(read.histories);
+        historySizes = std::move(read.historySizes);
+        updates = std::move(read.updates);
+        ticks = std::move(read.ticks);
+        ticksPerUpdate = std::move(read.ticksPerUpdate);
+        inputSizes = std::move(read.inputSizes);
+    }
+
+    // The previous layers are released, nothing is placed in the previous arena anymore
+    if (arenaMode)
+        packArena();
+    else
+        arena = nullptr;
+
+    // Weights were copied (or refer to the sections of a file being mapped, see mapFile)
+    mappedFile = nullptr;
+}
+
+bool Hierarchy::writeToFile(
+    const std::string &path
+) const {
+    FileSections sections;
+
+    std::ostringstream structure;
+
+    setStreamSections(structure, &sections);
+
+    writeToStream(structure);
+
+    setStreamSections(structure, nullptr);
+
+    std::string structureData = structure.str();
+
+    FileHeader header;
+
+    std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.version = fileVersion;
+    header.numSections = sections.data.size() + 1;
+    header.structureSection = sections.add(structureData.data(), structureData.size());
+    header.reserved = 0;
+    header.directoryOffset = sizeof(FileHeader);
+
+    std::vector<FileSectionEntry> directory(header.numSections);
+
+    long long offset = Arena::getPaddedSize(header.directoryOffset + directory.size() * sizeof(FileSectionEntry));
+
+    for (std::size_t i = 0; i < directory.size(); i++) {
+        directory[i].offset = offset;
+        directory[i].size = sections.sizes[i];
+
+        offset += Arena::getPaddedSize(sections.sizes[i]);
+    }
+
+    std::string tempPath = path + ".tmp";
+
+    std::ofstream os(tempPath, std::ios::binary);
+
+    os.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+    os.write(reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(FileSectionEntry));
+
+    const char padding[Arena::alignment] = {};
+
+    for (std::size_t i = 0; i < directory.size(); i++) {
+        long long position = os.tellp();
+
+        os.write(padding, directory[i].offset - position);
+        os.write(sections.data[i], sections.sizes[i]);
+    }
+
+    os.close();
+
+    if (!os || std::rename(tempPath.c_str(), path.c_str()) != 0) {
+        std::remove(tempPath.c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+bool Hierarchy::mapFile(
+    const std::string &path,
+    bool learnable
+) {
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+
+    if (!file->open(path, learnable) || file->getSize() < sizeof(FileHeader))
+        return false;
+
+    const FileHeader* header = reinterpret_cast<const FileHeader*>(file->getData());
+
+    if (std::memcmp(header->magic, fileMagic, sizeof(fileMagic)) != 0 || header->version != fileVersion)
+        return false;
+
+    long long fileSize = file->getSize();
+
+    // Sizes are compared as fileSize - offset, so that corrupt offsets and sizes can't overflow
+    if (header->numSections <= 0 || header->structureSection < 0 || header->structureSection >= header->numSections ||
+        header->directoryOffset < static_cast<long long>(sizeof(FileHeader)) || header->directoryOffset > fileSize ||
+        static_cast<long long>(header->numSections) * static_cast<long long>(sizeof(FileSectionEntry)) > fileSize - header->directoryOffset)
+        return false;
+
+    const FileSectionEntry* directory = reinterpret_cast<const FileSectionEntry*>(file->getData() + header->directoryOffset);
+
+    FileSections sections;
+
+    sections.immutable = !learnable;
+
+    for (int i = 0; i < header->numSections; i++) {
+        // Sections are aligned (see writeToFile), values are read from them in place
+        if (directory[i].offset < 0 || directory[i].size < 0 || directory[i].offset % Arena::alignment != 0 ||
+            directory[i].offset > fileSize || directory[i].size > fileSize - directory[i].offset)
+            return false;
+
+        sections.add(file->getData() + directory[i].offset, directory[i].size);
+    }
+
+    // Only the structure is parsed (and copied), matrices refer to the other sections
+    MemoryStreamBuf buffer(sections.data[header->structureSection], sections.sizes[header->structureSection]);
+
+    std::istream is(&buffer);
+
+    setStreamSections(is, &sections);
+
+    readFromStream(is);
+
+    // The sections didn't match the structure, this hierarchy is unchanged (see readFromStream)
+    if (!is)
+        return false;
+
+    mappedFile = file;
+
+    return true;
 }
 
 void Hierarchy::getState(
@@ -500,4 +856,48 @@ void Hierarchy::setState(
 
     ticks = state.ticks;
     updates = state.updates;
+}
+
+float ogmaneo::getPredictionAgreement(
+    ComputeSystem &cs,
+    const Hierarchy &reference,
+    const Hierarchy &other,
+    const std::vector<std::vector<IntBuffer>> &inputStream
+) {
+    Hierarchy h0 = reference;
+    Hierarchy h1 = other;
+
+    int numAgree = 0;
+    int numTotal = 0;
+
+    for (std::size_t t = 0; t < inputStream.size(); t++) {
+        std::vector<const IntBuffer*> inputCs(inputStream[t].size());
+
+        for (std::size_t i = 0; i < inputCs.size(); i++)
+            inputCs[i] = &inputStream[t][i];
+
+        // Both see the same random numbers (actor sampling)
+        std::mt19937 rngStart = cs.rng;
+
+        h0.step(cs, inputCs, false);
+
+        cs.rng = rngStart;
+
+        h1.step(cs, inputCs, false);
+
+        for (std::size_t i = 0; i < h0.getInputSizes().size(); i++) {
+            if (h0.getALayers()[i] == nullptr && h0.getPLayers(0)[i] == nullptr)
+                continue;
+
+            const IntBuffer &cs0 = h0.getPredictionCs(i);
+            const IntBuffer &cs1 = h1.getPredictionCs(i);
+
+            for (std::size_t j = 0; j < cs0.size(); j++)
+                numAgree += cs0[j] == cs1[j];
+
+            numTotal += cs0.size();
+        }
+    }
+
+    return static_cast<float>(numAgree) / std::max(1, numTotal);
 }
\ No newline at end of file
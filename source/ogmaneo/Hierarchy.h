@@ -11,6 +11,7 @@
 #include "SparseCoder.h"
 #include "Predictor.h"
 #include "Actor.h"
+#include "MappedFile.h"
 
 #include <memory>
 
@@ -52,6 +53,8 @@ public:
         int aRadius;
         int historyCapacity;
 
+        ValueType valueType; // Storage type of the weights of all layers created for this descriptor, not int8 (see quantize)
+
         LayerDesc()
         :
         hiddenSize(4, 4, 16),
@@ -60,10 +63,19 @@ public:
         ticksPerUpdate(2),
         temporalHorizon(2),
         aRadius(2),
-        historyCapacity(32)
+        historyCapacity(32),
+        valueType(float32)
         {}
     };
 private:
+    // File the weights refer to if loaded with mapFile, shared with copies. Declared first, so it is unmapped after the weights are released
+    std::shared_ptr<MappedFile> mappedFile;
+
+    // Arena holding all layer state and weights in arena mode. Declared first, so it is destroyed after the buffers placed in it
+    std::shared_ptr<Arena> arena;
+
+    bool arenaMode;
+
     // Layers
     std::vector<SparseCoder> scLayers;
     std::vector<std::vector<std::unique_ptr<Predictor>>> pLayers;
@@ -82,14 +94,35 @@ private:
     // Input dimensions
     std::vector<Int3> inputSizes;
 
+    // Step scratch, refilled every step (capacity is kept so that steady-state steps don't allocate)
+    std::vector<const IntBuffer*> layerInputCs;
+    std::vector<const IntBuffer*> feedBackCs;
+
+    // Call func on each buffer of layer state and weights, in the order a step accesses them
+    template <typename F>
+    void visitBuffers(
+        const F &func
+    );
+
+    // Read the layers and per-layer values written after the header by writeToStream. Stops early if the stream fails
+    void readLayersFromStream(
+        std::istream &is
+    );
+
 public:
     // Default
-    Hierarchy() {}
+    Hierarchy()
+    :
+    arenaMode(false)
+    {}
 
     // Copy
     Hierarchy(
         const Hierarchy &other // Hierarchy to copy from
-    ) {
+    )
+    :
+    arenaMode(false)
+    {
         *this = other;
     }
 
@@ -129,11 +162,82 @@ public:
         std::ostream &os // Stream to write to
     ) const;
 
-    // Read from stream
+    // Read from stream. Streams of another layout version (or that end early) are rejected: the failbit of the stream is set
+    // and the hierarchy is left unchanged
     void readFromStream(
         std::istream &is // Stream to read from
     );
 
+    // Write to a file that can be loaded with mapFile: a header, a section directory, and sections aligned to Arena::alignment
+    // holding the values of each weight matrix and the rest of the hierarchy (as written by writeToStream). Returns false on failure.
+    // The file is written next to path and renamed over it, so processes that mapped a previous version keep a consistent copy
+    bool writeToFile(
+        const std::string &path // Path of the file
+    ) const;
+
+    // Load a file written by writeToFile by mapping it. Weights are used in place: pages are read from the file on first access
+    // and shared between all processes mapping it, the rest of the hierarchy is copied. Returns false if the file can't be opened,
+    // is not a supported version or is inconsistent (sections outside the file or not matching their matrices), leaving the hierarchy unchanged. If learnable, the mapping is copy-on-write (changed pages
+    // are copied into this process and never written back), otherwise the weights are immutable and steps don't learn
+    bool mapFile(
+        const std::string &path, // Path of the file
+        bool learnable = false // Whether the weights may change
+    );
+
+    // Whether the weights refer to a mapped file (see mapFile)
+    bool isMapped() const {
+        return mappedFile != nullptr;
+    }
+
+    // Whether the weights may not change (mapped without learnable, or quantized), steps don't learn
+    bool isImmutable() const {
+        return !scLayers.empty() && scLayers.front().getVisibleLayer(0).weights.immutable;
+    }
+
+    // Convert all weights to int8 and drop learning-only data, producing a frozen inference model
+    void quantize();
+
+    // Remove the weights of all layers whose magnitude is below threshold and, if keepPerGroup > 0, all but the keepPerGroup largest per visible column.
+    // Only the remaining weights are stored, with a mask of them per visible cell (see SparseMatrix::prune), and the layers skip the removed ones,
+    // so pruned hierarchies are smaller and step faster. Check the result with getPredictionAgreement.
+    // The remaining weights are moved to new buffers, call placeWeights afterwards when running on several NUMA nodes
+    void prune(
+        float threshold, // Smallest weight magnitude to keep
+        int keepPerGroup = 0 // Weights to keep per visible column of each weight row, 0 to keep all above threshold
+    );
+
+    // Move the weights of all layers to the NUMA nodes that run them (see ComputeSystem::setNUMA).
+    // Layers place their weights when created, call after readFromStream, copying or prune
+    void placeWeights(
+        ComputeSystem &cs // Compute system
+    );
+
+    // In arena mode all layer state and weights are kept in one aligned, huge-page backed block, in the order a step accesses them.
+    // The hierarchy is packed now and after initRandom, readFromStream and copies. Disabling moves everything back to the heap
+    void setArenaMode(
+        bool enabled // Whether to use an arena
+    );
+
+    bool getArenaMode() const {
+        return arenaMode;
+    }
+
+    // (Re)pack all layer state and weights into a new arena sized to fit them exactly plus headroom.
+    // Buffers that later outgrow the arena fall back to the heap
+    void packArena(
+        size_t headroom = 0 // Extra bytes
+    );
+
+    // Arena in use, nullptr if not in arena mode. Its capacity is the memory used by the layer state and weights
+    const Arena* getArena() const {
+        return arena.get();
+    }
+
+    // Whether the hierarchy has been quantized (frozen)
+    bool isQuantized() const {
+        return !scLayers.empty() && scLayers.front().getVisibleLayer(0).weights.valueType == int8;
+    }
+
     // Get the number of layers (scLayers)
     int getNumLayers() const {
         return scLayers.size();
@@ -213,4 +317,13 @@ public:
         return aLayers;
     }
 };
+
+// Fraction of prediction columns (getPredictionCs) on which two hierarchies agree when stepped without learning over a recorded input stream.
+// Used to report the accuracy of a quantized or pruned hierarchy against its original. Both are copied, so their states are left untouched
+float getPredictionAgreement(
+    ComputeSystem &cs, // Compute system
+    const Hierarchy &reference, // Reference hierarchy, e.g. fp32
+    const Hierarchy &other, // Hierarchy to compare, e.g. quantized or pruned
+    const std::vector<std::vector<IntBuffer>> &inputStream // Recorded input column states, one vector of input layers per step
+);
 } // namespace ogmaneo
@@ -16,9 +16,36 @@ bool pairfiCompare(const std::pair<float, int> &lhs, const std::pair<float, int>
     return lhs.first > rhs.first; // Backwards so largest is in front
 }
 
+void ImageEncoder::initScales() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    hiddenScales.resize(numHiddenColumns);
+
+    for (int x = 0; x < hiddenSize.x; x++)
+        for (int y = 0; y < hiddenSize.y; y++) {
+            int count = 0;
+
+            for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+                count += visibleLayers[vli].weights.countFields(Int2(x, y)) * visibleLayerDescs[vli].size.z;
+
+            hiddenScales[address2(Int2(x, y), Int2(hiddenSize.x, hiddenSize.y))] = 1.0f / std::max(1, count);
+        }
+
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        vl.visibleScales.resize(vld.size.x * vld.size.y);
+
+        for (int x = 0; x < vld.size.x; x++)
+            for (int y = 0; y < vld.size.y; y++)
+                vl.visibleScales[address2(Int2(x, y), Int2(vld.size.x, vld.size.y))] = 1.0f / std::max(1, vl.weights.countFieldsT(Int2(x, y)));
+    }
+}
+
 void ImageEncoder::forward(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const std::vector<const FloatBuffer*> &inputActs,
     bool learnEnabled
 ) {
@@ -27,13 +54,14 @@ void ImageEncoder::forward(
     int maxIndex = 0;
     float maxActivation = -999999.0f;
 
-    std::vector<std::pair<float, int>> activations(hiddenSize.z);
+    std::pair<float, int>* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
+
+    float scale = hiddenScales[hiddenColumnIndex];
 
     for (int hc = 0; hc < hiddenSize.z; hc++) {
         int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
 
         float sum = 0.0f;
-        int count = 0;
 
         // For each visible layer
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -41,10 +69,9 @@ void ImageEncoder::forward(
             const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
             sum -= vl.weights.distance2(*inputActs[vli], hiddenIndex);
-            count += vl.weights.count(hiddenIndex);
         }
 
-        sum /= std::max(1, count);
+        sum *= scale;
 
         activations[hc] = std::make_pair(sum, hc);
 
@@ -57,7 +84,7 @@ void ImageEncoder::forward(
     hiddenCs[hiddenColumnIndex] = maxIndex;
 
     if (learnEnabled) {
-        std::sort(activations.begin(), activations.end(), pairfiCompare);
+        std::sort(activations, activations + hiddenSize.z, pairfiCompare);
 
         for (int i = 0; i < hiddenSize.z; i++) {
             int hiddenIndex = address3(Int3(pos.x, pos.y, activations[i].second), hiddenSize);
@@ -79,7 +106,7 @@ void ImageEncoder::forward(
 
 void ImageEncoder::backward(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const IntBuffer* hiddenCs,
     int vli
 ) {
@@ -88,19 +115,20 @@ void ImageEncoder::backward(
 
     int visibleColumnIndex = address2(pos, Int2(vld.size.x, vld.size.y));
 
-    for (int vc = 0; vc < vld.size.z; vc++) {
-        int visibleIndex = address3(Int3(pos.x, pos.y, vc), vld.size);
+    float scale = vl.visibleScales[visibleColumnIndex];
 
-        float sum = vl.weights.multiplyOHVsT(*hiddenCs, visibleIndex, hiddenSize.z) / std::max(1, vl.weights.countT(visibleIndex) / hiddenSize.z);
+    float* reconActs = &vl.reconActs[visibleColumnIndex * vld.size.z];
 
-        vl.reconActs[visibleIndex] = sum;
-    }
+    std::fill(reconActs, reconActs + vld.size.z, 0.0f);
+
+    vl.weights.multiplyOHVsColumnT(*hiddenCs, visibleColumnIndex, hiddenSize.z, reconActs, scale);
 }
 
 void ImageEncoder::initRandom(
     ComputeSystem &cs,
     const Int3 &hiddenSize,
-    const std::vector<VisibleLayerDesc> &visibleLayerDescs
+    const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+    ValueType valueType
 ) {
     this->visibleLayerDescs = visibleLayerDescs;
 
@@ -112,7 +140,6 @@ void ImageEncoder::initRandom(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    std::uniform_real_distribution<float> weightDist(0.0f, 1.0f);
 
     // Create layers
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -125,11 +152,9 @@ void ImageEncoder::initRandom(
         // Create weight matrix for this visible layer and initialize randomly
         initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
 
-        for (int i = 0; i < vl.weights.nonZeroValues.size(); i++)
-            vl.weights.nonZeroValues[i] = weightDist(cs.rng);
+        initSMUniform(cs, vl.weights, 0.0f, 1.0f, cs.rng);
 
-        // Generate transpose (needed for reconstruction)
-        vl.weights.initT();
+        vl.weights.setValueType(initValueType(valueType));
 
         vl.reconActs = FloatBuffer(numVisible, 0.0f);
     }
@@ -138,6 +163,12 @@ void ImageEncoder::initRandom(
     hiddenCs = IntBuffer(numHiddenColumns, 0);
 
     hiddenResources = FloatBuffer(numHidden, 1.0f);
+
+    hiddenActivations.resize(numHidden);
+
+    initScales();
+
+    placeWeights(cs);
 }
 
 void ImageEncoder::step(
@@ -148,7 +179,14 @@ void ImageEncoder::step(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    runKernel2(cs, std::bind(ImageEncoder::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputActs, learnEnabled), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    // Learning happens in the forward kernel
+    bool stochasticRounding = false;
+
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+        stochasticRounding |= learnEnabled && visibleLayers[vli].weights.roundsStochastically();
+
+    runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { forward(pos, rng, inputActs, learnEnabled); }, Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2, "ImageEncoder::forward",
+        stochasticRounding);
 }
 
 void ImageEncoder::reconstruct(
@@ -159,7 +197,24 @@ void ImageEncoder::reconstruct(
         VisibleLayer &vl = visibleLayers[vli];
         VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        runKernel2(cs, std::bind(ImageEncoder::backwardKernel, std::placeholders::_1, std::placeholders::_2, this, hiddenCs, vli), Int2(vld.size.x, vld.size.y), cs.rng, cs.batchSize2);
+        // There are no int8 transpose kernels
+        if (vl.weights.valueType == int8)
+            continue;
+
+        // The transpose is only needed here, so it is built on the first reconstruction
+        vl.weights.requireT();
+
+        runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { backward(pos, rng, hiddenCs, vli); }, Int2(vld.size.x, vld.size.y), cs.rng, cs.batchSize2, "ImageEncoder::backward");
+    }
+}
+
+void ImageEncoder::placeWeights(
+    ComputeSystem &cs
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        placeSMColumns(cs, vl.weights, Int2(hiddenSize.x, hiddenSize.y));
     }
 }
 
@@ -205,7 +260,9 @@ void ImageEncoder::readFromStream(
     readBufferFromStream(is, &hiddenCs);
     readBufferFromStream(is, &hiddenResources);
 
-    int numVisibleLayers;
+    hiddenActivations.resize(numHidden);
+
+    int numVisibleLayers = 0;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
 
@@ -225,4 +282,6 @@ void ImageEncoder::readFromStream(
 
         vl.reconActs = FloatBuffer(numVisible, 0.0f);
     }
+
+    initScales();
 }
\ No newline at end of file
@@ -33,6 +33,9 @@ public:
         SparseMatrix weights; // Weight matrix
 
         FloatBuffer reconActs;
+
+        // Normalization multiplier of each visible column (1 / hidden columns whose receptive fields contain it), derived from the geometry
+        FloatBuffer visibleScales;
     };
 
 private:
@@ -42,46 +45,34 @@ private:
 
     FloatBuffer hiddenResources; // Resources
 
+    // Normalization multiplier of each hidden column (1 / weights in the receptive fields of all visible layers), derived from the geometry
+    FloatBuffer hiddenScales;
+
+    // Forward kernel scratch (activation, cell) pairs, a slice of hiddenSize.z per hidden column, allocated once so that steps don't allocate
+    std::vector<std::pair<float, int>> hiddenActivations;
+
     // Visible layers and associated descriptors
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
     
+    void initScales();
+    
     // --- Kernels ---
     
     void forward(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const std::vector<const FloatBuffer*> &inputActs,
         bool learnEnabled
     );
 
     void backward(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const IntBuffer* hiddenCs,
         int vli
     );
 
-    static void forwardKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        ImageEncoder* sc,
-        const std::vector<const FloatBuffer*> &inputActs,
-        bool learnEnabled
-    ) {
-        sc->forward(pos, rng, inputActs, learnEnabled);
-    }
-
-    static void backwardKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        ImageEncoder* sc,
-        const IntBuffer* hiddenCs,
-        int vli
-    ) {
-        sc->backward(pos, rng, hiddenCs, vli);
-    }
-
 public:
     float alpha; // Resource depletion rate
     float gamma; // Gas falloff
@@ -97,7 +88,8 @@ public:
     void initRandom(
         ComputeSystem &cs, // Compute system
         const Int3 &hiddenSize, // Hidden/output size
-        const std::vector<VisibleLayerDesc> &visibleLayerDescs // Descriptors for visible layers
+        const std::vector<VisibleLayerDesc> &visibleLayerDescs, // Descriptors for visible layers
+        ValueType valueType = float32 // Storage type of the weights, not int8 (inference only)
     );
 
     // Activate the sparse coder (perform sparse coding)
@@ -112,6 +104,29 @@ public:
         const IntBuffer* hiddenCs
     );
 
+    // Move the weights to the NUMA nodes whose threads run their hidden columns (see ComputeSystem::setNUMA).
+    // Done by initRandom, call after reading or copying a layer
+    void placeWeights(
+        ComputeSystem &cs // Compute system
+    );
+
+    // Call func on each buffer of layer state and weights, in the order a step uses them
+    template <typename F>
+    void visitBuffers(
+        const F &func // Called with each buffer
+    ) {
+        for (int vli = 0; vli < visibleLayers.size(); vli++) {
+            visibleLayers[vli].weights.visitBuffers(func);
+
+            func(visibleLayers[vli].visibleScales);
+            func(visibleLayers[vli].reconActs);
+        }
+
+        func(hiddenScales);
+        func(hiddenResources);
+        func(hiddenCs);
+    }
+
     // Write to stream
     void writeToStream(
         std::ostream &os // Stream to write to
@@ -141,6 +156,27 @@ public:
         return visibleLayerDescs[i];
     }
 
+    // Receptive field of a hidden column in a visible layer, clamped to the visible layer (inclusive bounds)
+    void getFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &hiddenPos, // Position of hidden column
+        Int2 &lowerBound, // Lower bound of the field
+        Int2 &upperBound // Upper bound of the field
+    ) const {
+        visibleLayers[vli].weights.getFieldBounds(hiddenPos, lowerBound, upperBound);
+    }
+
+    // Range of hidden columns whose receptive fields in a visible layer contain a visible column
+    // (inclusive bounds, lower > upper if there are none)
+    void getReverseFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &visiblePos, // Position of visible column
+        Int2 &lowerBound, // Lower bound of the range
+        Int2 &upperBound // Upper bound of the range
+    ) const {
+        visibleLayers[vli].weights.getReverseFieldBounds(visiblePos, lowerBound, upperBound);
+    }
+
     // Get the hidden states
     const IntBuffer &getHiddenCs() const {
         return hiddenCs;
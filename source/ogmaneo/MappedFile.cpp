@@ -0,0 +1,99 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "MappedFile.h"
+
+#include "Arena.h"
+
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace ogmaneo;
+
+bool MappedFile::open(
+    const std::string &path,
+    bool writable
+) {
+    close();
+
+#ifdef _WIN32
+    std::ifstream is(path, std::ios::binary | std::ios::ate);
+
+    if (!is.is_open())
+        return false;
+
+    size = is.tellg();
+
+    if (size == 0)
+        return false;
+
+    data = static_cast<char*>(allocateAligned(size));
+
+    is.seekg(0);
+    is.read(data, size);
+
+    if (!is) {
+        close();
+
+        return false;
+    }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd == -1)
+        return false;
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+
+        return false;
+    }
+
+    // Private mappings may be written to even though the file is opened read-only
+    void* p = mmap(nullptr, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+
+    // The mapping keeps the file open
+    ::close(fd);
+
+    if (p == MAP_FAILED)
+        return false;
+
+    data = static_cast<char*>(p);
+    size = st.st_size;
+    mapped = true;
+#endif
+
+    this->writable = writable;
+
+    return true;
+}
+
+void MappedFile::close() {
+    if (data == nullptr)
+        return;
+
+#ifndef _WIN32
+    if (mapped)
+        munmap(data, size);
+    else
+#endif
+        freeAligned(data);
+
+    data = nullptr;
+    size = 0;
+    mapped = false;
+    writable = false;
+}
\ No newline at end of file
@@ -0,0 +1,74 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+namespace ogmaneo {
+// Memory mapping of a whole file. Pages are read on first access and shared with all processes mapping the same file.
+// Where mapping isn't supported, the file is read into aligned memory instead
+class MappedFile {
+private:
+    char* data;
+    std::size_t size;
+
+    bool mapped; // Whether data is a mapping, rather than a copy
+    bool writable;
+
+public:
+    MappedFile()
+    :
+    data(nullptr),
+    size(0),
+    mapped(false),
+    writable(false)
+    {}
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(
+        const MappedFile &other
+    ) = delete;
+
+    MappedFile &operator=(
+        const MappedFile &other
+    ) = delete;
+
+    // Map a file, returns false if it can't be opened. Writable mappings are copy-on-write:
+    // changed pages are copied into memory of this process and never written back to the file
+    bool open(
+        const std::string &path, // Path of the file
+        bool writable // Whether the memory may be changed
+    );
+
+    // Unmap, leaving nothing mapped
+    void close();
+
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    // Start of the file, page aligned
+    char* getData() const {
+        return data;
+    }
+
+    // Size of the file in bytes
+    std::size_t getSize() const {
+        return size;
+    }
+
+    bool isWritable() const {
+        return writable;
+    }
+};
+} // namespace ogmaneo
\ No newline at end of file
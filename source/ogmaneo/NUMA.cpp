@@ -0,0 +1,192 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "NUMA.h"
+
+#include "ComputeSystem.h"
+
+#include <fstream>
+#include <string>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace ogmaneo;
+
+// Parse a sysfs list such as "0-3,8-11"
+static std::vector<int> parseList(
+    const std::string &list
+) {
+    std::vector<int> values;
+
+    std::size_t pos = 0;
+
+    while (pos < list.length()) {
+        std::size_t end = list.find(',', pos);
+
+        if (end == std::string::npos)
+            end = list.length();
+
+        std::string range = list.substr(pos, end - pos);
+
+        std::size_t dash = range.find('-');
+
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+
+        for (int v = first; v <= last; v++)
+            values.push_back(v);
+
+        pos = end + 1;
+    }
+
+    return values;
+}
+
+static bool readList(
+    const std::string &path,
+    std::vector<int> &values
+) {
+    std::ifstream file(path);
+
+    std::string list;
+
+    if (!std::getline(file, list) || list.empty())
+        return false;
+
+    values = parseList(list);
+
+    return true;
+}
+
+NUMATopology ogmaneo::readNUMATopology() {
+    NUMATopology topology;
+
+    std::vector<int> nodes;
+
+    if (readList("/sys/devices/system/node/online", nodes)) {
+        for (std::size_t i = 0; i < nodes.size(); i++) {
+            std::vector<int> cpus;
+
+            if (readList("/sys/devices/system/node/node" + std::to_string(nodes[i]) + "/cpulist", cpus))
+                topology.nodeCPUs.push_back(cpus);
+        }
+    }
+
+    // No (usable) NUMA information, one node with all CPUs
+    if (topology.nodeCPUs.empty())
+        topology.nodeCPUs.resize(1);
+
+    return topology;
+}
+
+void ogmaneo::pinOpenMPThreads(
+    const NUMATopology &topology
+) {
+#ifdef __linux__
+    if (topology.getNumNodes() < 2)
+        return;
+
+    #pragma omp parallel
+    {
+        int node = getThreadNode(omp_get_thread_num(), omp_get_num_threads(), topology.getNumNodes());
+
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+
+        for (std::size_t i = 0; i < topology.nodeCPUs[node].size(); i++)
+            CPU_SET(topology.nodeCPUs[node][i], &set);
+
+        sched_setaffinity(0, sizeof(cpu_set_t), &set);
+    }
+#endif
+}
+
+void ogmaneo::placeSMColumns(
+    const ComputeSystem &cs,
+    SparseMatrix &mat,
+    const Int2 &size
+) {
+#ifdef __linux__
+    // External values may be shared with other processes, they stay where their owner put them
+    if (cs.numa == nullptr || cs.numa->getNumNodes() < 2 || mat.isView())
+        return;
+
+    int numNodes = cs.numa->getNumNodes();
+
+    char* values;
+    int valueSize;
+
+    switch (mat.valueType) {
+    case float32:
+        values = reinterpret_cast<char*>(mat.nonZeroValues.data());
+        valueSize = sizeof(float);
+
+        break;
+    case int8:
+        values = reinterpret_cast<char*>(mat.nonZeroValues8.data());
+        valueSize = sizeof(signed char);
+
+        break;
+    default:
+        values = reinterpret_cast<char*>(mat.nonZeroValues16.data());
+        valueSize = sizeof(unsigned short);
+    }
+
+    const long pageSize = sysconf(_SC_PAGESIZE);
+
+    // Same partition as runKernel2 with the default batch size and row order
+    const Int2 &batchSize = cs.batchSize2;
+
+    Int2 batches((size.x + batchSize.x - 1) / batchSize.x, (size.y + batchSize.y - 1) / batchSize.y);
+
+    int totalBatches = batches.x * batches.y;
+    int numColumns = size.x * size.y;
+    int rowsPerColumn = mat.rows / numColumns;
+
+    std::vector<void*> pages;
+    std::vector<int> nodes;
+
+    for (int x = 0; x < size.x; x++)
+        for (int y = 0; y < size.y; y++) {
+            int column = address2(Int2(x, y), size);
+
+            int node = getItemNode(x / batchSize.x + (y / batchSize.y) * batches.x, totalBatches, numNodes);
+
+            // Pruned local receptive fields only store the kept values of each column, the row ranges are those of the full layout
+            long long begin = static_cast<long long>(mat.isMasked() ? mat.topology->keptRanges[column] : mat.topology->rowRanges[column * rowsPerColumn]) * valueSize;
+            long long end = static_cast<long long>(mat.isMasked() ? mat.topology->keptRanges[column + 1] : mat.topology->rowRanges[(column + 1) * rowsPerColumn]) * valueSize;
+
+            // Pages overlapping the column's values, a page shared by several columns goes to the last one
+            for (long long page = (reinterpret_cast<long long>(values + begin) / pageSize) * pageSize; page < reinterpret_cast<long long>(values + end); page += pageSize) {
+                if (!pages.empty() && pages.back() == reinterpret_cast<void*>(page)) {
+                    nodes.back() = node;
+
+                    continue;
+                }
+
+                pages.push_back(reinterpret_cast<void*>(page));
+                nodes.push_back(node);
+            }
+        }
+
+    if (pages.empty())
+        return;
+
+    // move_pages(2) with MPOL_MF_MOVE, called directly to avoid depending on libnuma. Failure leaves the pages where they are
+    const int moveFlag = 1 << 1;
+
+    std::vector<int> status(pages.size());
+
+    syscall(SYS_move_pages, 0, static_cast<unsigned long>(pages.size()), pages.data(), nodes.data(), status.data(), moveFlag);
+#endif
+}
@@ -0,0 +1,68 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include "Helpers.h"
+
+namespace ogmaneo {
+class ComputeSystem;
+
+// CPUs of each NUMA node
+struct NUMATopology {
+    std::vector<std::vector<int>> nodeCPUs;
+
+    int getNumNodes() const {
+        return nodeCPUs.size();
+    }
+};
+
+// Read the node layout of the machine (Linux sysfs). Machines without NUMA information report a single node
+NUMATopology readNUMATopology();
+
+// Pin each OpenMP thread to the CPUs of its node (see getThreadNode)
+void pinOpenMPThreads(
+    const NUMATopology &topology // Node layout
+);
+
+// Node of a thread, threads are split evenly and in order between the nodes
+inline int getThreadNode(
+    int thread, // Thread index
+    int numThreads, // Number of threads
+    int numNodes // Number of nodes
+) {
+    return static_cast<long long>(thread) * numNodes / numThreads;
+}
+
+// Node owning an item, items are split statically into one contiguous range per node
+inline int getItemNode(
+    int item, // Item index
+    int count, // Number of items
+    int numNodes // Number of nodes
+) {
+    int node = static_cast<long long>(item) * numNodes / count;
+
+    // Undo rounding, the ranges are [count * n / numNodes, count * (n + 1) / numNodes)
+    while (node > 0 && item < static_cast<long long>(count) * node / numNodes)
+        node--;
+
+    while (node < numNodes - 1 && item >= static_cast<long long>(count) * (node + 1) / numNodes)
+        node++;
+
+    return node;
+}
+
+// Move the values of a weight matrix to the nodes whose threads run its rows. Rows are grouped per column
+// (rows / (size.x * size.y) each, ordered by address2) and columns are partitioned like the batches of runKernel2.
+// Does nothing unless the compute system is in NUMA mode on a machine with more than one node
+void placeSMColumns(
+    const ComputeSystem &cs, // Compute system
+    SparseMatrix &mat, // Matrix to place
+    const Int2 &size // Column extent of the kernel running the rows
+);
+} // namespace ogmaneo
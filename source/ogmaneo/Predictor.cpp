@@ -8,78 +8,99 @@
 
 #include "Predictor.h"
 
+#include <algorithm>
+#include <cstring>
+
 using namespace ogmaneo;
 
+void Predictor::initScales() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    hiddenScales.resize(numHiddenColumns);
+
+    // From the geometry, so pruning doesn't change the normalization
+    for (int x = 0; x < hiddenSize.x; x++)
+        for (int y = 0; y < hiddenSize.y; y++) {
+            int count = 0;
+
+            for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+                count += visibleLayers[vli].weights.countFields(Int2(x, y));
+
+            hiddenScales[address2(Int2(x, y), Int2(hiddenSize.x, hiddenSize.y))] = 1.0f / std::max(1, count);
+        }
+}
+
 void Predictor::forward(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const std::vector<const IntBuffer*> &inputCs
 ) {
-    int maxIndex = 0;
-    float maxActivation = -999999.0f;
+    int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    float* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
 
-        float sum = 0.0f;
+    std::fill(activations, activations + hiddenSize.z, 0.0f);
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    // All visible layers accumulate straight into the activations (unnormalized, only the maximum matters)
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z);
-        }
+        vl.weights.multiplyOHVsColumn(*inputCs[vli], hiddenColumnIndex, vld.size.z, activations);
+    }
+
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
 
-        if (sum > maxActivation) {
-            maxActivation = sum;
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        if (activations[hc] > maxActivation) {
+            maxActivation = activations[hc];
             maxIndex = hc;
         }
     }
 
-    hiddenCs[address2(pos, Int2(hiddenSize.x, hiddenSize.y))] = maxIndex;
+    hiddenCs[hiddenColumnIndex] = maxIndex;
 }
 
 void Predictor::learn(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const IntBuffer* hiddenTargetCs
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
     int targetC = (*hiddenTargetCs)[hiddenColumnIndex];
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    float* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
 
-        float sum = 0.0f;
-        int count = 0;
+    float scale = hiddenScales[hiddenColumnIndex];
 
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    std::fill(activations, activations + hiddenSize.z, 0.0f);
 
-            sum += vl.weights.multiplyOHVs(vl.inputCsPrev, hiddenIndex, vld.size.z);
-            count += vl.weights.count(hiddenIndex) / vld.size.z;
-        }
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-        sum /= std::max(1, count);
+        vl.weights.multiplyOHVsColumn(vl.inputCsPrev, hiddenColumnIndex, vld.size.z, activations, scale);
+    }
 
-        float delta = alpha * ((hc == targetC ? 1.0f : -1.0f) - std::tanh(sum));
+    // Activations become deltas
+    for (int hc = 0; hc < hiddenSize.z; hc++)
+        activations[hc] = alpha * ((hc == targetC ? 1.0f : -1.0f) - std::tanh(activations[hc]));
 
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            vl.weights.deltaOHVs(vl.inputCsPrev, delta, hiddenIndex, vld.size.z);
-        }
+        vl.weights.deltaOHVsColumn(vl.inputCsPrev, activations, hiddenColumnIndex, vld.size.z);
     }
 }
 
 void Predictor::initRandom(
     ComputeSystem &cs,
     const Int3 &hiddenSize,
-    const std::vector<VisibleLayerDesc> &visibleLayerDescs
+    const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+    ValueType valueType
 ) {
     this->visibleLayerDescs = visibleLayerDescs;
 
@@ -91,7 +112,6 @@ void Predictor::initRandom(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    std::uniform_real_distribution<float> weightDist(-0.01f, 0.01f);
 
     // Create layers
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -101,27 +121,36 @@ void Predictor::initRandom(
         int numVisibleColumns = vld.size.x * vld.size.y;
 
         // Create weight matrix for this visible layer and initialize randomly
-        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
+        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights, true);
+
+        initSMUniform(cs, vl.weights, -0.01f, 0.01f, cs.rng);
 
-        for (int i = 0; i < vl.weights.nonZeroValues.size(); i++)
-            vl.weights.nonZeroValues[i] = weightDist(cs.rng);
+        vl.weights.setValueType(initValueType(valueType));
 
         vl.inputCsPrev = IntBuffer(numVisibleColumns, 0);
     }
 
     // Hidden Cs
     hiddenCs = IntBuffer(numHiddenColumns, 0);
+
+    hiddenActivations = FloatBuffer(numHidden);
+
+    initScales();
+
+    placeWeights(cs);
 }
 
+template <typename R>
 void Predictor::activate(
     ComputeSystem &cs,
-    const std::vector<const IntBuffer*> &inputCs
+    const std::vector<const IntBuffer*> &inputCs,
+    R &rng
 ) {
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
     // Forward kernel
-    runKernel2(cs, std::bind(Predictor::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { forward(pos, rng, inputCs); }, Int2(hiddenSize.x, hiddenSize.y), rng, cs.batchSize2, "Predictor::forward");
 
     // Copy to prevs
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -130,16 +159,52 @@ void Predictor::activate(
 
         int numVisibleColumns = vld.size.x * vld.size.y;
 
-        runKernel1(cs, std::bind(copyInt, std::placeholders::_1, std::placeholders::_2, inputCs[vli], &vl.inputCsPrev), numVisibleColumns, cs.rng, cs.batchSize1);
+        std::memcpy(vl.inputCsPrev.data(), inputCs[vli]->data(), numVisibleColumns * sizeof(int));
     }
 }
 
+template <typename R>
 void Predictor::learn(
     ComputeSystem &cs,
-    const IntBuffer* hiddenTargetCs
+    const IntBuffer* hiddenTargetCs,
+    R &rng
 ) {
+    bool stochasticRounding = false;
+
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+        stochasticRounding |= visibleLayers[vli].weights.roundsStochastically();
+
     // Learn kernel
-    runKernel2(cs, std::bind(Predictor::learnKernel, std::placeholders::_1, std::placeholders::_2, this, hiddenTargetCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { learn(pos, rng, hiddenTargetCs); }, Int2(hiddenSize.x, hiddenSize.y), rng, cs.batchSize2, "Predictor::learn",
+        stochasticRounding);
+}
+
+template void Predictor::activate<std::mt19937>(ComputeSystem &cs, const std::vector<const IntBuffer*> &inputCs, std::mt19937 &rng);
+template void Predictor::activate<PhiloxRNG>(ComputeSystem &cs, const std::vector<const IntBuffer*> &inputCs, PhiloxRNG &rng);
+template void Predictor::learn<std::mt19937>(ComputeSystem &cs, const IntBuffer* hiddenTargetCs, std::mt19937 &rng);
+template void Predictor::learn<PhiloxRNG>(ComputeSystem &cs, const IntBuffer* hiddenTargetCs, PhiloxRNG &rng);
+
+void Predictor::quantize() {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].weights.setValueType(int8);
+}
+
+void Predictor::prune(
+    float threshold,
+    int keepPerGroup
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].weights.prune(threshold, visibleLayerDescs[vli].size.z, keepPerGroup);
+}
+
+void Predictor::placeWeights(
+    ComputeSystem &cs
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        placeSMColumns(cs, vl.weights, Int2(hiddenSize.x, hiddenSize.y));
+    }
 }
 
 void Predictor::writeToStream(
@@ -182,7 +247,9 @@ void Predictor::readFromStream(
 
     readBufferFromStream(is, &hiddenCs);
 
-    int numVisibleLayers;
+    hiddenActivations = FloatBuffer(numHidden);
+
+    int numVisibleLayers = 0;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
 
@@ -199,4 +266,6 @@ void Predictor::readFromStream(
 
         readBufferFromStream(is, &vl.inputCsPrev);
     }
+
+    initScales();
 }
\ No newline at end of file
@@ -40,41 +40,41 @@ private:
 
     IntBuffer hiddenCs; // Hidden state
 
+    // Kernel scratch, a slice of hiddenSize.z per hidden column, allocated once so that steps don't allocate
+    FloatBuffer hiddenActivations;
+
+    // Normalization multiplier of each hidden column (1 / input columns in the receptive fields of all visible layers).
+    // Derived from the geometry at init and load time
+    FloatBuffer hiddenScales;
+
     // Visible layers and descs
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
 
+    void initScales();
+
     // --- Kernels ---
 
     void forward(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const std::vector<const IntBuffer*> &inputCs
     );
 
     void learn(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const IntBuffer* hiddenTargetCs
     );
 
-    static void forwardKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        Predictor* p,
-        const std::vector<const IntBuffer*> &inputCs
-    ) {
-        p->forward(pos, rng, inputCs);
-    }
+    // Convert the weights to int8 and drop learning-only data, the layer can only be used for inference afterwards
+    void quantize();
 
-    static void learnKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        Predictor* p,
-        const IntBuffer* hiddenTargetCs
-    ) {
-        p->learn(pos, rng, hiddenTargetCs);
-    }
+    // Remove small weights (see SparseMatrix::prune), one-hot groups are the cells of a visible column. The layer can still learn afterwards
+    void prune(
+        float threshold, // Smallest weight magnitude to keep
+        int keepPerGroup // Weights to keep per visible column, 0 to keep all above threshold
+    );
 
 public:
     float alpha; // Learning rate
@@ -89,21 +89,64 @@ public:
     void initRandom(
         ComputeSystem &cs, // Compute system
         const Int3 &hiddenSize, // Hidden/output/prediction size
-        const std::vector<VisibleLayerDesc> &visibleLayerDescs // First visible layer must be from current hidden state, second must be feed back state, rest can be whatever
+        const std::vector<VisibleLayerDesc> &visibleLayerDescs, // First visible layer must be from current hidden state, second must be feed back state, rest can be whatever
+        ValueType valueType = float32 // Storage type of the weights, not int8 (see quantize)
     ); 
 
     // Activate the predictor (predict values)
     void activate(
         ComputeSystem &cs, // Compute system
         const std::vector<const IntBuffer*> &inputCs // Hidden/output/prediction size
+    ) {
+        activate(cs, inputCs, cs.rng);
+    }
+
+    // Activate with the launch keys drawn from rng instead of cs.rng (std::mt19937 or PhiloxRNG, see runTasks)
+    template <typename R>
+    void activate(
+        ComputeSystem &cs, // Compute system
+        const std::vector<const IntBuffer*> &inputCs, // Hidden/output/prediction size
+        R &rng // Generator
     );
 
     // Learning predictions (update weights)
     void learn(
         ComputeSystem &cs,
         const IntBuffer* hiddenTargetCs
+    ) {
+        learn(cs, hiddenTargetCs, cs.rng);
+    }
+
+    // Learn with the launch keys drawn from rng instead of cs.rng (std::mt19937 or PhiloxRNG, see runTasks)
+    template <typename R>
+    void learn(
+        ComputeSystem &cs,
+        const IntBuffer* hiddenTargetCs,
+        R &rng // Generator
     );
 
+    // Move the weights to the NUMA nodes whose threads run their hidden columns (see ComputeSystem::setNUMA).
+    // Done by initRandom, call after reading, copying or pruning a layer
+    void placeWeights(
+        ComputeSystem &cs // Compute system
+    );
+
+    // Call func on each buffer of layer state and weights, in the order a step uses them
+    template <typename F>
+    void visitBuffers(
+        const F &func // Called with each buffer
+    ) {
+        for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+            visibleLayers[vli].weights.visitBuffers(func);
+
+            func(visibleLayers[vli].inputCsPrev);
+        }
+
+        func(hiddenScales);
+        func(hiddenActivations);
+        func(hiddenCs);
+    }
+
     // Write to stream
     void writeToStream(
         std::ostream &os // Stream to write to
@@ -133,6 +176,27 @@ public:
         return visibleLayerDescs[i];
     }
 
+    // Receptive field of a hidden column in a visible layer, clamped to the visible layer (inclusive bounds)
+    void getFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &hiddenPos, // Position of hidden column
+        Int2 &lowerBound, // Lower bound of the field
+        Int2 &upperBound // Upper bound of the field
+    ) const {
+        visibleLayers[vli].weights.getFieldBounds(hiddenPos, lowerBound, upperBound);
+    }
+
+    // Range of hidden columns whose receptive fields in a visible layer contain a visible column
+    // (inclusive bounds, lower > upper if there are none)
+    void getReverseFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &visiblePos, // Position of visible column
+        Int2 &lowerBound, // Lower bound of the range
+        Int2 &upperBound // Upper bound of the range
+    ) const {
+        visibleLayers[vli].weights.getReverseFieldBounds(visiblePos, lowerBound, upperBound);
+    }
+
     // Get the hidden activations (predictions)
     const IntBuffer &getHiddenCs() const {
         return hiddenCs;
@@ -8,33 +8,63 @@
 
 #include "SparseCoder.h"
 
+#include <algorithm>
+
 using namespace ogmaneo;
 
+void SparseCoder::initScales() {
+    int numHiddenColumns = hiddenSize.x * hiddenSize.y;
+
+    hiddenScales.resize(numHiddenColumns * visibleLayers.size());
+
+    // From the geometry, so pruning doesn't change the normalization
+    for (int x = 0; x < hiddenSize.x; x++)
+        for (int y = 0; y < hiddenSize.y; y++) {
+            int i = address2(Int2(x, y), Int2(hiddenSize.x, hiddenSize.y));
+
+            for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+                hiddenScales[i * visibleLayers.size() + vli] = 1.0f / std::max(1, visibleLayers[vli].weights.countFields(Int2(x, y)));
+        }
+
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+
+        vl.visibleScales.resize(vld.size.x * vld.size.y);
+
+        for (int x = 0; x < vld.size.x; x++)
+            for (int y = 0; y < vld.size.y; y++)
+                vl.visibleScales[address2(Int2(x, y), Int2(vld.size.x, vld.size.y))] = 1.0f / std::max(1, vl.weights.countFieldsT(Int2(x, y)));
+    }
+}
+
 void SparseCoder::forward(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const std::vector<const IntBuffer*> &inputCs
 ) {
     int hiddenColumnIndex = address2(pos, Int2(hiddenSize.x, hiddenSize.y));
 
-    int maxIndex = 0;
-    float maxActivation = -999999.0f;
+    float* activations = &hiddenActivations[hiddenColumnIndex * hiddenSize.z];
 
-    for (int hc = 0; hc < hiddenSize.z; hc++) {
-        int hiddenIndex = address3(Int3(pos.x, pos.y, hc), hiddenSize);
+    const float* scales = &hiddenScales[hiddenColumnIndex * visibleLayers.size()];
 
-        float sum = 0.0f;
+    std::fill(activations, activations + hiddenSize.z, 0.0f);
 
-        // For each visible layer
-        for (int vli = 0; vli < visibleLayers.size(); vli++) {
-            VisibleLayer &vl = visibleLayers[vli];
-            const VisibleLayerDesc &vld = visibleLayerDescs[vli];
+    // All cells of the column are accumulated straight into the activations, one pass over the receptive field of each visible layer
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+        const VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            sum += vl.weights.multiplyOHVs(*inputCs[vli], hiddenIndex, vld.size.z) / std::max(1, vl.weights.count(hiddenIndex) / vld.size.z);
-        }
+        vl.weights.multiplyOHVsColumn(*inputCs[vli], hiddenColumnIndex, vld.size.z, activations, scales[vli]);
+    }
 
-        if (sum > maxActivation) {
-            maxActivation = sum;
+    int maxIndex = 0;
+    float maxActivation = -999999.0f;
+
+    for (int hc = 0; hc < hiddenSize.z; hc++) {
+        if (activations[hc] > maxActivation) {
+            maxActivation = activations[hc];
             maxIndex = hc;
         }
     }
@@ -44,7 +74,7 @@ void SparseCoder::forward(
 
 void SparseCoder::learn(
     const Int2 &pos,
-    std::mt19937 &rng,
+    PhiloxRNG &/* rng */,
     const IntBuffer* inputCs,
     int vli
 ) {
@@ -57,37 +87,37 @@ void SparseCoder::learn(
 
     int maxIndex = 0;
     float maxActivation = -999999.0f;
-    std::vector<float> activations(vld.size.z);
+    float* activations = &vl.visibleActivations[visibleColumnIndex * vld.size.z];
 
-    for (int vc = 0; vc < vld.size.z; vc++) {
-        int visibleIndex = address3(Int3(pos.x, pos.y, vc), vld.size);
+    float scale = vl.visibleScales[visibleColumnIndex];
 
-        float sum = vl.weights.multiplyOHVsT(hiddenCs, visibleIndex, hiddenSize.z) / std::max(1, vl.weights.countT(visibleIndex) / hiddenSize.z);
+    // All cells of the visible column are reconstructed at once, one pass over the hidden columns that see it
+    std::fill(activations, activations + vld.size.z, 0.0f);
 
-        activations[vc] = sum;
+    vl.weights.multiplyOHVsColumnT(hiddenCs, visibleColumnIndex, hiddenSize.z, activations, scale);
 
-        if (sum > maxActivation) {
-            maxActivation = sum;
+    for (int vc = 0; vc < vld.size.z; vc++) {
+        if (activations[vc] > maxActivation) {
+            maxActivation = activations[vc];
 
             maxIndex = vc;
         }
     }
 
     if (maxIndex != targetC) {
-        for (int vc = 0; vc < vld.size.z; vc++) {
-            int visibleIndex = address3(Int3(pos.x, pos.y, vc), vld.size);
-
-            float delta = alpha * ((vc == targetC ? 1.0f : 0.0f) - std::exp(activations[vc]));
+        // The activations are replaced by the deltas of their cells
+        for (int vc = 0; vc < vld.size.z; vc++)
+            activations[vc] = alpha * ((vc == targetC ? 1.0f : 0.0f) - std::exp(activations[vc]));
 
-            vl.weights.deltaOHVsT(hiddenCs, delta, visibleIndex, hiddenSize.z);
-        }
+        vl.weights.deltaOHVsColumnT(hiddenCs, activations, visibleColumnIndex, hiddenSize.z);
     }
 }
 
 void SparseCoder::initRandom(
     ComputeSystem &cs,
     const Int3 &hiddenSize,
-    const std::vector<VisibleLayerDesc> &visibleLayerDescs
+    const std::vector<VisibleLayerDesc> &visibleLayerDescs,
+    ValueType valueType
 ) {
     this->visibleLayerDescs = visibleLayerDescs;
 
@@ -99,7 +129,6 @@ void SparseCoder::initRandom(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    std::uniform_real_distribution<float> weightDist(-0.01f, 0.0f);
 
     // Create layers
     for (int vli = 0; vli < visibleLayers.size(); vli++) {
@@ -110,17 +139,23 @@ void SparseCoder::initRandom(
         int numVisible = numVisibleColumns * vld.size.z;
 
         // Create weight matrix for this visible layer and initialize randomly
-        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights);
+        initSMLocalRF(vld.size, hiddenSize, vld.radius, vl.weights, true);
+
+        initSMUniform(cs, vl.weights, -0.01f, 0.0f, cs.rng);
 
-        for (int i = 0; i < vl.weights.nonZeroValues.size(); i++)
-            vl.weights.nonZeroValues[i] = weightDist(cs.rng);
+        vl.weights.setValueType(initValueType(valueType));
 
-        // Generate transpose (needed for reconstruction)
-        vl.weights.initT();
+        vl.visibleActivations = FloatBuffer(numVisible);
     }
 
     // Hidden Cs
     hiddenCs = IntBuffer(numHiddenColumns, 0);
+
+    hiddenActivations = FloatBuffer(numHidden);
+
+    initScales();
+
+    placeWeights(cs);
 }
 
 void SparseCoder::step(
@@ -131,18 +166,55 @@ void SparseCoder::step(
     int numHiddenColumns = hiddenSize.x * hiddenSize.y;
     int numHidden = numHiddenColumns * hiddenSize.z;
 
-    runKernel2(cs, std::bind(SparseCoder::forwardKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs), Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2);
+    runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { forward(pos, rng, inputCs); }, Int2(hiddenSize.x, hiddenSize.y), cs.rng, cs.batchSize2, "SparseCoder::forward");
 
     if (learnEnabled) {
         for (int vli = 0; vli < visibleLayers.size(); vli++) {
             VisibleLayer &vl = visibleLayers[vli];
             VisibleLayerDesc &vld = visibleLayerDescs[vli];
 
-            runKernel2(cs, std::bind(SparseCoder::learnKernel, std::placeholders::_1, std::placeholders::_2, this, inputCs[vli], vli), Int2(vld.size.x, vld.size.y), cs.rng, cs.batchSize2);
+            // Quantized weights can't learn, and have no transpose kernels to reconstruct with
+            if (vl.weights.valueType == int8)
+                continue;
+
+            // Learning reconstructs through the transpose, which is only built once needed
+            vl.weights.requireT();
+
+            runKernel2(cs, [&](const Int2 &pos, PhiloxRNG &rng) { learn(pos, rng, inputCs[vli], vli); }, Int2(vld.size.x, vld.size.y), cs.rng, cs.batchSize2, "SparseCoder::learn",
+                vl.weights.roundsStochastically());
         }
     }
 }
 
+void SparseCoder::quantize() {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        vl.weights.setValueType(int8);
+
+        // Transpose is only used for learning
+        vl.weights.releaseT();
+    }
+}
+
+void SparseCoder::prune(
+    float threshold,
+    int keepPerGroup
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++)
+        visibleLayers[vli].weights.prune(threshold, visibleLayerDescs[vli].size.z, keepPerGroup);
+}
+
+void SparseCoder::placeWeights(
+    ComputeSystem &cs
+) {
+    for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+        VisibleLayer &vl = visibleLayers[vli];
+
+        placeSMColumns(cs, vl.weights, Int2(hiddenSize.x, hiddenSize.y));
+    }
+}
+
 void SparseCoder::writeToStream(
     std::ostream &os
 ) const {
@@ -181,7 +253,9 @@ void SparseCoder::readFromStream(
 
     readBufferFromStream(is, &hiddenCs);
 
-    int numVisibleLayers;
+    hiddenActivations = FloatBuffer(numHidden);
+
+    int numVisibleLayers = 0;
     
     is.read(reinterpret_cast<char*>(&numVisibleLayers), sizeof(int));
 
@@ -198,5 +272,9 @@ void SparseCoder::readFromStream(
         int numVisible = numVisibleColumns * vld.size.z;
 
         readSMFromStream(is, vl.weights);
+
+        vl.visibleActivations = FloatBuffer(numVisible);
     }
+
+    initScales();
 }
\ No newline at end of file
@@ -31,6 +31,11 @@ public:
     // Visible layer
     struct VisibleLayer {
         SparseMatrix weights; // Weight matrix
+
+        FloatBuffer visibleActivations; // Learn kernel scratch, a slice of size.z per visible column
+
+        // Normalization multiplier of each visible column (1 / hidden columns whose receptive fields contain it), derived from the geometry
+        FloatBuffer visibleScales;
     };
 
 private:
@@ -38,44 +43,34 @@ private:
 
     IntBuffer hiddenCs; // Hidden states
 
+    // Kernel scratch, a slice of hiddenSize.z per hidden column, allocated once so that steps don't allocate
+    FloatBuffer hiddenActivations;
+
+    // Normalization multiplier of each visible layer at each hidden column (1 / input columns in its receptive field),
+    // [hidden column][visible layer]. Derived from the geometry at init and load time
+    FloatBuffer hiddenScales;
+
     // Visible layers and associated descriptors
     std::vector<VisibleLayer> visibleLayers;
     std::vector<VisibleLayerDesc> visibleLayerDescs;
     
+    void initScales();
+    
     // --- Kernels ---
     
     void forward(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const std::vector<const IntBuffer*> &inputCs
     );
 
     void learn(
         const Int2 &pos,
-        std::mt19937 &rng,
+        PhiloxRNG &rng,
         const IntBuffer* inputCs,
         int vli
     );
 
-    static void forwardKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        SparseCoder* sc,
-        const std::vector<const IntBuffer*> &inputCs
-    ) {
-        sc->forward(pos, rng, inputCs);
-    }
-
-    static void learnKernel(
-        const Int2 &pos,
-        std::mt19937 &rng,
-        SparseCoder* sc,
-        const IntBuffer* inputCs,
-        int vli
-    ) {
-        sc->learn(pos, rng, inputCs, vli);
-    }
-
 public:
     float alpha; // Weight learning rate
 
@@ -89,7 +84,8 @@ public:
     void initRandom(
         ComputeSystem &cs, // Compute system
         const Int3 &hiddenSize, // Hidden/output size
-        const std::vector<VisibleLayerDesc> &visibleLayerDescs // Descriptors for visible layers
+        const std::vector<VisibleLayerDesc> &visibleLayerDescs, // Descriptors for visible layers
+        ValueType valueType = float32 // Storage type of the weights, not int8 (see quantize)
     );
 
     // Activate the sparse coder (perform sparse coding)
@@ -99,6 +95,38 @@ public:
         bool learnEnabled // Whether to learn
     );
 
+    // Convert the weights to int8 and drop learning-only data, the layer can only be used for inference afterwards
+    void quantize();
+
+    // Remove small weights (see SparseMatrix::prune), one-hot groups are the cells of a visible column. The layer can still learn afterwards
+    void prune(
+        float threshold, // Smallest weight magnitude to keep
+        int keepPerGroup // Weights to keep per visible column, 0 to keep all above threshold
+    );
+
+    // Move the weights to the NUMA nodes whose threads run their hidden columns (see ComputeSystem::setNUMA).
+    // Done by initRandom, call after reading, copying or pruning a layer
+    void placeWeights(
+        ComputeSystem &cs // Compute system
+    );
+
+    // Call func on each buffer of layer state and weights, in the order a step uses them
+    template <typename F>
+    void visitBuffers(
+        const F &func // Called with each buffer
+    ) {
+        for (std::size_t vli = 0; vli < visibleLayers.size(); vli++) {
+            visibleLayers[vli].weights.visitBuffers(func);
+
+            func(visibleLayers[vli].visibleScales);
+            func(visibleLayers[vli].visibleActivations);
+        }
+
+        func(hiddenScales);
+        func(hiddenActivations);
+        func(hiddenCs);
+    }
+
     // Write to stream
     void writeToStream(
         std::ostream &os // Stream to write to
@@ -128,6 +156,27 @@ public:
         return visibleLayerDescs[i];
     }
 
+    // Receptive field of a hidden column in a visible layer, clamped to the visible layer (inclusive bounds)
+    void getFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &hiddenPos, // Position of hidden column
+        Int2 &lowerBound, // Lower bound of the field
+        Int2 &upperBound // Upper bound of the field
+    ) const {
+        visibleLayers[vli].weights.getFieldBounds(hiddenPos, lowerBound, upperBound);
+    }
+
+    // Range of hidden columns whose receptive fields in a visible layer contain a visible column
+    // (inclusive bounds, lower > upper if there are none)
+    void getReverseFieldBounds(
+        int vli, // Index of visible layer
+        const Int2 &visiblePos, // Position of visible column
+        Int2 &lowerBound, // Lower bound of the range
+        Int2 &upperBound // Upper bound of the range
+    ) const {
+        visibleLayers[vli].weights.getReverseFieldBounds(visiblePos, lowerBound, upperBound);
+    }
+
     // Get the hidden states
     const IntBuffer &getHiddenCs() const {
         return hiddenCs;
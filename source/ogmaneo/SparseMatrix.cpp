@@ -8,525 +8,3121 @@
 
 #include "SparseMatrix.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <type_traits>
+
 using namespace ogmaneo;
 
-void SparseMatrix::init(
-	int rows,
-	int columns,
-	const std::vector<float> &nonZeroValues,
-	const std::vector<int> &rowRanges,
-	const std::vector<int> &columnIndices
+// --- Value Storage ---
+
+inline unsigned int floatBits(
+	float x
+) {
+	unsigned int bits;
+
+	std::memcpy(&bits, &x, sizeof(float));
+
+	return bits;
+}
+
+inline float bitsFloat(
+	unsigned int bits
+) {
+	float x;
+
+	std::memcpy(&x, &bits, sizeof(float));
+
+	return x;
+}
+
+// Stream of the stochastic rounding noise of this thread, restarted per kernel item (see seedRounding)
+struct RoundingStream {
+	unsigned int key;
+	unsigned int counter;
+};
+
+static thread_local RoundingStream roundingStream = { 0, 0 };
+
+void ogmaneo::seedRounding(
+	unsigned long long key,
+	unsigned int c0,
+	unsigned int c1,
+	unsigned int c2
+) {
+	unsigned int h = static_cast<unsigned int>(key) ^ static_cast<unsigned int>(key >> 32) * 0x85ebca6bu;
+
+	unsigned int c[3] = { c0, c1, c2 };
+
+	for (int i = 0; i < 3; i++) {
+		h = (h ^ c[i]) * 0x9e3779b9u;
+		h ^= h >> 15;
+	}
+
+	roundingStream.key = h;
+	roundingStream.counter = 0;
+}
+
+// Noise source of stochastic rounding. Mixes the entry and its new value with the rounding stream of the item being run,
+// so the result is the same whichever thread runs the item
+inline unsigned int roundingNoise(
+	int index,
+	unsigned int bits
+) {
+	unsigned int h = static_cast<unsigned int>(index) * 0x9e3779b9u ^ bits ^ roundingStream.key ^ (roundingStream.counter++ * 0x85ebca6bu);
+
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+
+	return h;
+}
+
+inline float bfloat16ToFloat(
+	unsigned short h
+) {
+	return bitsFloat(static_cast<unsigned int>(h) << 16);
+}
+
+inline unsigned short floatToBFloat16(
+	float x
+) {
+	unsigned int bits = floatBits(x);
+
+	if ((bits & 0x7f800000u) == 0x7f800000u) // Inf or NaN
+		return bits >> 16;
+
+	// Round to nearest even
+	return (bits + 0x7fffu + ((bits >> 16) & 1u)) >> 16;
+}
+
+inline unsigned short floatToBFloat16Stochastic(
+	float x,
+	int index
+) {
+	unsigned int bits = floatBits(x);
+
+	if ((bits & 0x7f800000u) == 0x7f800000u) // Inf or NaN
+		return bits >> 16;
+
+	// Adding uniform noise to the truncated bits rounds up with probability equal to the remainder
+	return (bits + (roundingNoise(index, bits) & 0xffffu)) >> 16;
+}
+
+inline float float16ToFloat(
+	unsigned short h
+) {
+	unsigned int sign = static_cast<unsigned int>(h & 0x8000u) << 16;
+	unsigned int exponent = (h >> 10) & 0x1fu;
+	unsigned int mantissa = h & 0x3ffu;
+
+	if (exponent == 0) { // Zero or subnormal
+		float x = mantissa * 5.9604645e-8f; // 2^-24
+
+		return sign ? -x : x;
+	}
+
+	if (exponent == 31) // Inf or NaN
+		return bitsFloat(sign | 0x7f800000u | (mantissa << 13));
+
+	return bitsFloat(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
+
+// Rounds toward zero, saturating at the largest finite value
+inline unsigned short floatToFloat16Truncate(
+	float x
+) {
+	unsigned int bits = floatBits(x);
+
+	unsigned short sign = (bits >> 16) & 0x8000u;
+
+	if ((bits & 0x7f800000u) == 0x7f800000u) // Inf or NaN
+		return sign | 0x7c00u | ((bits & 0x7fffffu) != 0 ? 0x200u : 0u);
+
+	int exponent = static_cast<int>((bits >> 23) & 0xffu) - 127 + 15;
+	unsigned int mantissa = bits & 0x7fffffu;
+
+	if (exponent >= 31)
+		return sign | 0x7bffu;
+
+	if (exponent <= 0) {
+		int shift = 14 - exponent;
+
+		if (shift > 24)
+			return sign;
+
+		return sign | ((mantissa | 0x800000u) >> shift);
+	}
+
+	return sign | (exponent << 10) | (mantissa >> 13);
+}
+
+// Rounds to one of the two neighbouring fp16 values, chosen by threshold (0.5 is round to nearest)
+inline unsigned short floatToFloat16Threshold(
+	float x,
+	float threshold
+) {
+	unsigned short h0 = floatToFloat16Truncate(x);
+
+	float f0 = float16ToFloat(h0);
+
+	if (f0 == x || (h0 & 0x7fffu) >= 0x7bffu)
+		return h0;
+
+	unsigned short h1 = h0 + 1; // Next value away from zero
+
+	float f1 = float16ToFloat(h1);
+
+	return (x - f0) / (f1 - f0) > threshold ? h1 : h0;
+}
+
+inline unsigned short floatToFloat16(
+	float x
+) {
+	return floatToFloat16Threshold(x, 0.5f);
+}
+
+inline unsigned short floatToFloat16Stochastic(
+	float x,
+	int index
+) {
+	return floatToFloat16Threshold(x, (roundingNoise(index, floatBits(x)) >> 8) * (1.0f / 16777216.0f));
+}
+
+// Value accessors, values are always read and accumulated as fp32
+struct Float32Values {
+	float* data;
+
+	float get(SparseOffset j) const {
+		return data[j];
+	}
+
+	void set(SparseOffset j, float value) const {
+		data[j] = value;
+	}
+
+	void add(SparseOffset j, float delta) const {
+		data[j] += delta;
+	}
+};
+
+struct BFloat16Values {
+	unsigned short* data;
+
+	float get(SparseOffset j) const {
+		return bfloat16ToFloat(data[j]);
+	}
+
+	void set(SparseOffset j, float value) const {
+		data[j] = floatToBFloat16(value);
+	}
+
+	// Stochastic rounding so that updates smaller than the precision still apply on average
+	void add(SparseOffset j, float delta) const {
+		data[j] = floatToBFloat16Stochastic(get(j) + delta, j);
+	}
+};
+
+struct Float16Values {
+	unsigned short* data;
+
+	float get(SparseOffset j) const {
+		return float16ToFloat(data[j]);
+	}
+
+	void set(SparseOffset j, float value) const {
+		data[j] = floatToFloat16(value);
+	}
+
+	void add(SparseOffset j, float delta) const {
+		data[j] = floatToFloat16Stochastic(get(j) + delta, j);
+	}
+};
+
+// Values of the storage type, external if the matrix is a view. Writes through it are guarded by the immutable flag
+template <typename T>
+inline T* valueData(
+	const SparseMatrix &mat,
+	const Buffer<T> &buffer
+) {
+	return const_cast<T*>(mat.isView() ? static_cast<const T*>(mat.externalValues) : buffer.data());
+}
+
+// Address of the value of an entry, for prefetching
+inline const void* valueAddress(
+	const SparseMatrix &mat,
+	SparseOffset j
+) {
+	switch (mat.valueType) {
+	case int8:
+		return valueData(mat, mat.nonZeroValues8) + j;
+	case bfloat16:
+	case float16:
+		return valueData(mat, mat.nonZeroValues16) + j;
+	default:
+		return valueData(mat, mat.nonZeroValues) + j;
+	}
+}
+
+// Run a kernel body instantiated for the storage type of the matrix
+template <typename F>
+inline auto visitValues(
+	SparseMatrix &mat,
+	F f
+) -> decltype(f(Float32Values())) {
+	// Quantized matrices only support the forward OHV kernels, the others leave their outputs untouched and return zero
+	assert(mat.valueType != int8);
+
+	switch (mat.valueType) {
+	case int8:
+		return decltype(f(Float32Values()))();
+	case bfloat16:
+		return f(BFloat16Values{ assumeAligned(valueData(mat, mat.nonZeroValues16)) });
+	case float16:
+		return f(Float16Values{ assumeAligned(valueData(mat, mat.nonZeroValues16)) });
+	default:
+		return f(Float32Values{ assumeAligned(valueData(mat, mat.nonZeroValues)) });
+	}
+}
+
+// Run a kernel body that changes the values
+template <typename F>
+inline void visitMutableValues(
+	SparseMatrix &mat,
+	F f
+) {
+	// Immutable matrices (such as views of read-only memory) can't learn, updates are dropped
+	assert(!mat.immutable);
+
+	if (mat.immutable)
+		return;
+
+	visitValues(mat, f);
+}
+
+// Run an OHV kernel body instantiated for the storage type. For the common one-hot sizes the size is passed
+// as a compile-time constant, so divisions by it become shifts and the loops over one-hot vectors can be unrolled
+template <typename F>
+inline auto visitValuesOHVs(
+	SparseMatrix &mat,
+	int oneHotSize,
+	F f
+) -> decltype(f(Float32Values(), oneHotSize)) {
+	return visitValues(mat, [&](auto values) {
+		switch (oneHotSize) {
+		case 8:
+			return f(values, std::integral_constant<int, 8>());
+		case 16:
+			return f(values, std::integral_constant<int, 16>());
+		case 32:
+			return f(values, std::integral_constant<int, 32>());
+		case 64:
+			return f(values, std::integral_constant<int, 64>());
+		default:
+			return f(values, oneHotSize);
+		}
+	});
+}
+
+template <typename F>
+inline void visitMutableValuesOHVs(
+	SparseMatrix &mat,
+	int oneHotSize,
+	F f
+) {
+	assert(!mat.immutable);
+
+	if (mat.immutable)
+		return;
+
+	visitValuesOHVs(mat, oneHotSize, f);
+}
+
+// --- Local Receptive Field Addressing ---
+
+// Position of a row (output cell) in the output field
+inline Int3 rowPosition(
+	const SparseMatrix &mat,
+	int row
+) {
+	return Int3(row / (mat.outSize.y * mat.outSize.z), (row / mat.outSize.z) % mat.outSize.y, row % mat.outSize.z);
+}
+
+// Position of a column (input cell) in the input field
+inline Int3 columnPosition(
+	const SparseMatrix &mat,
+	int column
+) {
+	return Int3(column / (mat.inSize.y * mat.inSize.z), (column / mat.inSize.z) % mat.inSize.y, column % mat.inSize.z);
+}
+
+// Index of an entry of a row, given its offset into the receptive field
+inline SparseOffset entryIndex(
+	const SparseMatrix &mat,
+	int row,
+	int offset
+) {
+	if (mat.columnBlocked) {
+		int oz = row % mat.outSize.z;
+
+		return mat.topology->rowRanges[row - oz] + offset * mat.outSize.z + oz;
+	}
+
+	return mat.topology->rowRanges[row] + offset;
+}
+
+// Step between consecutive entries of a row
+inline int entryStride(
+	const SparseMatrix &mat
+) {
+	return mat.columnBlocked ? mat.outSize.z : 1;
+}
+
+// Call f(ox, oy, offset) for every output column whose receptive field contains an input cell, with the offset of the cell
+// into the rows of that column. Uses the exact per axis ranges of the local receptive field topology
+template <typename F>
+inline void forEachReverseField(
+	const SparseMatrix &mat,
+	const Int3 &inPos,
+	F f
+) {
+	const SparseTopology &t = *mat.topology;
+
+	int lowerY = t.reverseLowers[1][inPos.y];
+	int upperY = t.reverseUppers[1][inPos.y];
+
+	for (int ox = t.reverseLowers[0][inPos.x]; ox <= t.reverseUppers[0][inPos.x]; ox++) {
+		int offsetX = inPos.x - t.fieldLowers[0][ox];
+
+		for (int oy = lowerY; oy <= upperY; oy++) {
+			int fieldLowerY = t.fieldLowers[1][oy];
+
+			f(ox, oy, (offsetX * (t.fieldUppers[1][oy] - fieldLowerY + 1) + inPos.y - fieldLowerY) * mat.inSize.z + inPos.z);
+		}
+	}
+}
+
+// --- Masked Addressing ---
+
+// Pruned local receptive fields (isMasked) keep the column-blocked groups of entries with the same output column, input column
+// and input cell. A group is stored as the start of its entries in the output column followed by a mask of the output cells it kept
+// (see SparseTopology::cellMasks), and only the kept values are stored
+
+// Without the popcnt instruction the builtin is a library call, which costs more than counting in registers
+inline int bitCount(
+	unsigned int bits
+) {
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__POPCNT__)
+	return __builtin_popcount(bits);
+#else
+	bits = bits - ((bits >> 1) & 0x55555555u);
+	bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+	bits = (bits + (bits >> 4)) & 0x0f0f0f0fu;
+
+	return (bits * 0x01010101u) >> 24;
+#endif
+}
+
+// Index of the lowest set bit, bits must not be 0
+inline int lowestBit(
+	unsigned int bits
+) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(bits);
+#else
+	int index = 0;
+
+	for (; (bits & 1u) == 0; bits >>= 1)
+		index++;
+
+	return index;
+#endif
+}
+
+// The output column size (outSize.z) is a parameter of the helpers below, so that the OHV kernels can pass it as a compile-time
+// constant (their one-hot size) and the group lookups don't divide
+
+// Hint that the memory at p is about to be read
+inline void prefetch(
+	const void* p
+) {
+#if defined(__GNUC__) || defined(__clang__)
+	__builtin_prefetch(p);
+#else
+	(void)p;
+#endif
+}
+
+// Groups looked up ahead of the entries they hold (see forEachMaskedActiveOutColumnEntry)
+static const int maskBatchSize = 32;
+
+// Words of a group, the start and the mask
+template <typename O>
+inline int maskStride(
+	O outZ
+) {
+	return 1 + (outZ + 31) / 32;
+}
+
+// Group of an output column and an input cell, given the offset of the cell into the rows of the column
+template <typename O>
+inline const unsigned int* maskGroup(
+	const SparseMatrix &mat,
+	int outColumn,
+	int offset,
+	O outZ
+) {
+	return &mat.topology->cellMasks[(mat.topology->rowRanges[outColumn * outZ] / outZ + offset) * maskStride(outZ)];
+}
+
+// Index of the entry of an output cell in a group, -1 if it was removed
+inline SparseOffset maskedEntryIndex(
+	const SparseMatrix &mat,
+	int outColumn,
+	const unsigned int* group,
+	int oz
+) {
+	const unsigned int* mask = group + 1;
+
+	int word = oz / 32;
+	unsigned int bit = 1u << (oz % 32);
+
+	if ((mask[word] & bit) == 0)
+		return -1;
+
+	int rank = bitCount(mask[word] & (bit - 1u));
+
+	for (int w = 0; w < word; w++)
+		rank += bitCount(mask[w]);
+
+	return mat.topology->keptRanges[outColumn] + group[0] + rank;
+}
+
+// Call f with the index and output cell of every entry of a group, in output cell order
+template <typename F>
+inline void forEachMaskedEntry(
+	const SparseMatrix &mat,
+	int outColumn,
+	const unsigned int* group,
+	F f
+) {
+	SparseOffset j = mat.topology->keptRanges[outColumn] + group[0];
+
+	int words = maskStride(mat.outSize.z) - 1;
+
+	for (int w = 0; w < words; w++)
+		for (unsigned int bits = group[1 + w]; bits != 0; bits &= bits - 1, j++)
+			f(j, w * 32 + lowestBit(bits));
+}
+
+// Call f with the index and column of every entry of a row
+template <typename F>
+inline void forEachMaskedRowEntry(
+	const SparseMatrix &mat,
+	int row,
+	F f
+) {
+	int outColumn = row / mat.outSize.z;
+	int oz = row % mat.outSize.z;
+
+	Int2 lowerBound, upperBound;
+	mat.getFieldBounds(Int2(outColumn / mat.outSize.y, outColumn % mat.outSize.y), lowerBound, upperBound);
+
+	int stride = maskStride(mat.outSize.z);
+
+	const unsigned int* group = maskGroup(mat, outColumn, 0, mat.outSize.z);
+
+	for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+		for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+			int columnStart = address3(Int3(ix, iy, 0), mat.inSize);
+
+			for (int iz = 0; iz < mat.inSize.z; iz++, group += stride) {
+				SparseOffset j = maskedEntryIndex(mat, outColumn, group, oz);
+
+				if (j != -1)
+					f(j, columnStart + iz);
+			}
+		}
+}
+
+// Call f with the index and row of every entry of a column
+template <typename F>
+inline void forEachMaskedColumnEntry(
+	const SparseMatrix &mat,
+	int column,
+	F f
+) {
+	forEachReverseField(mat, columnPosition(mat, column), [&](int ox, int oy, int offset) {
+		int outColumn = address2(Int2(ox, oy), Int2(mat.outSize.x, mat.outSize.y));
+
+		forEachMaskedEntry(mat, outColumn, maskGroup(mat, outColumn, offset, mat.outSize.z), [&](SparseOffset j, int oz) {
+			f(j, outColumn * mat.outSize.z + oz);
+		});
+	});
+}
+
+// The OHV kernels only visit the active cell of each one-hot group, so they jump straight to its group and skip it if it was removed
+
+// Call f with the index of the entry of the active cell of each input column of a row, and the input column
+template <typename F>
+inline void forEachMaskedActiveRowEntry(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int row,
+	F f
+) {
+	int outColumn = row / mat.outSize.z;
+	int oz = row % mat.outSize.z;
+
+	Int2 lowerBound, upperBound;
+	mat.getFieldBounds(Int2(outColumn / mat.outSize.y, outColumn % mat.outSize.y), lowerBound, upperBound);
+
+	int stride = maskStride(mat.outSize.z);
+
+	const unsigned int* groups = maskGroup(mat, outColumn, 0, mat.outSize.z);
+
+	for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+		for (int iy = lowerBound.y; iy <= upperBound.y; iy++, groups += mat.inSize.z * stride) {
+			int i = address2(Int2(ix, iy), Int2(mat.inSize.x, mat.inSize.y));
+
+			SparseOffset j = maskedEntryIndex(mat, outColumn, groups + nonZeroIndices[i] * stride, oz);
+
+			if (j != -1)
+				f(j, i);
+		}
+}
+
+// Call f with the index of the entry of a column in each output column whose receptive field contains it, if it was kept for the
+// active cell of the output column, and the output column. The one-hot size is that of the output columns
+template <typename O, typename F>
+inline void forEachMaskedActiveColumnEntry(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int column,
+	O oneHotSize,
+	F f
+) {
+	assert(oneHotSize == mat.outSize.z);
+
+	forEachReverseField(mat, columnPosition(mat, column), [&](int ox, int oy, int offset) {
+		int outColumn = address2(Int2(ox, oy), Int2(mat.outSize.x, mat.outSize.y));
+
+		SparseOffset j = maskedEntryIndex(mat, outColumn, maskGroup(mat, outColumn, offset, oneHotSize), nonZeroIndices[outColumn]);
+
+		if (j != -1)
+			f(j, outColumn);
+	});
+}
+
+// Call f with the index and output cell of every entry of an output column for the active cells of its input columns.
+// The kept output cells of a group are stored together, so this only touches the weights that remain. Where the values of a group
+// start is only known once its mask is loaded, so the groups of a batch of input columns are prefetched before their entries are
+// visited, instead of each group stalling on its mask
+template <typename F>
+inline void forEachMaskedActiveOutColumnEntry(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int outColumn,
+	F f
+) {
+	Int2 lowerBound, upperBound;
+	mat.getFieldBounds(Int2(outColumn / mat.outSize.y, outColumn % mat.outSize.y), lowerBound, upperBound);
+
+	int stride = maskStride(mat.outSize.z);
+
+	const unsigned int* groups = maskGroup(mat, outColumn, 0, mat.outSize.z);
+
+	const unsigned int* batch[maskBatchSize];
+	int batchCount = 0;
+
+	SparseOffset keptStart = mat.topology->keptRanges[outColumn];
+
+	auto visitBatch = [&]() {
+		// The values are prefetched too, before any branch on the masks could stall them
+		for (int b = 0; b < batchCount; b++)
+			prefetch(valueAddress(mat, keptStart + batch[b][0]));
+
+		for (int b = 0; b < batchCount; b++)
+			forEachMaskedEntry(mat, outColumn, batch[b], f);
+
+		batchCount = 0;
+	};
+
+	for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+		for (int iy = lowerBound.y; iy <= upperBound.y; iy++, groups += mat.inSize.z * stride) {
+			const unsigned int* group = groups + nonZeroIndices[address2(Int2(ix, iy), Int2(mat.inSize.x, mat.inSize.y))] * stride;
+
+			prefetch(group);
+
+			batch[batchCount++] = group;
+
+			if (batchCount == maskBatchSize)
+				visitBatch();
+		}
+
+	visitBatch();
+}
+
+// Call f with the index of the entry of each cell in [cellStart, cellStart + cells) of an input column, in each output column whose
+// receptive field contains it, if it was kept for the active cell of the output column, and the cell relative to cellStart.
+// The groups of the cells of an input column are adjacent, so each output column is looked up once for all of them. As above,
+// the groups of a batch of output columns are prefetched before their entries are visited
+template <typename O, typename F>
+inline void forEachMaskedActiveInColumnEntry(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int inColumn,
+	int cellStart,
+	int cells,
+	O oneHotSize,
+	F f
+) {
+	assert(oneHotSize == mat.outSize.z);
+
+	int stride = maskStride(oneHotSize);
+
+	int outColumns[maskBatchSize];
+	const unsigned int* batch[maskBatchSize];
+	int batchCount = 0;
+
+	auto visitBatch = [&]() {
+		// The values of the cells are adjacent in the output column, so the first ones are prefetched
+		for (int b = 0; b < batchCount; b++)
+			prefetch(valueAddress(mat, mat.topology->keptRanges[outColumns[b]] + batch[b][0]));
+
+		for (int b = 0; b < batchCount; b++) {
+			int oz = nonZeroIndices[outColumns[b]];
+
+			const unsigned int* group = batch[b];
+
+			for (int c = 0; c < cells; c++, group += stride) {
+				SparseOffset j = maskedEntryIndex(mat, outColumns[b], group, oz);
+
+				if (j != -1)
+					f(j, c);
+			}
+		}
+
+		batchCount = 0;
+	};
+
+	forEachReverseField(mat, Int3(inColumn / mat.inSize.y, inColumn % mat.inSize.y, cellStart), [&](int ox, int oy, int offset) {
+		int outColumn = address2(Int2(ox, oy), Int2(mat.outSize.x, mat.outSize.y));
+
+		const unsigned int* group = maskGroup(mat, outColumn, offset, oneHotSize);
+
+		// First and last group of the cells
+		prefetch(group);
+		prefetch(group + (cells - 1) * stride);
+
+		outColumns[batchCount] = outColumn;
+		batch[batchCount++] = group;
+
+		if (batchCount == maskBatchSize)
+			visitBatch();
+	});
+
+	visitBatch();
+}
+
+// --- Generic Addressing ---
+
+// Call f with the index of every entry of a row
+template <typename F>
+inline void forEachRowEntry(
+	const SparseMatrix &mat,
+	int row,
+	F f
+) {
+	if (mat.isLocalRF()) {
+		int num = mat.topology->rowRanges[row + 1] - mat.topology->rowRanges[row];
+
+		int stride = entryStride(mat);
+
+		SparseOffset j = entryIndex(mat, row, 0);
+
+		for (int k = 0; k < num; k++, j += stride)
+			f(j);
+	}
+	else if (mat.isMasked()) {
+		forEachMaskedRowEntry(mat, row, [&](SparseOffset j, int /* column */) {
+			f(j);
+		});
+	}
+	else {
+		for (SparseOffset j = mat.topology->rowRanges[row]; j < mat.topology->rowRanges[row + 1]; j++)
+			f(j);
+	}
+}
+
+// Call f with the index and column of every entry of a row, for matrices that aren't local receptive fields
+template <typename F>
+inline void forEachRowColumnEntry(
+	const SparseMatrix &mat,
+	int row,
+	F f
+) {
+	if (mat.isMasked()) {
+		forEachMaskedRowEntry(mat, row, f);
+
+		return;
+	}
+
+	for (SparseOffset j = mat.topology->rowRanges[row]; j < mat.topology->rowRanges[row + 1]; j++)
+		f(j, mat.topology->columnIndices[j]);
+}
+
+// Call f with the value index and row of every entry of a column, for matrices that aren't local receptive fields.
+// Explicit topologies need the transpose
+template <typename F>
+inline void forEachColumnRowEntry(
+	const SparseMatrix &mat,
+	int column,
+	F f
+) {
+	if (mat.isMasked()) {
+		forEachMaskedColumnEntry(mat, column, f);
+
+		return;
+	}
+
+	for (SparseOffset j = mat.topology->columnRanges[column]; j < mat.topology->columnRanges[column + 1]; j++)
+		f(mat.topology->getValueIndex(j), mat.topology->rowIndices[j]);
+}
+
+// --- Pruned Addressing ---
+
+// One-hot groups of pruned matrices may be missing entries, so the generic kernels can't jump to the active cell of a group.
+// Instead they visit every stored entry along with its group and cell in the group. Masked matrices have their own kernels
+// for the common OHV operations, which do jump to the active cell (see maskedEntryIndex)
+
+// Call f with the index, one-hot group and cell of every entry of a row
+template <typename O, typename F>
+inline void forEachRowGroupEntry(
+	const SparseMatrix &mat,
+	int row,
+	O oneHotSize,
+	F f
+) {
+	forEachRowColumnEntry(mat, row, [&](SparseOffset j, int column) {
+		int i = column / oneHotSize;
+
+		f(j, i, column - i * oneHotSize);
+	});
+}
+
+// Call f with the value index, one-hot group and cell of every entry of a column
+template <typename O, typename F>
+inline void forEachColumnGroupEntry(
+	const SparseMatrix &mat,
+	int column,
+	O oneHotSize,
+	F f
+) {
+	forEachColumnRowEntry(mat, column, [&](SparseOffset j, int row) {
+		int i = row / oneHotSize;
+
+		f(j, i, row - i * oneHotSize);
+	});
+}
+
+// --- Quantized (int8) Kernels ---
+
+inline float multiplyOHVsQuantized(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int row,
+	int oneHotSize
+) {
+	const signed char* values = valueData(mat, mat.nonZeroValues8);
+
+	int sum = 0;
+
+	if (mat.isLocalRF()) {
+		Int3 outPos = rowPosition(mat, row);
+
+		Int2 lowerBound, upperBound;
+		mat.getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+		int stride = entryStride(mat);
+
+		SparseOffset jj = entryIndex(mat, row, 0);
+
+		for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+			for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride)
+				sum += values[jj + nonZeroIndices[address2(Int2(ix, iy), Int2(mat.inSize.x, mat.inSize.y))] * stride];
+	}
+	else if (mat.isMasked()) {
+		forEachMaskedActiveRowEntry(mat, nonZeroIndices, row, [&](SparseOffset j, int /* i */) {
+			sum += values[j];
+		});
+	}
+	else if (mat.pruned) {
+		forEachRowGroupEntry(mat, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+			if (dj == nonZeroIndices[i])
+				sum += values[j];
+		});
+	}
+	else {
+		for (SparseOffset jj = mat.topology->rowRanges[row]; jj < mat.topology->rowRanges[row + 1]; jj += oneHotSize)
+			sum += values[jj + nonZeroIndices[mat.topology->columnIndices[jj] / oneHotSize]];
+	}
+
+	return sum * mat.getRowScaleData()[row];
+}
+
+// Output cells of a column accumulated at a time by the column kernels (stack scratch)
+static const int columnBlockSize = 256;
+
+// Column-blocked layout only
+inline void multiplyOHVsColumnQuantized(
+	const SparseMatrix &mat,
+	const IntBuffer &nonZeroIndices,
+	int outColumn,
+	int oneHotSize,
+	float* sums,
+	float scale
+) {
+	const signed char* values = valueData(mat, mat.nonZeroValues8);
+	const float* rowScales = mat.getRowScaleData();
+
+	int rowStart = outColumn * mat.outSize.z;
+
+	Int2 lowerBound, upperBound;
+	mat.getFieldBounds(Int2(outColumn / mat.outSize.y, outColumn % mat.outSize.y), lowerBound, upperBound);
+
+	// Sums of the quantized weights for output cells [ozStart, ozStart + blockSize), scaled once when added to sums
+	auto accumulate = [&](int ozStart, int blockSize) {
+		int intSums[columnBlockSize];
+
+		for (int oz = 0; oz < blockSize; oz++)
+			intSums[oz] = 0;
+
+		if (mat.isMasked()) {
+			forEachMaskedActiveOutColumnEntry(mat, nonZeroIndices, outColumn, [&](SparseOffset j, int oz) {
+				if (static_cast<unsigned int>(oz - ozStart) < static_cast<unsigned int>(blockSize))
+					intSums[oz - ozStart] += values[j];
+			});
+		}
+		else {
+			SparseOffset jj = mat.topology->rowRanges[rowStart] + ozStart;
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * mat.outSize.z) {
+					const signed char* weights = &values[jj + nonZeroIndices[address2(Int2(ix, iy), Int2(mat.inSize.x, mat.inSize.y))] * mat.outSize.z];
+
+					for (int oz = 0; oz < blockSize; oz++)
+						intSums[oz] += weights[oz];
+				}
+		}
+
+		for (int oz = 0; oz < blockSize; oz++)
+			sums[ozStart + oz] += intSums[oz] * (rowScales[rowStart + ozStart + oz] * scale);
+	};
+
+	// Blocks of output cells that fit on the stack (the whole column for usual sizes)
+	if (mat.outSize.z <= columnBlockSize)
+		accumulate(0, mat.outSize.z);
+	else {
+		for (int ozStart = 0; ozStart < mat.outSize.z; ozStart += columnBlockSize)
+			accumulate(ozStart, std::min(columnBlockSize, mat.outSize.z - ozStart));
+	}
+}
+
+void SparseMatrix::init(
+	int rows,
+	int columns,
+	const std::vector<float> &nonZeroValues,
+	const std::vector<int> &rowRanges,
+	const std::vector<int> &columnIndices
+) {
+	this->rows = rows;
+	this->columns = columns;
+
+	valueType = float32;
+	radius = -1;
+	columnBlocked = false;
+	pruned = false;
+
+	clearExternalValues();
+
+	this->nonZeroValues.assign(nonZeroValues.begin(), nonZeroValues.end());
+
+	std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>();
+
+	t->rowRanges.assign(rowRanges.begin(), rowRanges.end());
+	t->columnIndices.assign(columnIndices.begin(), columnIndices.end());
+
+	topology = t;
+}
+
+void SparseMatrix::init(
+	int rows,
+	int columns,
+	const std::vector<float> &data
+) {
+	this->rows = rows;
+	this->columns = columns;
+
+	valueType = float32;
+	radius = -1;
+	columnBlocked = false;
+	pruned = false;
+
+	clearExternalValues();
+
+	std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>();
+
+	t->rowRanges.reserve(rows + 1);
+	t->rowRanges.push_back(0);
+
+	SparseOffset nonZeroCountInRow = 0; // Only need to set this to zero once because it's cumulative
+	
+	for (int row = 0; row < rows; row++) {
+		int rowOffset = row * columns;
+
+		for (int col = 0; col < columns; col++) {
+			int index = rowOffset + col;
+
+			if (data[index] != 0.0f) {
+				nonZeroValues.push_back(data[index]);
+				t->columnIndices.push_back(col);
+
+				nonZeroCountInRow++;
+			}
+		}
+
+		t->rowRanges.push_back(nonZeroCountInRow);
+	}
+
+	topology = t;
+}
+
+void SparseMatrix::initT() {
+	if (isLocalRF()) {
+		initLocalRFTopology(true);
+
+		return;
+	}
+
+	// Only the column counts are needed, entries are found from the geometry and the masks
+	if (isMasked()) {
+		std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>(*topology);
+
+		t->columnRanges.resize(columns + 1);
+
+		SparseOffset offset = 0;
+
+		for (int i = 0; i < columns; i++) {
+			t->columnRanges[i] = offset;
+
+			forEachMaskedColumnEntry(*this, i, [&](SparseOffset /* j */, int /* row */) {
+				offset++;
+			});
+		}
+
+		t->columnRanges[columns] = offset;
+
+		topology = t;
+
+		return;
+	}
+
+	// Explicit topologies are not shared between different matrices, but may be shared by copies
+	std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>(*topology);
+
+	t->columnRanges.assign(columns + 1, 0);
+
+	t->rowIndices.resize(getNumNonZeroValues());
+
+	// 32-bit value indices where they fit
+	bool wide = getNumNonZeroValues() > std::numeric_limits<int>::max();
+
+	if (wide)
+		t->nonZeroValueIndices64.resize(getNumNonZeroValues());
+	else
+		t->nonZeroValueIndices.resize(getNumNonZeroValues());
+
+	// Pattern for T
+	int nextIndex;
+
+	for (int i = 0; i < rows; i = nextIndex) {
+		nextIndex = i + 1;
+
+		for (SparseOffset j = t->rowRanges[i]; j < t->rowRanges[nextIndex]; j++)
+			t->columnRanges[t->columnIndices[j]]++;
+	}
+
+	// Bring row range array in place using exclusive scan
+	SparseOffset offset = 0;
+
+	for (int i = 0; i < columns; i++) {
+		SparseOffset temp = t->columnRanges[i];
+
+		t->columnRanges[i] = offset;
+
+		offset += temp;
+	}
+
+	t->columnRanges[columns] = offset;
+
+	Buffer<SparseOffset> columnOffsets = t->columnRanges;
+
+	for (int i = 0; i < rows; i = nextIndex) {
+		nextIndex = i + 1;
+
+		for (SparseOffset j = t->rowRanges[i]; j < t->rowRanges[nextIndex]; j++) {
+			int colIndex = t->columnIndices[j];
+
+			SparseOffset nonZeroIndexT = columnOffsets[colIndex];
+
+			t->rowIndices[nonZeroIndexT] = i;
+
+			if (wide)
+				t->nonZeroValueIndices64[nonZeroIndexT] = j;
+			else
+				t->nonZeroValueIndices[nonZeroIndexT] = j;
+
+			columnOffsets[colIndex]++;
+		}
+	}
+
+	topology = t;
+}
+
+void SparseMatrix::releaseT() {
+	if (!hasT())
+		return;
+
+	if (isLocalRF()) {
+		initLocalRFTopology(false);
+
+		return;
+	}
+
+	if (isMasked()) {
+		std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>(*topology);
+
+		t->columnRanges = Buffer<SparseOffset>();
+
+		topology = t;
+
+		return;
+	}
+
+	std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>();
+
+	t->rowRanges = topology->rowRanges;
+	t->columnIndices = topology->columnIndices;
+
+	topology = t;
+}
+
+SparseMatrix &SparseMatrix::operator=(
+	const SparseMatrix &other
+) {
+	rows = other.rows;
+	columns = other.columns;
+
+	valueType = other.valueType;
+
+	nonZeroValues = other.nonZeroValues;
+	nonZeroValues16 = other.nonZeroValues16;
+	nonZeroValues8 = other.nonZeroValues8;
+	rowScales = other.rowScales;
+
+	externalValues = other.externalValues;
+	externalRowScales = other.externalRowScales;
+	numExternalValues = other.numExternalValues;
+	immutable = other.immutable;
+
+	topology = other.topology;
+
+	inSize = other.inSize;
+	outSize = other.outSize;
+	radius = other.radius;
+	columnBlocked = other.columnBlocked;
+	pruned = other.pruned;
+
+	if (isView() && !immutable)
+		ownValues();
+
+	return *this;
+}
+
+void SparseMatrix::setExternalValues(
+	const void* values,
+	SparseOffset numValues,
+	const float* rowScales,
+	bool immutable
+) {
+	assert(reinterpret_cast<size_t>(values) % Arena::alignment == 0);
+	assert(valueType != int8 || rowScales != nullptr);
+
+	nonZeroValues = FloatBuffer();
+	nonZeroValues16 = Buffer<unsigned short>();
+	nonZeroValues8 = Buffer<signed char>();
+	this->rowScales = FloatBuffer();
+
+	externalValues = values;
+	externalRowScales = rowScales;
+	numExternalValues = numValues;
+
+	// Quantized values never learn
+	this->immutable = immutable || valueType == int8;
+}
+
+void SparseMatrix::ownValues() {
+	if (!isView())
+		return;
+
+	switch (valueType) {
+	case float32:
+		nonZeroValues.assign(static_cast<const float*>(externalValues), static_cast<const float*>(externalValues) + numExternalValues);
+
+		break;
+	case int8:
+		nonZeroValues8.assign(static_cast<const signed char*>(externalValues), static_cast<const signed char*>(externalValues) + numExternalValues);
+		rowScales.assign(externalRowScales, externalRowScales + rows);
+
+		break;
+	default:
+		nonZeroValues16.assign(static_cast<const unsigned short*>(externalValues), static_cast<const unsigned short*>(externalValues) + numExternalValues);
+	}
+
+	clearExternalValues();
+}
+
+const void* SparseMatrix::getValueData() const {
+	switch (valueType) {
+	case float32:
+		return valueData(*this, nonZeroValues);
+	case int8:
+		return valueData(*this, nonZeroValues8);
+	default:
+		return valueData(*this, nonZeroValues16);
+	}
+}
+
+int SparseMatrix::getValueSize() const {
+	switch (valueType) {
+	case float32:
+		return sizeof(float);
+	case int8:
+		return sizeof(signed char);
+	default:
+		return sizeof(unsigned short);
+	}
+}
+
+void SparseMatrix::initLocalRFTopology(
+	bool transpose
+) {
+	// Cache of built topologies, keyed by geometry. Entries expire once no matrix uses them
+	typedef std::array<int, 9> Key;
+
+	static std::mutex cacheMutex;
+	static std::map<Key, std::weak_ptr<const SparseTopology>> cache;
+
+	Key key = { inSize.x, inSize.y, inSize.z, outSize.x, outSize.y, outSize.z, radius, columnBlocked, transpose };
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+
+	std::map<Key, std::weak_ptr<const SparseTopology>>::iterator it = cache.find(key);
+
+	if (it != cache.end()) {
+		topology = it->second.lock();
+
+		if (topology != nullptr)
+			return;
+	}
+
+	std::shared_ptr<SparseTopology> t = std::make_shared<SparseTopology>();
+
+	// Field bounds per axis, and from them the reverse ranges. Both bounds are nondecreasing in the output position,
+	// so the output positions whose fields contain an input position run from the first upper bound at or above it to the last lower bound at or below it
+	for (int a = 0; a < 2; a++) {
+		int numOutA = a == 0 ? outSize.x : outSize.y;
+		int numInA = a == 0 ? inSize.x : inSize.y;
+
+		t->fieldLowers[a].resize(numOutA);
+		t->fieldUppers[a].resize(numOutA);
+
+		for (int o = 0; o < numOutA; o++) {
+			Int2 lowerBound, upperBound;
+			getFieldBounds(a == 0 ? Int2(o, 0) : Int2(0, o), lowerBound, upperBound);
+
+			t->fieldLowers[a][o] = a == 0 ? lowerBound.x : lowerBound.y;
+			t->fieldUppers[a][o] = a == 0 ? upperBound.x : upperBound.y;
+		}
+
+		t->reverseLowers[a].resize(numInA);
+		t->reverseUppers[a].resize(numInA);
+
+		int lower = 0;
+		int upper = -1;
+
+		for (int i = 0; i < numInA; i++) {
+			while (lower < numOutA && t->fieldUppers[a][lower] < i)
+				lower++;
+
+			while (upper + 1 < numOutA && t->fieldLowers[a][upper + 1] <= i)
+				upper++;
+
+			t->reverseLowers[a][i] = lower;
+			t->reverseUppers[a][i] = upper;
+		}
+	}
+
+	int numOut = outSize.x * outSize.y * outSize.z;
+
+	t->rowRanges.resize(numOut + 1);
+
+	// Count weights per row
+	for (int ox = 0; ox < outSize.x; ox++)
+		for (int oy = 0; oy < outSize.y; oy++) {
+			// Bounds of receptive field, clamped to input size
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(ox, oy), lowerBound, upperBound);
+
+			int nonZeroInRow = (upperBound.x - lowerBound.x + 1) * (upperBound.y - lowerBound.y + 1) * inSize.z;
+
+			for (int oz = 0; oz < outSize.z; oz++)
+				t->rowRanges[address3(Int3(ox, oy, oz), outSize)] = nonZeroInRow;
+		}
+
+	// Convert rowRanges from counts to cumulative counts
+	SparseOffset offset = 0;
+
+	for (int i = 0; i < numOut; i++) {
+		SparseOffset temp = t->rowRanges[i];
+
+		t->rowRanges[i] = offset;
+
+		offset += temp;
+	}
+
+	t->rowRanges[numOut] = offset;
+
+	if (transpose) {
+		int numIn = inSize.x * inSize.y * inSize.z;
+
+		t->columnRanges.resize(numIn + 1);
+
+		// Only the column counts are needed, entries are found from the geometry.
+		// Receptive fields are separable, so the number of fields covering an input column is the product of the coverage in x and y
+		for (int ix = 0; ix < inSize.x; ix++)
+			for (int iy = 0; iy < inSize.y; iy++) {
+				SparseOffset count = static_cast<SparseOffset>(std::max(0, t->reverseUppers[0][ix] - t->reverseLowers[0][ix] + 1)) *
+					std::max(0, t->reverseUppers[1][iy] - t->reverseLowers[1][iy] + 1) * outSize.z;
+
+				for (int iz = 0; iz < inSize.z; iz++)
+					t->columnRanges[address3(Int3(ix, iy, iz), inSize)] = count;
+			}
+
+		offset = 0;
+
+		for (int i = 0; i < numIn; i++) {
+			SparseOffset temp = t->columnRanges[i];
+
+			t->columnRanges[i] = offset;
+
+			offset += temp;
+		}
+
+		t->columnRanges[numIn] = offset;
+	}
+
+	// Drop expired entries before adding
+	for (it = cache.begin(); it != cache.end();) {
+		if (it->second.expired())
+			it = cache.erase(it);
+		else
+			it++;
+	}
+
+	cache[key] = t;
+
+	topology = t;
+}
+
+void SparseMatrix::setValueType(
+	ValueType valueType
+) {
+	if (valueType == this->valueType)
+		return;
+
+	ownValues();
+
+	// Go through fp32
+	if (this->valueType == int8) {
+		nonZeroValues.resize(nonZeroValues8.size());
+
+		for (int i = 0; i < rows; i++)
+			forEachRowEntry(*this, i, [&](SparseOffset j) {
+				nonZeroValues[j] = nonZeroValues8[j] * rowScales[i];
+			});
+
+		nonZeroValues8.clear();
+		nonZeroValues8.shrink_to_fit();
+		rowScales.clear();
+		rowScales.shrink_to_fit();
+	}
+	else if (this->valueType != float32) {
+		nonZeroValues.resize(nonZeroValues16.size());
+
+		for (std::size_t i = 0; i < nonZeroValues16.size(); i++)
+			nonZeroValues[i] = (this->valueType == bfloat16 ? bfloat16ToFloat(nonZeroValues16[i]) : float16ToFloat(nonZeroValues16[i]));
+
+		nonZeroValues16.clear();
+		nonZeroValues16.shrink_to_fit();
+	}
+
+	this->valueType = valueType;
+
+	if (valueType == int8) {
+		nonZeroValues8.resize(nonZeroValues.size());
+		rowScales.resize(rows);
+
+		// Symmetric quantization, each row is scaled to its largest magnitude
+		for (int i = 0; i < rows; i++) {
+			float maxMagnitude = 0.0f;
+
+			forEachRowEntry(*this, i, [&](SparseOffset j) {
+				maxMagnitude = std::max(maxMagnitude, std::abs(nonZeroValues[j]));
+			});
+
+			rowScales[i] = maxMagnitude / 127.0f;
+
+			float toQuantized = maxMagnitude > 0.0f ? 127.0f / maxMagnitude : 0.0f;
+
+			forEachRowEntry(*this, i, [&](SparseOffset j) {
+				nonZeroValues8[j] = static_cast<signed char>(std::round(nonZeroValues[j] * toQuantized));
+			});
+		}
+
+		nonZeroValues.clear();
+		nonZeroValues.shrink_to_fit();
+	}
+	else if (valueType != float32) {
+		nonZeroValues16.resize(nonZeroValues.size());
+
+		for (std::size_t i = 0; i < nonZeroValues.size(); i++)
+			nonZeroValues16[i] = (valueType == bfloat16 ? floatToBFloat16(nonZeroValues[i]) : floatToFloat16(nonZeroValues[i]));
+
+		nonZeroValues.clear();
+		nonZeroValues.shrink_to_fit();
+	}
+
+	immutable = valueType == int8;
+}
+
+void SparseMatrix::getFieldBounds(
+	const Int2 &outPos,
+	Int2 &lowerBound,
+	Int2 &upperBound
+) const {
+	// Projection constant
+	Float2 outToIn = Float2(static_cast<float>(inSize.x) / static_cast<float>(outSize.x),
+		static_cast<float>(inSize.y) / static_cast<float>(outSize.y));
+
+	Int2 visiblePositionCenter = project(outPos, outToIn);
+
+	lowerBound = Int2(std::max(0, visiblePositionCenter.x - radius), std::max(0, visiblePositionCenter.y - radius));
+	upperBound = Int2(std::min(inSize.x - 1, visiblePositionCenter.x + radius), std::min(inSize.y - 1, visiblePositionCenter.y + radius));
+}
+
+void SparseMatrix::getReverseFieldBounds(
+	const Int2 &inPos,
+	Int2 &lowerBound,
+	Int2 &upperBound
+) const {
+	if (topology != nullptr && !topology->reverseLowers[0].empty()) {
+		lowerBound = Int2(topology->reverseLowers[0][inPos.x], topology->reverseLowers[1][inPos.y]);
+		upperBound = Int2(topology->reverseUppers[0][inPos.x], topology->reverseUppers[1][inPos.y]);
+
+		return;
+	}
+
+	// No tables (pruned), scan around the projected center. Padded by one to cover rounding in the forward projection
+	Float2 inToOut = Float2(static_cast<float>(outSize.x) / static_cast<float>(inSize.x),
+		static_cast<float>(outSize.y) / static_cast<float>(inSize.y));
+
+	Int2 hiddenPositionCenter = project(inPos, inToOut);
+
+	Int2 reverseRadii(static_cast<int>(std::ceil(inToOut.x * (radius + 0.5f))) + 1, static_cast<int>(std::ceil(inToOut.y * (radius + 0.5f))) + 1);
+
+	lowerBound = Int2(outSize.x, outSize.y);
+	upperBound = Int2(-1, -1);
+
+	for (int ox = std::max(0, hiddenPositionCenter.x - reverseRadii.x); ox <= std::min(outSize.x - 1, hiddenPositionCenter.x + reverseRadii.x); ox++) {
+		Int2 fieldLowerBound, fieldUpperBound;
+		getFieldBounds(Int2(ox, 0), fieldLowerBound, fieldUpperBound);
+
+		if (inPos.x >= fieldLowerBound.x && inPos.x <= fieldUpperBound.x) {
+			lowerBound.x = std::min(lowerBound.x, ox);
+			upperBound.x = ox;
+		}
+	}
+
+	for (int oy = std::max(0, hiddenPositionCenter.y - reverseRadii.y); oy <= std::min(outSize.y - 1, hiddenPositionCenter.y + reverseRadii.y); oy++) {
+		Int2 fieldLowerBound, fieldUpperBound;
+		getFieldBounds(Int2(0, oy), fieldLowerBound, fieldUpperBound);
+
+		if (inPos.y >= fieldLowerBound.y && inPos.y <= fieldUpperBound.y) {
+			lowerBound.y = std::min(lowerBound.y, oy);
+			upperBound.y = oy;
+		}
+	}
+}
+
+int SparseMatrix::countFields(
+	const Int2 &outPos
+) const {
+	Int2 lowerBound, upperBound;
+	getFieldBounds(outPos, lowerBound, upperBound);
+
+	return (upperBound.x - lowerBound.x + 1) * (upperBound.y - lowerBound.y + 1);
+}
+
+int SparseMatrix::countFieldsT(
+	const Int2 &inPos
+) const {
+	Int2 lowerBound, upperBound;
+	getReverseFieldBounds(inPos, lowerBound, upperBound);
+
+	return std::max(0, upperBound.x - lowerBound.x + 1) * std::max(0, upperBound.y - lowerBound.y + 1);
+}
+
+SparseOffset SparseMatrix::prune(
+	float threshold,
+	int oneHotSize,
+	int keepPerGroup
+) {
+	ownValues();
+
+	bool transpose = hasT();
+
+	auto magnitude = [&](int row, SparseOffset j) {
+		return valueType == int8 ? std::abs(nonZeroValues8[j] * rowScales[row]) : std::abs(visitValues(*this, [&](auto values) { return values.get(j); }));
+	};
+
+	// Reduce the magnitudes of a one-hot group (with their positions, in order) to the ones to keep, in order
+	auto select = [&](std::vector<std::pair<float, std::size_t>> &groupMagnitudes) {
+		// Largest first, ties keep their order
+		if (keepPerGroup > 0 && groupMagnitudes.size() > static_cast<std::size_t>(keepPerGroup)) {
+			std::stable_sort(groupMagnitudes.begin(), groupMagnitudes.end(), [](const std::pair<float, std::size_t> &lhs, const std::pair<float, std::size_t> &rhs) {
+				return lhs.first > rhs.first;
+			});
+
+			groupMagnitudes.resize(keepPerGroup);
+
+			// Back to their order
+			std::sort(groupMagnitudes.begin(), groupMagnitudes.end(), [](const std::pair<float, std::size_t> &lhs, const std::pair<float, std::size_t> &rhs) {
+				return lhs.second < rhs.second;
+			});
+		}
+
+		groupMagnitudes.erase(std::remove_if(groupMagnitudes.begin(), groupMagnitudes.end(), [&](const std::pair<float, std::size_t> &m) {
+			return m.first < threshold;
+		}), groupMagnitudes.end());
+	};
+
+	// Indices of the kept entries, in their new order
+	std::vector<SparseOffset> kept;
+
+	std::vector<std::pair<float, std::size_t>> groupMagnitudes; // Magnitude and position of each entry of a group
+
+	std::shared_ptr<SparseTopology> t;
+
+	if (radius >= 0) {
+		// The geometry stays, a mask of the kept output cells is added to each column-blocked group
+		assert(oneHotSize == inSize.z);
+
+		t = std::make_shared<SparseTopology>(*topology);
+
+		t->columnRanges = Buffer<SparseOffset>();
+
+		int numOutColumns = outSize.x * outSize.y;
+		int stride = maskStride(outSize.z);
+
+		t->keptRanges.resize(numOutColumns + 1);
+		t->cellMasks.assign(topology->rowRanges[rows] / outSize.z * stride, 0);
+
+		std::vector<SparseOffset> sources; // Index of each entry of an output column, [offset][output cell], -1 if removed
+		std::vector<std::pair<int, SparseOffset>> groupEntries; // Offset and index of each remaining entry of a group
+
+		for (int outColumn = 0; outColumn < numOutColumns; outColumn++) {
+			int rowStart = outColumn * outSize.z;
+			int numOffsets = (topology->rowRanges[rowStart + outSize.z] - topology->rowRanges[rowStart]) / outSize.z;
+
+			sources.assign(static_cast<std::size_t>(numOffsets) * outSize.z, -1);
+
+			for (int oz = 0; oz < outSize.z; oz++) {
+				// One-hot groups are the input columns
+				for (int start = 0; start < numOffsets; start += inSize.z) {
+					groupMagnitudes.clear();
+					groupEntries.clear();
+
+					for (int offset = start; offset < start + inSize.z; offset++) {
+						SparseOffset j = isLocalRF() ? entryIndex(*this, rowStart + oz, offset) : maskedEntryIndex(*this, outColumn, maskGroup(*this, outColumn, offset, outSize.z), oz);
+
+						if (j == -1)
+							continue;
+
+						groupMagnitudes.push_back(std::make_pair(magnitude(rowStart + oz, j), groupEntries.size()));
+						groupEntries.push_back(std::make_pair(offset, j));
+					}
+
+					select(groupMagnitudes);
+
+					for (std::size_t k = 0; k < groupMagnitudes.size(); k++) {
+						const std::pair<int, SparseOffset> &entry = groupEntries[groupMagnitudes[k].second];
+
+						sources[static_cast<std::size_t>(entry.first) * outSize.z + oz] = entry.second;
+					}
+				}
+			}
+
+			// Kept entries by group, then output cell
+			t->keptRanges[outColumn] = kept.size();
+
+			unsigned int* group = &t->cellMasks[topology->rowRanges[rowStart] / outSize.z * stride];
+
+			for (int offset = 0; offset < numOffsets; offset++, group += stride) {
+				group[0] = kept.size() - t->keptRanges[outColumn];
+
+				for (int oz = 0; oz < outSize.z; oz++) {
+					SparseOffset j = sources[static_cast<std::size_t>(offset) * outSize.z + oz];
+
+					if (j == -1)
+						continue;
+
+					group[1 + oz / 32] |= 1u << (oz % 32);
+
+					kept.push_back(j);
+				}
+			}
+		}
+
+		t->keptRanges[numOutColumns] = kept.size();
+
+		columnBlocked = true;
+	}
+	else {
+		t = std::make_shared<SparseTopology>();
+
+		t->rowRanges.resize(rows + 1);
+
+		std::vector<std::pair<int, SparseOffset>> rowEntries; // Column and index of each entry of a row, by column
+
+		for (int i = 0; i < rows; i++) {
+			t->rowRanges[i] = kept.size();
+
+			rowEntries.clear();
+
+			for (SparseOffset j = topology->rowRanges[i]; j < topology->rowRanges[i + 1]; j++)
+				rowEntries.push_back(std::make_pair(topology->columnIndices[j], j));
+
+			// One-hot groups are runs of entries with the same input column
+			for (std::size_t start = 0; start < rowEntries.size();) {
+				int group = rowEntries[start].first / oneHotSize;
+
+				std::size_t end = start + 1;
+
+				while (end < rowEntries.size() && rowEntries[end].first / oneHotSize == group)
+					end++;
+
+				groupMagnitudes.clear();
+
+				for (std::size_t k = start; k < end; k++)
+					groupMagnitudes.push_back(std::make_pair(magnitude(i, rowEntries[k].second), k));
+
+				select(groupMagnitudes);
+
+				for (std::size_t k = 0; k < groupMagnitudes.size(); k++) {
+					kept.push_back(rowEntries[groupMagnitudes[k].second].second);
+					t->columnIndices.push_back(rowEntries[groupMagnitudes[k].second].first);
+				}
+
+				start = end;
+			}
+		}
+
+		t->rowRanges[rows] = kept.size();
+	}
+
+	// Only the buffer of the current storage type is non-empty
+	auto compact = [&](auto &buffer) {
+		if (buffer.empty())
+			return;
+
+		typename std::decay<decltype(buffer)>::type compacted(kept.size());
+
+		for (std::size_t k = 0; k < kept.size(); k++)
+			compacted[k] = buffer[kept[k]];
+
+		buffer.swap(compacted);
+	};
+
+	compact(nonZeroValues);
+	compact(nonZeroValues16);
+	compact(nonZeroValues8);
+
+	topology = t;
+
+	pruned = true;
+
+	if (transpose)
+		initT();
+
+	return kept.size();
+}
+
+float SparseMatrix::multiply(
+	const FloatBuffer &in,
+	int row
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+					for (int iz = 0; iz < inSize.z; iz++, j += stride)
+						sum += values.get(j) * in[columnStart + iz];
+				}
+
+			return sum;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			sum += values.get(j) * in[column];
+		});
+
+		return sum;
+	});
+}
+
+float SparseMatrix::distance2(
+	const FloatBuffer &in,
+	int row
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+					for (int iz = 0; iz < inSize.z; iz++, j += stride) {
+						float delta = in[columnStart + iz] - values.get(j);
+
+						sum += delta * delta;
+					}
+				}
+
+			return sum;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			float delta = in[column] - values.get(j);
+
+			sum += delta * delta;
+		});
+
+		return sum;
+	});
+}
+
+int SparseMatrix::count(
+	int row
+) {
+	if (isMasked()) {
+		int num = 0;
+
+		forEachMaskedRowEntry(*this, row, [&](SparseOffset /* j */, int /* column */) {
+			num++;
+		});
+
+		return num;
+	}
+
+	int nextIndex = row + 1;
+	
+	return topology->rowRanges[nextIndex] - topology->rowRanges[row];
+}
+
+float SparseMatrix::count(
+	const FloatBuffer &in,
+	int row
+) {
+	float sum = 0.0f;
+
+	if (isLocalRF()) {
+		Int3 outPos = rowPosition(*this, row);
+
+		Int2 lowerBound, upperBound;
+		getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+		for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+			for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+				int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+				for (int iz = 0; iz < inSize.z; iz++)
+					sum += in[columnStart + iz];
+			}
+
+		return sum;
+	}
+
+	forEachRowColumnEntry(*this, row, [&](SparseOffset /* j */, int column) {
+		sum += in[column];
+	});
+
+	return sum;
+}
+
+void SparseMatrix::fill(
+	int row,
+    float value
+) {
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int e = 0; e < count(row); e++, j += stride)
+				values.set(j, value);
+
+			return;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int /* column */) {
+			values.set(j, value);
+		});
+	});
+}
+
+float SparseMatrix::total(
+	int row
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int e = 0; e < count(row); e++, j += stride)
+				sum += values.get(j);
+
+			return sum;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int /* column */) {
+			sum += values.get(j);
+		});
+
+		return sum;
+	});
+}
+
+float SparseMatrix::multiplyT(
+	const FloatBuffer &in,
+	int column
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
+
+				for (int oz = 0; oz < outSize.z; oz++)
+					sum += values.get(entryIndex(*this, rowStart + oz, offset)) * in[rowStart + oz];
+			});
+
+			return sum;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int row) {
+			sum += values.get(j) * in[row];
+		});
+
+		return sum;
+	});
+}
+
+float SparseMatrix::distance2T(
+	const FloatBuffer &in,
+	int column
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
+
+				for (int oz = 0; oz < outSize.z; oz++) {
+					float delta = in[rowStart + oz] - values.get(entryIndex(*this, rowStart + oz, offset));
+
+					sum += delta * delta;
+				}
+			});
+
+			return sum;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int row) {
+			float delta = in[row] - values.get(j);
+	
+			sum += delta * delta;
+		});
+
+		return sum;
+	});
+}
+
+int SparseMatrix::countT(
+	int column
+) {
+	int nextIndex = column + 1;
+	
+	return topology->columnRanges[nextIndex] - topology->columnRanges[column];
+}
+
+float SparseMatrix::countT(
+	const FloatBuffer &in,
+	int column
+) {
+	float sum = 0.0f;
+
+	if (isLocalRF()) {
+		Int3 inPos = columnPosition(*this, column);
+
+		forEachReverseField(*this, inPos, [&](int ox, int oy, int /* offset */) {
+			int rowStart = address3(Int3(ox, oy, 0), outSize);
+
+			for (int oz = 0; oz < outSize.z; oz++)
+				sum += in[rowStart + oz];
+		});
+
+		return sum;
+	}
+
+	forEachColumnRowEntry(*this, column, [&](SparseOffset /* j */, int row) {
+		sum += in[row];
+	});
+
+	return sum;
+}
+
+void SparseMatrix::fillT(
+	int column,
+    float value
 ) {
-	rows = rows;
-	columns = columns;
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
 
-	this->nonZeroValues = nonZeroValues;
-	this->rowRanges = rowRanges;
-	this->columnIndices = columnIndices;
+				for (int oz = 0; oz < outSize.z; oz++)
+					values.set(entryIndex(*this, rowStart + oz, offset), value);
+			});
+
+			return;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int /* row */) {
+			values.set(j, value);
+		});
+	});
 }
 
-void SparseMatrix::init(
-	int rows,
-	int columns,
-	const std::vector<float> &data
+float SparseMatrix::totalT(
+	int column
+) {
+	return visitValues(*this, [&](auto values) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
+
+				for (int oz = 0; oz < outSize.z; oz++)
+					sum += values.get(entryIndex(*this, rowStart + oz, offset));
+			});
+
+			return sum;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int /* row */) {
+			sum += values.get(j);
+		});
+
+		return sum;
+	});
+}
+
+float SparseMatrix::multiplyOHVs(
+	const IntBuffer &nonZeroIndices,
+	int row,
+	int oneHotSize
 ) {
-	rows = rows;
-	columns = columns;
+	if (valueType == int8)
+		return multiplyOHVsQuantized(*this, nonZeroIndices, row, oneHotSize);
+
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
 
-	rowRanges.reserve(rows + 1);
-	rowRanges.push_back(0);
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
 
-	int nonZeroCountInRow = 0; // Only need to set this to zero once because it's cumulative
+			int stride = entryStride(*this);
+
+			SparseOffset jj = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride)
+					sum += values.get(jj + nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))] * stride);
+
+			return sum;
+		}
+
+		if (isMasked()) {
+			forEachMaskedActiveRowEntry(*this, nonZeroIndices, row, [&](SparseOffset j, int /* i */) {
+				sum += values.get(j);
+			});
+
+			return sum;
+		}
+
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					sum += values.get(j);
+			});
+
+			return sum;
+		}
+
+		int nextIndex = row + 1;
 	
-	for (int row = 0; row < rows; row++) {
-		int rowOffset = row * columns;
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			SparseOffset j = jj + nonZeroIndices[topology->columnIndices[jj] / oneHotSize];
 
-		for (int col = 0; col < columns; col++) {
-			int index = rowOffset + col;
+			sum += values.get(j);
+		}
 
-			if (data[index] != 0.0f) {
-				nonZeroValues.push_back(data[index]);
-				columnIndices.push_back(col);
+		return sum;
+	});
+}
 
-				nonZeroCountInRow++;
-			}
+float SparseMatrix::multiplyOHVsT(
+	const IntBuffer &nonZeroIndices,
+	int column,
+	int oneHotSize
+) {
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float sum = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
+
+				sum += values.get(entryIndex(*this, outColumnIndex * oneHotSize + nonZeroIndices[outColumnIndex], offset));
+			});
+
+			return sum;
 		}
 
-		rowRanges.push_back(nonZeroCountInRow);
-	}
+		if (isMasked()) {
+			forEachMaskedActiveColumnEntry(*this, nonZeroIndices, column, oneHotSize, [&](SparseOffset j, int /* i */) {
+				sum += values.get(j);
+			});
+
+			return sum;
+		}
+
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					sum += values.get(j);
+			});
+
+			return sum;
+		}
+
+		int nextIndex = column + 1;
+	
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			SparseOffset j = jj + nonZeroIndices[topology->rowIndices[jj] / oneHotSize];
+
+			sum += values.get(topology->getValueIndex(j));
+		}
+
+		return sum;
+	});
 }
 
-void SparseMatrix::initT() {
-	columnRanges.resize(columns + 1, 0);
+float SparseMatrix::multiplyOHVs(
+	const IntBuffer &nonZeroIndices,
+	const FloatBuffer &nonZeroScalars,
+	int row,
+	int oneHotSize
+) {
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float sum = 0.0f;
 
-	rowIndices.resize(nonZeroValues.size());
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
 
-	nonZeroValueIndices.resize(nonZeroValues.size());
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
 
-	// Pattern for T
-	int nextIndex;
+			int stride = entryStride(*this);
 
-	for (int i = 0; i < rows; i = nextIndex) {
-		nextIndex = i + 1;
+			SparseOffset jj = entryIndex(*this, row, 0);
 
-		for (int j = rowRanges[i]; j < rowRanges[nextIndex]; j++)
-			columnRanges[columnIndices[j]]++;
-	}
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride) {
+					int i = address2(Int2(ix, iy), Int2(inSize.x, inSize.y));
 
-	// Bring row range array in place using exclusive scan
-	int offset = 0;
+					sum += values.get(jj + nonZeroIndices[i] * stride) * nonZeroScalars[i];
+				}
 
-	for (int i = 0; i < columns; i++) {
-		int temp = columnRanges[i];
+			return sum;
+		}
 
-		columnRanges[i] = offset;
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					sum += values.get(j) * nonZeroScalars[i];
+			});
 
-		offset += temp;
-	}
+			return sum;
+		}
 
-	columnRanges[columns] = offset;
+		int nextIndex = row + 1;
+	
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			int i = topology->columnIndices[jj] / oneHotSize;
+			SparseOffset j = jj + nonZeroIndices[i];
 
-	std::vector<int> columnOffsets = columnRanges;
+			sum += values.get(j) * nonZeroScalars[i];
+		}
 
-	for (int i = 0; i < rows; i = nextIndex) {
-		nextIndex = i + 1;
+		return sum;
+	});
+}
+
+float SparseMatrix::multiplyOHVsT(
+	const IntBuffer &nonZeroIndices,
+	const FloatBuffer &nonZeroScalars,
+	int column,
+	int oneHotSize
+) {
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float sum = 0.0f;
 
-		for (int j = rowRanges[i]; j < rowRanges[nextIndex]; j++) {
-			int colIndex = columnIndices[j];
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
 
-			int nonZeroIndexT = columnOffsets[colIndex];
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int i = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
 
-			rowIndices[nonZeroIndexT] = i;
+				sum += values.get(entryIndex(*this, i * oneHotSize + nonZeroIndices[i], offset)) * nonZeroScalars[i];
+			});
 
-			nonZeroValueIndices[nonZeroIndexT] = j;
+			return sum;
+		}
 
-			columnOffsets[colIndex]++;
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					sum += values.get(j) * nonZeroScalars[i];
+			});
+
+			return sum;
+		}
+
+		int nextIndex = column + 1;
+	
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			int i = topology->rowIndices[jj] / oneHotSize;
+			SparseOffset j = jj + nonZeroIndices[i];
+
+			sum += values.get(topology->getValueIndex(j)) * nonZeroScalars[i];
 		}
+
+		return sum;
+	});
+}
+
+void SparseMatrix::multiplyOHVsColumn(
+	const IntBuffer &nonZeroIndices,
+	int outColumn,
+	int oneHotSize,
+	float* sums,
+	float scale
+) {
+	assert(radius >= 0);
+
+	int rowStart = outColumn * outSize.z;
+
+	if (!columnBlocked) {
+		for (int oz = 0; oz < outSize.z; oz++)
+			sums[oz] += multiplyOHVs(nonZeroIndices, rowStart + oz, oneHotSize) * scale;
+
+		return;
+	}
+
+	if (valueType == int8) {
+		multiplyOHVsColumnQuantized(*this, nonZeroIndices, outColumn, oneHotSize, sums, scale);
+
+		return;
 	}
+
+	visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		Int2 lowerBound, upperBound;
+		getFieldBounds(Int2(outColumn / outSize.y, outColumn % outSize.y), lowerBound, upperBound);
+
+		// Unscaled sums of this matrix for output cells [ozStart, ozStart + blockSize), scaled once when added to sums
+		auto accumulate = [&](int ozStart, int blockSize) {
+			float columnSums[columnBlockSize];
+
+			for (int oz = 0; oz < blockSize; oz++)
+				columnSums[oz] = 0.0f;
+
+			if (isMasked()) {
+				forEachMaskedActiveOutColumnEntry(*this, nonZeroIndices, outColumn, [&](SparseOffset j, int oz) {
+					if (static_cast<unsigned int>(oz - ozStart) < static_cast<unsigned int>(blockSize))
+						columnSums[oz - ozStart] += values.get(j);
+				});
+			}
+			else {
+				SparseOffset jj = topology->rowRanges[rowStart] + ozStart;
+
+				// Each input column is a contiguous [input cell][output cell] block
+				for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+					for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * outSize.z) {
+						SparseOffset weightsStart = jj + nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))] * outSize.z;
+
+						for (int oz = 0; oz < blockSize; oz++)
+							columnSums[oz] += values.get(weightsStart + oz);
+					}
+			}
+
+			for (int oz = 0; oz < blockSize; oz++)
+				sums[ozStart + oz] += columnSums[oz] * scale;
+		};
+
+		// Blocks of output cells that fit on the stack (the whole column for usual sizes)
+		if (outSize.z <= columnBlockSize)
+			accumulate(0, outSize.z);
+		else {
+			for (int ozStart = 0; ozStart < outSize.z; ozStart += columnBlockSize)
+				accumulate(ozStart, std::min(columnBlockSize, outSize.z - ozStart));
+		}
+	});
 }
 
-float SparseMatrix::multiply(
-	const std::vector<float> &in,
-	int row
+void SparseMatrix::multiplyOHVsColumnT(
+	const IntBuffer &nonZeroIndices,
+	int inColumn,
+	int oneHotSize,
+	float* sums,
+	float scale
 ) {
-	float sum = 0.0f;
+	assert(radius >= 0);
 
-	int nextIndex = row + 1;
+	visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		// Unscaled sums of input cells [izStart, izStart + blockSize), scaled once when added to sums
+		auto accumulate = [&](int izStart, int blockSize) {
+			float columnSums[columnBlockSize];
+
+			for (int iz = 0; iz < blockSize; iz++)
+				columnSums[iz] = 0.0f;
+
+			if (isMasked()) {
+				forEachMaskedActiveInColumnEntry(*this, nonZeroIndices, inColumn, izStart, blockSize, oneHotSize, [&](SparseOffset j, int iz) {
+					columnSums[iz] += values.get(j);
+				});
+			}
+			else {
+				int stride = entryStride(*this);
+
+				// The cells of the input column are consecutive offsets into the rows of each output column
+				forEachReverseField(*this, Int3(inColumn / inSize.y, inColumn % inSize.y, izStart), [&](int ox, int oy, int offset) {
+					int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
+
+					SparseOffset j = entryIndex(*this, outColumnIndex * oneHotSize + nonZeroIndices[outColumnIndex], offset);
+
+					for (int iz = 0; iz < blockSize; iz++)
+						columnSums[iz] += values.get(j + iz * stride);
+				});
+			}
+
+			for (int iz = 0; iz < blockSize; iz++)
+				sums[izStart + iz] += columnSums[iz] * scale;
+		};
+
+		// Blocks of input cells that fit on the stack (the whole column for usual sizes)
+		if (inSize.z <= columnBlockSize)
+			accumulate(0, inSize.z);
+		else {
+			for (int izStart = 0; izStart < inSize.z; izStart += columnBlockSize)
+				accumulate(izStart, std::min(columnBlockSize, inSize.z - izStart));
+		}
+	});
+}
+
+float SparseMatrix::distance2OHVs(
+	const IntBuffer &nonZeroIndices,
+	int row,
+	int oneHotSize
+) {
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float dist = 0.0f;
+
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset jj = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride) {
+					int targetDJ = nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))];
+
+					for (int dj = 0; dj < oneHotSize; dj++) {
+						float delta = (dj == targetDJ ? 1.0f : 0.0f) - values.get(jj + dj * stride);
+
+						dist += delta * delta;
+					}
+				}
+
+			return dist;
+		}
+
+		// Removed weights are left out of the distance
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float delta = (dj == nonZeroIndices[i] ? 1.0f : 0.0f) - values.get(j);
+
+				dist += delta * delta;
+			});
+
+			return dist;
+		}
+
+		int nextIndex = row + 1;
 	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		sum += nonZeroValues[j] * in[columnIndices[j]];
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			int targetDJ = nonZeroIndices[topology->columnIndices[jj] / oneHotSize];
 
-	return sum;
+			for (int dj = 0; dj < oneHotSize; dj++) {
+				float delta = (dj == targetDJ ? 1.0f : 0.0f) - values.get(jj + dj);
+
+				dist += delta * delta;
+			}
+		}
+
+		return dist;
+	});
 }
 
-float SparseMatrix::distance2(
-	const std::vector<float> &in,
-	int row
+float SparseMatrix::distance2OHVsT(
+	const IntBuffer &nonZeroIndices,
+	int column,
+	int oneHotSize
 ) {
-	float sum = 0.0f;
+	return visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		float dist = 0.0f;
 
-	int nextIndex = row + 1;
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
+
+				int targetDJ = nonZeroIndices[outColumnIndex];
+
+				for (int dj = 0; dj < oneHotSize; dj++) {
+					float delta = (dj == targetDJ ? 1.0f : 0.0f) - values.get(entryIndex(*this, outColumnIndex * oneHotSize + dj, offset));
+
+					dist += delta * delta;
+				}
+			});
+
+			return dist;
+		}
+
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float delta = (dj == nonZeroIndices[i] ? 1.0f : 0.0f) - values.get(j);
+
+				dist += delta * delta;
+			});
+
+			return dist;
+		}
+
+		int nextIndex = column + 1;
 	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++) {
-		float delta = in[columnIndices[j]] - nonZeroValues[j];
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			int targetDJ = nonZeroIndices[topology->rowIndices[jj] / oneHotSize];
+
+			for (int dj = 0; dj < oneHotSize; dj++) {
+				float delta = (dj == targetDJ ? 1.0f : 0.0f) - values.get(topology->getValueIndex(jj + dj));
+
+				dist += delta * delta;
+			}
+		}
+
+		return dist;
+	});
+}
+
+void SparseMatrix::multiply(
+	const std::vector<const FloatBuffer*> &ins,
+	int row,
+	float* sums
+) {
+	int numInputs = ins.size();
+
+	for (int b = 0; b < numInputs; b++)
+		sums[b] = 0.0f;
+
+	visitValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+					for (int iz = 0; iz < inSize.z; iz++, j += stride) {
+						float value = values.get(j);
+
+						for (int b = 0; b < numInputs; b++)
+							sums[b] += value * (*ins[b])[columnStart + iz];
+					}
+				}
+
+			return;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			float value = values.get(j);
+
+			for (int b = 0; b < numInputs; b++)
+				sums[b] += value * (*ins[b])[column];
+		});
+	});
+}
+
+void SparseMatrix::distance2(
+	const std::vector<const FloatBuffer*> &ins,
+	int row,
+	float* sums
+) {
+	int numInputs = ins.size();
+
+	for (int b = 0; b < numInputs; b++)
+		sums[b] = 0.0f;
+
+	visitValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+					for (int iz = 0; iz < inSize.z; iz++, j += stride) {
+						float value = values.get(j);
+
+						for (int b = 0; b < numInputs; b++) {
+							float delta = (*ins[b])[columnStart + iz] - value;
+
+							sums[b] += delta * delta;
+						}
+					}
+				}
+
+			return;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			float value = values.get(j);
+
+			for (int b = 0; b < numInputs; b++) {
+				float delta = (*ins[b])[column] - value;
+
+				sums[b] += delta * delta;
+			}
+		});
+	});
+}
+
+void SparseMatrix::multiplyOHVs(
+	const std::vector<const IntBuffer*> &nonZeroIndices,
+	int row,
+	int oneHotSize,
+	float* sums
+) {
+	int numInputs = nonZeroIndices.size();
 
-		sum += delta * delta;
+	if (valueType == int8) {
+		for (int b = 0; b < numInputs; b++)
+			sums[b] = multiplyOHVsQuantized(*this, *nonZeroIndices[b], row, oneHotSize);
+
+		return;
 	}
 
-	return sum;
-}
+	for (int b = 0; b < numInputs; b++)
+		sums[b] = 0.0f;
+
+	visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		// All inputs select from the same one-hot group of weights, so it is loaded once and then read from L1
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset jj = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride) {
+					int inColumnIndex = address2(Int2(ix, iy), Int2(inSize.x, inSize.y));
+
+					for (int b = 0; b < numInputs; b++)
+						sums[b] += values.get(jj + (*nonZeroIndices[b])[inColumnIndex] * stride);
+				}
+
+			return;
+		}
+
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float value = values.get(j);
 
-int SparseMatrix::count(
-	int row
-) {
-	int nextIndex = row + 1;
-	
-	return rowRanges[nextIndex] - rowRanges[row];
-}
+				for (int b = 0; b < numInputs; b++)
+					sums[b] += (dj == (*nonZeroIndices[b])[i] ? value : 0.0f);
+			});
 
-float SparseMatrix::count(
-	const std::vector<float> &in,
-	int row
-) {
-	float sum = 0.0f;
+			return;
+		}
 
-	int nextIndex = row + 1;
+		int nextIndex = row + 1;
 	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		sum += in[columnIndices[j]];
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			int inColumnIndex = topology->columnIndices[jj] / oneHotSize;
 
-	return sum;
+			for (int b = 0; b < numInputs; b++)
+				sums[b] += values.get(jj + (*nonZeroIndices[b])[inColumnIndex]);
+		}
+	});
 }
 
-void SparseMatrix::fill(
-	int row,
-    float value
+void SparseMatrix::multiplyOHVsT(
+	const std::vector<const IntBuffer*> &nonZeroIndices,
+	int column,
+	int oneHotSize,
+	float* sums
 ) {
-	float sum = 0.0f;
+	int numInputs = nonZeroIndices.size();
 
-	int nextIndex = row + 1;
-	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		nonZeroValues[j] = value;
-}
+	for (int b = 0; b < numInputs; b++)
+		sums[b] = 0.0f;
 
-float SparseMatrix::total(
-	int row
-) {
-	float sum = 0.0f;
+	visitValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
 
-	int nextIndex = row + 1;
-	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		sum += nonZeroValues[j];
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
 
-	return sum;
-}
+				for (int b = 0; b < numInputs; b++)
+					sums[b] += values.get(entryIndex(*this, outColumnIndex * oneHotSize + (*nonZeroIndices[b])[outColumnIndex], offset));
+			});
 
-float SparseMatrix::multiplyT(
-	const std::vector<float> &in,
-	int column
-) {
-	float sum = 0.0f;
+			return;
+		}
 
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		sum += nonZeroValues[nonZeroValueIndices[j]] * in[rowIndices[j]];
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float value = values.get(j);
 
-	return sum;
-}
+				for (int b = 0; b < numInputs; b++)
+					sums[b] += (dj == (*nonZeroIndices[b])[i] ? value : 0.0f);
+			});
 
-float SparseMatrix::distance2T(
-	const std::vector<float> &in,
-	int column
-) {
-	float sum = 0.0f;
+			return;
+		}
 
-	int nextIndex = column + 1;
+		int nextIndex = column + 1;
 	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++) {
-		float delta = in[rowIndices[j]] - nonZeroValues[nonZeroValueIndices[j]];
-	
-		sum += delta * delta;
-	}
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			int outColumnIndex = topology->rowIndices[jj] / oneHotSize;
 
-	return sum;
+			for (int b = 0; b < numInputs; b++)
+				sums[b] += values.get(topology->getValueIndex(jj + (*nonZeroIndices[b])[outColumnIndex]));
+		}
+	});
 }
 
-int SparseMatrix::countT(
-	int column
+void SparseMatrix::deltas(
+	const FloatBuffer &in,
+	float delta,
+	int row
 ) {
-	int nextIndex = column + 1;
-	
-	return columnRanges[nextIndex] - columnRanges[column];
-}
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
 
-float SparseMatrix::countT(
-	const std::vector<float> &in,
-	int column
-) {
-	float sum = 0.0f;
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
 
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		sum += in[rowIndices[j]];
+			int stride = entryStride(*this);
 
-	return sum;
-}
+			SparseOffset j = entryIndex(*this, row, 0);
 
-void SparseMatrix::fillT(
-	int column,
-    float value
-) {
-	float sum = 0.0f;
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
 
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		nonZeroValues[nonZeroValueIndices[j]] = value;
+					for (int iz = 0; iz < inSize.z; iz++, j += stride)
+						values.add(j, delta * in[columnStart + iz]);
+				}
+
+			return;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			values.add(j, delta * in[column]);
+		});
+	});
 }
 
-float SparseMatrix::totalT(
+void SparseMatrix::deltasT(
+	const FloatBuffer &in,
+	float delta,
 	int column
 ) {
-	float sum = 0.0f;
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
 
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		sum += nonZeroValues[nonZeroValueIndices[j]];
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
 
-	return sum;
+				for (int oz = 0; oz < outSize.z; oz++)
+					values.add(entryIndex(*this, rowStart + oz, offset), delta * in[rowStart + oz]);
+			});
+
+			return;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int row) {
+			values.add(j, delta * in[row]);
+		});
+	});
 }
 
-float SparseMatrix::multiplyOHVs(
-	const std::vector<int> &nonZeroIndices,
+void SparseMatrix::deltaOHVs(
+	const IntBuffer &nonZeroIndices,
+	float delta,
 	int row,
 	int oneHotSize
 ) {
-	float sum = 0.0f;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
 
-	int nextIndex = row + 1;
-	
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int j = jj + nonZeroIndices[columnIndices[jj] / oneHotSize];
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
 
-		sum += nonZeroValues[j];
-	}
+			int stride = entryStride(*this);
 
-	return sum;
-}
+			SparseOffset jj = entryIndex(*this, row, 0);
 
-float SparseMatrix::multiplyOHVsT(
-	const std::vector<int> &nonZeroIndices,
-	int column,
-	int oneHotSize
-) {
-	float sum = 0.0f;
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride)
+					values.add(jj + nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))] * stride, delta);
 
-	int nextIndex = column + 1;
-	
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int j = jj + nonZeroIndices[rowIndices[jj] / oneHotSize];
+			return;
+		}
 
-		sum += nonZeroValues[nonZeroValueIndices[j]];
-	}
+		if (isMasked()) {
+			forEachMaskedActiveRowEntry(*this, nonZeroIndices, row, [&](SparseOffset j, int /* i */) {
+				values.add(j, delta);
+			});
 
-	return sum;
-}
+			return;
+		}
 
-float SparseMatrix::multiplyOHVs(
-	const std::vector<int> &nonZeroIndices,
-	const std::vector<float> &nonZeroScalars,
-	int row,
-	int oneHotSize
-) {
-	float sum = 0.0f;
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					values.add(j, delta);
+			});
 
-	int nextIndex = row + 1;
-	
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int i = columnIndices[jj] / oneHotSize;
-		int j = jj + nonZeroIndices[i];
+			return;
+		}
 
-		sum += nonZeroValues[j] * nonZeroScalars[i];
-	}
+		int nextIndex = row + 1;
 
-	return sum;
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			SparseOffset j = jj + nonZeroIndices[topology->columnIndices[jj] / oneHotSize];
+
+			values.add(j, delta);
+		}
+	});
 }
 
-float SparseMatrix::multiplyOHVsT(
-	const std::vector<int> &nonZeroIndices,
-	const std::vector<float> &nonZeroScalars,
+void SparseMatrix::deltaOHVsT(
+	const IntBuffer &nonZeroIndices,
+	float delta,
 	int column,
 	int oneHotSize
 ) {
-	float sum = 0.0f;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
 
-	int nextIndex = column + 1;
-	
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int i = rowIndices[jj] / oneHotSize;
-		int j = jj + nonZeroIndices[i];
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
 
-		sum += nonZeroValues[nonZeroValueIndices[j]] * nonZeroScalars[i];
-	}
+				values.add(entryIndex(*this, outColumnIndex * oneHotSize + nonZeroIndices[outColumnIndex], offset), delta);
+			});
 
-	return sum;
-}
+			return;
+		}
 
-float SparseMatrix::distance2OHVs(
-	const std::vector<int> &nonZeroIndices,
-	int row,
-	int oneHotSize
-) {
-	float dist = 0.0f;
+		if (isMasked()) {
+			forEachMaskedActiveColumnEntry(*this, nonZeroIndices, column, oneHotSize, [&](SparseOffset j, int /* i */) {
+				values.add(j, delta);
+			});
 
-	int nextIndex = row + 1;
-	
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int targetDJ = nonZeroIndices[columnIndices[jj] / oneHotSize];
+			return;
+		}
 
-		for (int dj = 0; dj < oneHotSize; dj++) {
-			float delta = (dj == targetDJ ? 1.0f : 0.0f) - nonZeroValues[jj + dj];
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					values.add(j, delta);
+			});
 
-			dist += delta * delta;
+			return;
 		}
-	}
 
-	return dist;
+		int nextIndex = column + 1;
+
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			SparseOffset j = jj + nonZeroIndices[topology->rowIndices[jj] / oneHotSize];
+
+			values.add(topology->getValueIndex(j), delta);
+		}
+	});
 }
 
-float SparseMatrix::distance2OHVsT(
-	const std::vector<int> &nonZeroIndices,
-	int column,
+void SparseMatrix::deltaOHVsColumn(
+	const IntBuffer &nonZeroIndices,
+	const float* deltas,
+	int outColumn,
 	int oneHotSize
 ) {
-	float dist = 0.0f;
+	assert(radius >= 0);
 
-	int nextIndex = column + 1;
-	
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int targetDJ = nonZeroIndices[rowIndices[jj] / oneHotSize];
+	int rowStart = outColumn * outSize.z;
 
-		for (int dj = 0; dj < oneHotSize; dj++) {
-			float delta = (dj == targetDJ ? 1.0f : 0.0f) - nonZeroValues[nonZeroValueIndices[jj + dj]];
+	if (!columnBlocked) {
+		for (int oz = 0; oz < outSize.z; oz++)
+			deltaOHVs(nonZeroIndices, deltas[oz], rowStart + oz, oneHotSize);
 
-			dist += delta * delta;
-		}
+		return;
 	}
 
-	return dist;
-}
+	if (isMasked()) {
+		visitMutableValues(*this, [&](auto values) {
+			forEachMaskedActiveOutColumnEntry(*this, nonZeroIndices, outColumn, [&](SparseOffset j, int oz) {
+				values.add(j, deltas[oz]);
+			});
+		});
 
-void SparseMatrix::deltas(
-	const std::vector<float> &in,
-	float delta,
-	int row
-) {
-	int nextIndex = row + 1;
-	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		nonZeroValues[j] += delta * in[columnIndices[j]];
-}
+		return;
+	}
 
-void SparseMatrix::deltasT(
-	const std::vector<float> &in,
-	float delta,
-	int column
-) {
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		nonZeroValues[nonZeroValueIndices[j]] += delta * in[rowIndices[j]];
-}
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		Int2 lowerBound, upperBound;
+		getFieldBounds(Int2(outColumn / outSize.y, outColumn % outSize.y), lowerBound, upperBound);
 
-void SparseMatrix::deltaOHVs(
-	const std::vector<int> &nonZeroIndices,
-	float delta,
-	int row,
-	int oneHotSize
-) {
-	int nextIndex = row + 1;
+		SparseOffset jj = topology->rowRanges[rowStart];
 
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int j = jj + nonZeroIndices[columnIndices[jj] / oneHotSize];
+		for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+			for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * outSize.z) {
+				SparseOffset weightsStart = jj + nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))] * outSize.z;
 
-		nonZeroValues[j] += delta;
-	}
+				for (int oz = 0; oz < outSize.z; oz++)
+					values.add(weightsStart + oz, deltas[oz]);
+			}
+	});
 }
 
-void SparseMatrix::deltaOHVsT(
-	const std::vector<int> &nonZeroIndices,
-	float delta,
-	int column,
+void SparseMatrix::deltaOHVsColumnT(
+	const IntBuffer &nonZeroIndices,
+	const float* deltas,
+	int inColumn,
 	int oneHotSize
 ) {
-	int nextIndex = column + 1;
+	assert(radius >= 0);
 
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int j = jj + nonZeroIndices[rowIndices[jj] / oneHotSize];
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isMasked()) {
+			forEachMaskedActiveInColumnEntry(*this, nonZeroIndices, inColumn, 0, inSize.z, oneHotSize, [&](SparseOffset j, int iz) {
+				values.add(j, deltas[iz]);
+			});
 
-		nonZeroValues[nonZeroValueIndices[j]] += delta;
-	}
+			return;
+		}
+
+		int stride = entryStride(*this);
+
+		forEachReverseField(*this, Int3(inColumn / inSize.y, inColumn % inSize.y, 0), [&](int ox, int oy, int offset) {
+			int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
+
+			SparseOffset j = entryIndex(*this, outColumnIndex * oneHotSize + nonZeroIndices[outColumnIndex], offset);
+
+			for (int iz = 0; iz < inSize.z; iz++)
+				values.add(j + iz * stride, deltas[iz]);
+		});
+	});
 }
 
 void SparseMatrix::deltaOHVs(
-	const std::vector<int> &nonZeroIndices,
-	const std::vector<float> &nonZeroScalars,
+	const IntBuffer &nonZeroIndices,
+	const FloatBuffer &nonZeroScalars,
 	float delta,
 	int row,
 	int oneHotSize
 ) {
-	int nextIndex = row + 1;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
 
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int i = columnIndices[jj] / oneHotSize;
-		int j = jj + nonZeroIndices[i];
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
 
-		nonZeroValues[j] += delta * nonZeroScalars[i];
-	}
+			int stride = entryStride(*this);
+
+			SparseOffset jj = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride) {
+					int i = address2(Int2(ix, iy), Int2(inSize.x, inSize.y));
+
+					values.add(jj + nonZeroIndices[i] * stride, delta * nonZeroScalars[i]);
+				}
+
+			return;
+		}
+
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					values.add(j, delta * nonZeroScalars[i]);
+			});
+
+			return;
+		}
+
+		int nextIndex = row + 1;
+
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			int i = topology->columnIndices[jj] / oneHotSize;
+			SparseOffset j = jj + nonZeroIndices[i];
+
+			values.add(j, delta * nonZeroScalars[i]);
+		}
+	});
 }
 
 void SparseMatrix::deltaOHVsT(
-	const std::vector<int> &nonZeroIndices,
-	const std::vector<float> &nonZeroScalars,
+	const IntBuffer &nonZeroIndices,
+	const FloatBuffer &nonZeroScalars,
 	float delta,
 	int column,
 	int oneHotSize
 ) {
-	int nextIndex = column + 1;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
 
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int i = rowIndices[jj] / oneHotSize;
-		int j = jj + nonZeroIndices[i];
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int i = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
 
-		nonZeroValues[nonZeroValueIndices[j]] += delta * nonZeroScalars[i];
-	}
+				values.add(entryIndex(*this, i * oneHotSize + nonZeroIndices[i], offset), delta * nonZeroScalars[i]);
+			});
+
+			return;
+		}
+
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				if (dj == nonZeroIndices[i])
+					values.add(j, delta * nonZeroScalars[i]);
+			});
+
+			return;
+		}
+
+		int nextIndex = column + 1;
+
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			int i = topology->rowIndices[jj] / oneHotSize;
+			SparseOffset j = jj + nonZeroIndices[i];
+
+			values.add(topology->getValueIndex(j), delta * nonZeroScalars[i]);
+		}
+	});
 }
 
 void SparseMatrix::hebb(
-	const std::vector<float> &in,
+	const FloatBuffer &in,
 	int row,
 	float alpha
 ) {
-	int nextIndex = row + 1;
-	
-	for (int j = rowRanges[row]; j < rowRanges[nextIndex]; j++)
-		nonZeroValues[j] += alpha * (in[columnIndices[j]] - nonZeroValues[j]);
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset j = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++) {
+					int columnStart = address3(Int3(ix, iy, 0), inSize);
+
+					for (int iz = 0; iz < inSize.z; iz++, j += stride)
+						values.add(j, alpha * (in[columnStart + iz] - values.get(j)));
+				}
+
+			return;
+		}
+
+		forEachRowColumnEntry(*this, row, [&](SparseOffset j, int column) {
+			values.add(j, alpha * (in[column] - values.get(j)));
+		});
+	});
 }
 
 void SparseMatrix::hebbT(
-	const std::vector<float> &in,
+	const FloatBuffer &in,
 	int column,
 	float alpha
 ) {
-	int nextIndex = column + 1;
-	
-	for (int j = columnRanges[column]; j < columnRanges[nextIndex]; j++)
-		nonZeroValues[nonZeroValueIndices[j]] += alpha * (in[rowIndices[j]] - nonZeroValues[nonZeroValueIndices[j]]);
+	visitMutableValues(*this, [&](auto values) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int rowStart = address3(Int3(ox, oy, 0), outSize);
+
+				for (int oz = 0; oz < outSize.z; oz++) {
+					SparseOffset j = entryIndex(*this, rowStart + oz, offset);
+
+					values.add(j, alpha * (in[rowStart + oz] - values.get(j)));
+				}
+			});
+
+			return;
+		}
+
+		forEachColumnRowEntry(*this, column, [&](SparseOffset j, int row) {
+			values.add(j, alpha * (in[row] - values.get(j)));
+		});
+	});
 }
 
 void SparseMatrix::hebbOHVs(
-	const std::vector<int> &nonZeroIndices,
+	const IntBuffer &nonZeroIndices,
 	int row,
 	int oneHotSize,
 	float alpha
 ) {
-	int nextIndex = row + 1;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 outPos = rowPosition(*this, row);
+
+			Int2 lowerBound, upperBound;
+			getFieldBounds(Int2(outPos.x, outPos.y), lowerBound, upperBound);
+
+			int stride = entryStride(*this);
+
+			SparseOffset jj = entryIndex(*this, row, 0);
+
+			for (int ix = lowerBound.x; ix <= upperBound.x; ix++)
+				for (int iy = lowerBound.y; iy <= upperBound.y; iy++, jj += oneHotSize * stride) {
+					int targetDJ = nonZeroIndices[address2(Int2(ix, iy), Int2(inSize.x, inSize.y))];
+
+					for (int dj = 0; dj < oneHotSize; dj++) {
+						SparseOffset j = jj + dj * stride;
+
+						float target = (dj == targetDJ ? 1.0f : 0.0f);
+
+						values.add(j, alpha * (target - values.get(j)));
+					}
+				}
+
+			return;
+		}
+
+		if (pruned) {
+			forEachRowGroupEntry(*this, row, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float target = (dj == nonZeroIndices[i] ? 1.0f : 0.0f);
+
+				values.add(j, alpha * (target - values.get(j)));
+			});
+
+			return;
+		}
+
+		int nextIndex = row + 1;
 	
-	for (int jj = rowRanges[row]; jj < rowRanges[nextIndex]; jj += oneHotSize) {
-		int targetDJ = nonZeroIndices[columnIndices[jj] / oneHotSize];
+		for (SparseOffset jj = topology->rowRanges[row]; jj < topology->rowRanges[nextIndex]; jj += oneHotSize) {
+			int targetDJ = nonZeroIndices[topology->columnIndices[jj] / oneHotSize];
 
-		for (int dj = 0; dj < oneHotSize; dj++) {
-			int j = jj + dj;
+			for (int dj = 0; dj < oneHotSize; dj++) {
+				SparseOffset j = jj + dj;
 
-			float target = (dj == targetDJ ? 1.0f : 0.0f);
+				float target = (dj == targetDJ ? 1.0f : 0.0f);
 
-			nonZeroValues[j] += alpha * (target - nonZeroValues[j]);
+				values.add(j, alpha * (target - values.get(j)));
+			}
 		}
-	}
+	});
 }
 
 void SparseMatrix::hebbOHVsT(
-	const std::vector<int> &nonZeroIndices,
+	const IntBuffer &nonZeroIndices,
 	int column,
 	int oneHotSize,
 	float alpha
 ) {
-	int nextIndex = column + 1;
+	visitMutableValuesOHVs(*this, oneHotSize, [&](auto values, auto oneHotSize) {
+		if (isLocalRF()) {
+			Int3 inPos = columnPosition(*this, column);
+
+			forEachReverseField(*this, inPos, [&](int ox, int oy, int offset) {
+				int outColumnIndex = address2(Int2(ox, oy), Int2(outSize.x, outSize.y));
+
+				int targetDJ = nonZeroIndices[outColumnIndex];
+
+				for (int dj = 0; dj < oneHotSize; dj++) {
+					SparseOffset j = entryIndex(*this, outColumnIndex * oneHotSize + dj, offset);
+
+					float target = (dj == targetDJ ? 1.0f : 0.0f);
+
+					values.add(j, alpha * (target - values.get(j)));
+				}
+			});
+
+			return;
+		}
+
+		if (pruned) {
+			forEachColumnGroupEntry(*this, column, oneHotSize, [&](SparseOffset j, int i, int dj) {
+				float target = (dj == nonZeroIndices[i] ? 1.0f : 0.0f);
+
+				values.add(j, alpha * (target - values.get(j)));
+			});
+
+			return;
+		}
+
+		int nextIndex = column + 1;
 	
-	for (int jj = columnRanges[column]; jj < columnRanges[nextIndex]; jj += oneHotSize) {
-		int targetDJ = nonZeroIndices[rowIndices[jj] / oneHotSize];
+		for (SparseOffset jj = topology->columnRanges[column]; jj < topology->columnRanges[nextIndex]; jj += oneHotSize) {
+			int targetDJ = nonZeroIndices[topology->rowIndices[jj] / oneHotSize];
 
-		for (int dj = 0; dj < oneHotSize; dj++) {
-			int j = jj + dj;
+			for (int dj = 0; dj < oneHotSize; dj++) {
+				SparseOffset j = jj + dj;
 
-			float target = (dj == targetDJ ? 1.0f : 0.0f);
+				float target = (dj == targetDJ ? 1.0f : 0.0f);
 
-			nonZeroValues[nonZeroValueIndices[j]] += alpha * (target - nonZeroValues[nonZeroValueIndices[j]]);
+				values.add(topology->getValueIndex(j), alpha * (target - values.get(topology->getValueIndex(j))));
+			}
 		}
-	}
+	});
 }
\ No newline at end of file
@@ -8,27 +8,147 @@
 
 #pragma once
 
+#include "Helpers.h"
+
 #include <vector>
+#include <memory>
 #include <math.h>
 #include <assert.h>
 
 namespace ogmaneo {
+// Storage type of the non-zero values, kernels always accumulate in fp32.
+// int8 is inference only: values are quantized per row and only the forward OHV kernels (int32 accumulation) are supported.
+// int8 matrices are always immutable, and the other kernels skip them
+enum ValueType {
+	float32 = 0,
+	bfloat16 = 1,
+	float16 = 2,
+	int8 = 3
+};
+
+// Storage type of the weights of a new layer. int8 only comes from quantizing trained weights, so it is rejected
+// (asserts in debug builds, falls back to float32 otherwise)
+inline ValueType initValueType(
+	ValueType valueType
+) {
+	assert(valueType != int8);
+
+	return valueType == int8 ? float32 : valueType;
+}
+
+// Offset into the non-zero values. 64-bit so that a matrix may hold more than 2^31 non-zeros,
+// row and column indices stay 32-bit
+typedef long long SparseOffset;
+
+// Index structure of a sparse matrix and its transpose. Immutable once built,
+// so matrices of identical geometry share one instance (see SparseMatrix::initLocalRFTopology)
+struct SparseTopology {
+	Buffer<SparseOffset> rowRanges;
+	IntBuffer columnIndices;
+
+	// Transpose
+	IntBuffer nonZeroValueIndices; // Used if the number of non-zeros fits an int
+	Buffer<SparseOffset> nonZeroValueIndices64; // Used otherwise
+	Buffer<SparseOffset> columnRanges;
+	IntBuffer rowIndices;
+
+	// Local receptive field bounds per axis (x, y), empty if explicit. Fields are separable and their centers are monotone,
+	// so the output columns whose fields contain an input position form one contiguous range per axis (lower > upper if none)
+	IntBuffer fieldLowers[2]; // Per output position
+	IntBuffer fieldUppers[2];
+	IntBuffer reverseLowers[2]; // Per input position
+	IntBuffer reverseUppers[2];
+
+	// Pruned local receptive fields (see SparseMatrix::prune), empty otherwise. Entries stay in column-blocked groups of the same
+	// output column, input column and input cell, but a group only stores the output cells it kept
+	Buffer<SparseOffset> keptRanges; // Start of the kept entries of each output column
+	Buffer<unsigned int> cellMasks; // Per group: start of its entries in the output column, then one bit per output cell
+
+	// Number of stored entries
+	SparseOffset getNumEntries() const {
+		return keptRanges.empty() ? rowRanges.back() : keptRanges.back();
+	}
+
+	// Index of the value of a transpose entry
+	SparseOffset getValueIndex(
+		SparseOffset j
+	) const {
+		return nonZeroValueIndices64.empty() ? nonZeroValueIndices[j] : nonZeroValueIndices64[j];
+	}
+};
+
 // Compressed sparse row (CSR) format
 struct SparseMatrix {
 	int rows, columns; // Dimensions
 
-	std::vector<float> nonZeroValues;
-	std::vector<int> rowRanges;
-	std::vector<int> columnIndices;
+	ValueType valueType; // Storage type of the non-zero values
 
-	// Transpose
-	std::vector<int> nonZeroValueIndices;
-	std::vector<int> columnRanges;
-	std::vector<int> rowIndices;
+	FloatBuffer nonZeroValues; // Used if valueType is float32
+	Buffer<unsigned short> nonZeroValues16; // Bit patterns, used if valueType is bfloat16 or float16
+	Buffer<signed char> nonZeroValues8; // Used if valueType is int8
+	FloatBuffer rowScales; // Dequantization scale of each row (receptive field), used if valueType is int8
+
+	// Externally owned values (see setExternalValues), used instead of the value buffers if not null
+	const void* externalValues;
+	const float* externalRowScales; // Used with externalValues if valueType is int8
+	SparseOffset numExternalValues;
+
+	// Whether the values may not be changed. Delta, hebb and fill kernels leave immutable matrices untouched (and assert in debug builds).
+	// Always set for int8
+	bool immutable;
+
+	std::shared_ptr<const SparseTopology> topology; // Index structure, shared between copies and matrices of identical geometry
+
+	// Local receptive field geometry. If radius >= 0 the topology is implicit:
+	// columnIndices, rowIndices and nonZeroValueIndices are left empty and entries are found from the geometry
+	Int3 inSize; // Size of input field (columns)
+	Int3 outSize; // Size of output field (rows)
+	int radius; // Radius of output onto input, -1 if explicit
+
+	// Local receptive field storage order. Row-major is [output cell][input column][input cell],
+	// column-blocked is [output column][input column][input cell][output cell] so all cells of an output column are updated together
+	bool columnBlocked;
+
+	// Whether weights have been removed (see prune), so one-hot groups may be missing entries. Pruned local receptive fields
+	// keep their geometry and the column-blocked layout with masks of the kept entries (see isMasked), other matrices an explicit topology
+	bool pruned;
 
 	// --- Init ---
 
-	SparseMatrix() {}
+	SparseMatrix()
+	:
+	valueType(float32),
+	externalValues(nullptr),
+	externalRowScales(nullptr),
+	numExternalValues(0),
+	immutable(false),
+	radius(-1),
+	columnBlocked(false),
+	pruned(false)
+	{}
+
+	// Copies share immutable external values, but take their own copy of the values of a mutable view
+	// (such as a copy-on-write mapping), since it would otherwise be changed through both
+	SparseMatrix(
+		const SparseMatrix &other
+	)
+	:
+	SparseMatrix()
+	{
+		*this = other;
+	}
+
+	SparseMatrix(
+		SparseMatrix &&other
+	) = default;
+
+	SparseMatrix &operator=(
+		const SparseMatrix &other
+	);
+
+	SparseMatrix &operator=(
+		SparseMatrix &&other
+	) = default;
 
 	// If you don't want to construct immediately
 	SparseMatrix(
@@ -69,15 +189,159 @@ struct SparseMatrix {
 	// Generate a transpose, must be called after the original has been created
 	void initT();
 
+	// Drop the transpose, it is only used by the transpose kernels
+	void releaseT();
+
+	// Whether the transpose has been generated
+	bool hasT() const {
+		return !topology->columnRanges.empty();
+	}
+
+	// Generate the transpose on first use. Transposes are not serialized, so call this before launching transpose kernels
+	// (the kernels don't build it themselves, that wouldn't be thread safe)
+	void requireT() {
+		if (!hasT())
+			initT();
+	}
+
+	// Convert the non-zero values to another storage type (rounds to nearest). Converting to int8 freezes the matrix.
+	// External values are copied first (see ownValues)
+	void setValueType(
+		ValueType valueType
+	);
+
+	// Refer to externally owned values instead of owning them, e.g. a region of a mapped file or a shared-memory segment,
+	// so that several processes can share one physical copy. The owned value buffers are released.
+	// The memory must outlive the matrix and all of its copies
+	void setExternalValues(
+		const void* values, // Values laid out as the buffer of valueType, aligned to Arena::alignment
+		SparseOffset numValues, // Number of values
+		const float* rowScales = nullptr, // Row scales, if valueType is int8 (aligned as well)
+		bool immutable = true // Whether to reject changes to the values. Only pass false if the memory is writable (e.g. a private mapping)
+	);
+
+	// Copy external values into owned buffers, so the matrix no longer refers to external memory and may be changed (unless it is int8)
+	void ownValues();
+
+	// Forget external values without copying them, leaving the matrix with no values
+	void clearExternalValues() {
+		externalValues = nullptr;
+		externalRowScales = nullptr;
+		numExternalValues = 0;
+		immutable = valueType == int8;
+	}
+
+	// Whether the values are externally owned
+	bool isView() const {
+		return externalValues != nullptr;
+	}
+
+	// Start of the values (external or owned), laid out as the buffer of valueType
+	const void* getValueData() const;
+
+	// Size of a value in bytes
+	int getValueSize() const;
+
+	// Start of the row scales (external or owned), int8 only
+	const float* getRowScaleData() const {
+		return isView() ? externalRowScales : rowScales.data();
+	}
+
+	// Call func on each value buffer (topologies are shared and stay where they are)
+	template <typename F>
+	void visitBuffers(
+		const F &func
+	) {
+		func(nonZeroValues);
+		func(nonZeroValues16);
+		func(nonZeroValues8);
+		func(rowScales);
+	}
+
+	// Whether updates to the values round stochastically (16-bit storage), kernels updating them must seed the rounding (see seedRounding)
+	bool roundsStochastically() const {
+		return valueType == bfloat16 || valueType == float16;
+	}
+
+	// Number of stored non-zero values
+	SparseOffset getNumNonZeroValues() const {
+		if (isView())
+			return numExternalValues;
+
+		switch (valueType) {
+		case float32:
+			return nonZeroValues.size();
+		case int8:
+			return nonZeroValues8.size();
+		default:
+			return nonZeroValues16.size();
+		}
+	}
+
+	// --- Local Receptive Field ---
+
+	// Whether the topology is implicit (local receptive field)
+	bool isLocalRF() const {
+		return radius >= 0 && !pruned;
+	}
+
+	// Whether this is a pruned local receptive field (see prune)
+	bool isMasked() const {
+		return radius >= 0 && pruned;
+	}
+
+	// Set the topology from the geometry (inSize, outSize, radius, columnBlocked).
+	// Topologies are cached, so all matrices with the same geometry share one
+	void initLocalRFTopology(
+		bool transpose // Whether to include the transpose
+	);
+
+	// Receptive field of an output column, clamped to the input field (inclusive bounds)
+	void getFieldBounds(
+		const Int2 &outPos,
+		Int2 &lowerBound,
+		Int2 &upperBound
+	) const;
+
+	// Range of output columns whose receptive fields contain an input column (inclusive bounds, lower > upper if there are none)
+	void getReverseFieldBounds(
+		const Int2 &inPos,
+		Int2 &lowerBound,
+		Int2 &upperBound
+	) const;
+
+	// Number of input columns in the receptive field of an output column. Found from the geometry, so unlike count it is unaffected by pruning
+	int countFields(
+		const Int2 &outPos
+	) const;
+
+	// Number of output columns whose receptive fields contain an input column. Found from the geometry, so unlike countT it doesn't need the transpose
+	int countFieldsT(
+		const Int2 &inPos
+	) const;
+
+	// --- Pruning ---
+
+	// Remove the weights whose magnitude is below threshold and, if keepPerGroup > 0, all but the keepPerGroup largest of each one-hot group.
+	// Returns the number of weights kept. External values are copied first (see ownValues).
+	// Local receptive fields keep the column-blocked layout: each output column, input column and input cell stores a mask of its kept
+	// output cells and only their values, so the OHV kernels still go straight to the active cell and skip the removed weights.
+	// The one-hot groups must then be the input columns. Other matrices are compacted into an explicit topology
+	SparseOffset prune(
+		float threshold, // Smallest magnitude to keep
+		int oneHotSize, // Size of the one-hot groups (input cells per input column)
+		int keepPerGroup = 0 // Weights to keep per group, 0 to keep all above threshold
+	);
+
 	// --- Dense ---
 
 	float multiply(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int row
 	);
 
 	float distance2(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int row
 	);
 
@@ -86,7 +350,7 @@ struct SparseMatrix {
 	);
 
 	float count(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int row
 	);
 
@@ -100,12 +364,12 @@ struct SparseMatrix {
     );
 
 	float multiplyT(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int column
 	);
 
 	float distance2T(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int column
 	);
 
@@ -114,7 +378,7 @@ struct SparseMatrix {
 	);
 
 	float countT(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int column
 	);
 
@@ -130,82 +394,149 @@ struct SparseMatrix {
 	// --- One-Hot Vectors Operations ---
 
 	float multiplyOHVs(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int row,
 		int oneHotSize
 	);
 
 	float multiplyOHVsT(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int column,
 		int oneHotSize
 	);
 
 	float multiplyOHVs(
-		const std::vector<int> &nonZeroIndices,
-		const std::vector<float> &nonZeroScalars,
+		const IntBuffer &nonZeroIndices,
+		const FloatBuffer &nonZeroScalars,
 		int row,
 		int oneHotSize
 	);
 
 	float multiplyOHVsT(
-		const std::vector<int> &nonZeroIndices,
-		const std::vector<float> &nonZeroScalars,
+		const IntBuffer &nonZeroIndices,
+		const FloatBuffer &nonZeroScalars,
 		int column,
 		int oneHotSize
 	);
 
+	// Accumulate the OHV products of all rows (cells) of an output column into sums, times scale. Local receptive field only.
+	// Layers accumulate the columns of all their visible layers into the same sums, each with its own (precomputed) normalization
+	void multiplyOHVsColumn(
+		const IntBuffer &nonZeroIndices,
+		int outColumn,
+		int oneHotSize,
+		float* sums,
+		float scale = 1.0f
+	);
+
+	// Accumulate the transposed OHV products of all columns (cells) of an input column into sums, times scale. Local receptive
+	// field only. The cells of an input column are adjacent in every receptive field, so each output column is visited once for all of them
+	void multiplyOHVsColumnT(
+		const IntBuffer &nonZeroIndices,
+		int inColumn,
+		int oneHotSize,
+		float* sums,
+		float scale = 1.0f
+	);
+
 	float distance2OHVs(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int row,
 		int oneHotSize
 	);
 
 	float distance2OHVsT(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int column,
 		int oneHotSize
 	);
 
+	// --- Batched ---
+
+	// Evaluate a row (column) against several independent input vectors at once, writing one sum per input to sums.
+	// Each weight is loaded once and reused for all inputs, instead of streaming the row once per input
+
+	void multiply(
+		const std::vector<const FloatBuffer*> &ins,
+		int row,
+		float* sums
+	);
+
+	void distance2(
+		const std::vector<const FloatBuffer*> &ins,
+		int row,
+		float* sums
+	);
+
+	void multiplyOHVs(
+		const std::vector<const IntBuffer*> &nonZeroIndices,
+		int row,
+		int oneHotSize,
+		float* sums
+	);
+
+	void multiplyOHVsT(
+		const std::vector<const IntBuffer*> &nonZeroIndices,
+		int column,
+		int oneHotSize,
+		float* sums
+	);
+
 	// --- Delta Rules ---
 
 	void deltas(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		float delta,
 		int row
 	);
 
 	void deltasT(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		float delta,
 		int column
 	);
 
 	void deltaOHVs(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		float delta,
 		int row,
 		int oneHotSize
 	);
 
 	void deltaOHVsT(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		float delta,
 		int column,
 		int oneHotSize
 	);
 
+	// Apply a separate delta to each row (cell) of an output column, local receptive field only
+	void deltaOHVsColumn(
+		const IntBuffer &nonZeroIndices,
+		const float* deltas,
+		int outColumn,
+		int oneHotSize
+	);
+
+	// Apply a separate delta to each column (cell) of an input column, local receptive field only
+	void deltaOHVsColumnT(
+		const IntBuffer &nonZeroIndices,
+		const float* deltas,
+		int inColumn,
+		int oneHotSize
+	);
+
 	void deltaOHVs(
-		const std::vector<int> &nonZeroIndices,
-		const std::vector<float> &nonZeroScalars,
+		const IntBuffer &nonZeroIndices,
+		const FloatBuffer &nonZeroScalars,
 		float delta,
 		int row,
 		int oneHotSize
 	);
 
 	void deltaOHVsT(
-		const std::vector<int> &nonZeroIndices,
-		const std::vector<float> &nonZeroScalars,
+		const IntBuffer &nonZeroIndices,
+		const FloatBuffer &nonZeroScalars,
 		float delta,
 		int column,
 		int oneHotSize
@@ -214,26 +545,26 @@ struct SparseMatrix {
 	// --- Hebb Rules ---
 
 	void hebb(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int row,
 		float alpha
 	);
 
 	void hebbT(
-		const std::vector<float> &in,
+		const FloatBuffer &in,
 		int column,
 		float alpha
 	);
 
 	void hebbOHVs(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int row,
 		int oneHotSize,
 		float alpha
 	);
 
 	void hebbOHVsT(
-		const std::vector<int> &nonZeroIndices,
+		const IntBuffer &nonZeroIndices,
 		int column,
 		int oneHotSize,
 		float alpha
@@ -0,0 +1,254 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+using namespace ogmaneo;
+
+// Index of the worker running on this thread, -1 if not a worker
+static thread_local int currentWorker = -1;
+
+void ThreadPool::Worker::pushBack(
+    const Task &task
+) {
+    if (size == static_cast<int>(tasks.size())) {
+        std::vector<Task> grown(tasks.size() * 2);
+
+        for (int i = 0; i < size; i++)
+            grown[i] = tasks[(first + i) % tasks.size()];
+
+        tasks.swap(grown);
+
+        first = 0;
+    }
+
+    tasks[(first + size) % tasks.size()] = task;
+
+    size++;
+}
+
+ThreadPool::Task ThreadPool::Worker::popFront() {
+    Task task = tasks[first];
+
+    first = (first + 1) % tasks.size();
+    size--;
+
+    return task;
+}
+
+ThreadPool::Task ThreadPool::Worker::popBack() {
+    size--;
+
+    return tasks[(first + size) % tasks.size()];
+}
+
+ThreadPool::ThreadPool(
+    int numThreads,
+    int spinIterations
+)
+:
+numPending(0),
+nextWorker(0),
+spinIterations(spinIterations),
+stop(false)
+{
+    numThreads = std::max(1, numThreads);
+
+    workers.resize(numThreads);
+
+    for (int i = 0; i < numThreads; i++)
+        workers[i] = std::make_unique<Worker>();
+
+    threads.reserve(numThreads);
+
+    for (int i = 0; i < numThreads; i++)
+        threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(parkMutex);
+
+        stop = true;
+    }
+
+    parkCondition.notify_all();
+
+    for (std::size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+bool ThreadPool::popTask(
+    int workerIndex,
+    Task &task
+) {
+    if (numPending.load(std::memory_order_acquire) == 0)
+        return false;
+
+    // Own deque first (front), then steal from the others (back)
+    int numWorkers = workers.size();
+
+    for (int i = 0; i < numWorkers; i++) {
+        int index = workerIndex >= 0 ? (workerIndex + i) % numWorkers : i;
+
+        Worker &w = *workers[index];
+
+        std::lock_guard<std::mutex> lock(w.mutex);
+
+        if (w.size == 0)
+            continue;
+
+        if (index == workerIndex)
+            task = w.popFront();
+        else
+            task = w.popBack();
+
+        numPending--;
+
+        return true;
+    }
+
+    return false;
+}
+
+void ThreadPool::runTask(
+    const Task &task
+) {
+    (*task.job->func)(task.begin, task.end);
+
+    task.job->remaining.fetch_sub(1, std::memory_order_release);
+}
+
+void ThreadPool::workerLoop(
+    int workerIndex
+) {
+    currentWorker = workerIndex;
+
+    Task task;
+
+    for (;;) {
+        if (popTask(workerIndex, task)) {
+            runTask(task);
+
+            continue;
+        }
+
+        // Spin before parking, keeps wake-up latency low at high step rates
+        bool found = false;
+
+        for (int s = 0; s < spinIterations; s++) {
+            if (numPending.load(std::memory_order_acquire) > 0) {
+                found = true;
+
+                break;
+            }
+
+            std::this_thread::yield();
+        }
+
+        if (found)
+            continue;
+
+        std::unique_lock<std::mutex> lock(parkMutex);
+
+        parkCondition.wait(lock, [&] { return stop || numPending.load() > 0; });
+
+        if (stop && numPending.load() == 0)
+            return;
+    }
+}
+
+void ThreadPool::parallelFor(
+    int count,
+    const RangeFunc &func,
+    LoopSchedule schedule
+) {
+    if (count <= 0)
+        return;
+
+    int numParticipants = workers.size() + 1;
+
+    // Guided chunks take a share of the remaining items, never fewer than this
+    const int minGuidedChunk = 1;
+
+    int numChunks;
+
+    switch (schedule) {
+    case staticSchedule:
+        numChunks = std::min(count, numParticipants);
+
+        break;
+    case dynamicSchedule:
+        numChunks = std::min(count, numParticipants * 16);
+
+        break;
+    case guidedSchedule:
+        numChunks = 0;
+
+        for (int begin = 0; begin < count; numChunks++)
+            begin += std::max(minGuidedChunk, (count - begin) / (2 * numParticipants));
+
+        break;
+    default:
+        // A few chunks per thread so that stealing can balance uneven items
+        numChunks = std::min(count, numParticipants * 4);
+    }
+
+    if (numChunks == 1) {
+        func(0, count);
+
+        return;
+    }
+
+    Job job;
+    job.func = &func;
+    job.remaining = numChunks;
+
+    int first = nextWorker.fetch_add(1) % workers.size();
+
+    int begin = 0;
+
+    for (int c = 0; c < numChunks; c++) {
+        Task task;
+        task.job = &job;
+        task.begin = begin;
+
+        if (schedule == guidedSchedule)
+            task.end = std::min(count, begin + std::max(minGuidedChunk, (count - begin) / (2 * numParticipants)));
+        else
+            task.end = static_cast<long long>(count) * (c + 1) / numChunks;
+
+        begin = task.end;
+
+        Worker &w = *workers[(first + c) % workers.size()];
+
+        std::lock_guard<std::mutex> lock(w.mutex);
+
+        w.pushBack(task);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(parkMutex);
+
+        numPending += numChunks;
+    }
+
+    parkCondition.notify_all();
+
+    // Help until all chunks are done, this also runs tasks of other jobs so nested loops can't deadlock
+    Task task;
+
+    while (job.remaining.load(std::memory_order_acquire) > 0) {
+        if (popTask(currentWorker, task))
+            runTask(task);
+        else
+            std::this_thread::yield();
+    }
+}
\ No newline at end of file
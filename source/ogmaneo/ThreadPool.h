@@ -0,0 +1,141 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ogmaneo {
+// How a parallel loop is split between threads
+enum LoopSchedule {
+    defaultSchedule = -1, // Backend default
+    staticSchedule = 0, // One equal range per thread
+    dynamicSchedule = 1, // Many small ranges, taken on demand
+    guidedSchedule = 2 // Ranges that shrink as the loop progresses
+};
+
+// Non-owning reference to a callable taking an index range [begin, end), avoids the allocation of a std::function
+class RangeFunc {
+private:
+    void* obj;
+    void (*invoke)(void*, int, int);
+
+public:
+    template <typename F>
+    RangeFunc(
+        F &f
+    )
+    :
+    obj(&f),
+    invoke([](void* o, int begin, int end) { (*static_cast<F*>(o))(begin, end); })
+    {}
+
+    void operator()(
+        int begin,
+        int end
+    ) const {
+        invoke(obj, begin, end);
+    }
+};
+
+// Persistent work-stealing thread pool
+class ThreadPool {
+private:
+    // A parallel loop, lives on the stack of the submitting thread until all of its chunks are done
+    struct Job {
+        const RangeFunc* func;
+
+        std::atomic<int> remaining; // Chunks not yet finished
+    };
+
+    // Chunk of a job
+    struct Task {
+        Job* job;
+
+        int begin, end;
+    };
+
+    // Each worker owns a queue, pops from its front and steals from the back of the others
+    struct Worker {
+        std::mutex mutex;
+
+        // Ring buffer, only grows (when full) so that steady-state submission doesn't allocate
+        std::vector<Task> tasks;
+        int first; // Index of the front task
+        int size; // Number of queued tasks
+
+        Worker()
+        :
+        tasks(64),
+        first(0),
+        size(0)
+        {}
+
+        void pushBack(
+            const Task &task
+        );
+
+        Task popFront();
+        Task popBack();
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::atomic<int> numPending; // Tasks pushed but not yet popped
+    std::atomic<int> nextWorker; // Round robin submission
+
+    int spinIterations; // Idle polls before parking, 0 parks immediately
+
+    std::mutex parkMutex;
+    std::condition_variable parkCondition;
+
+    bool stop;
+
+    bool popTask(
+        int workerIndex,
+        Task &task
+    );
+
+    void runTask(
+        const Task &task
+    );
+
+    void workerLoop(
+        int workerIndex
+    );
+
+public:
+    ThreadPool(
+        int numThreads, // Number of worker threads, the submitting thread helps as well
+        int spinIterations // Idle polls before a worker parks (spin-then-park), 0 to park immediately
+    );
+
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Run func over [0, count) split into chunks and wait for it. May be called from inside a task (nested)
+    void parallelFor(
+        int count, // Number of items
+        const RangeFunc &func, // Called with sub-ranges of items
+        LoopSchedule schedule = defaultSchedule // How the items are split into chunks
+    );
+
+    // Get number of worker threads
+    int getNumThreads() const {
+        return threads.size();
+    }
+};
+} // namespace ogmaneo
\ No newline at end of file
@@ -0,0 +1,74 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+// Counts heap allocations of the whole program: replaces the global operator new if OGMANEO_COUNT_ALLOCATIONS is defined,
+// and adds the aligned allocations of the library buffers (allocateAligned). Include in a single translation unit only
+
+#include <ogmaneo/Arena.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#ifdef OGMANEO_COUNT_ALLOCATIONS
+static std::atomic<long long> numNewAllocations(0);
+
+void* operator new(
+    std::size_t bytes
+) {
+    numNewAllocations.fetch_add(1, std::memory_order_relaxed);
+
+    void* p = std::malloc(bytes != 0 ? bytes : 1);
+
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+void* operator new[](
+    std::size_t bytes
+) {
+    return operator new(bytes);
+}
+
+void operator delete(
+    void* p
+) noexcept {
+    std::free(p);
+}
+
+void operator delete[](
+    void* p
+) noexcept {
+    std::free(p);
+}
+
+void operator delete(
+    void* p,
+    std::size_t
+) noexcept {
+    std::free(p);
+}
+
+void operator delete[](
+    void* p,
+    std::size_t
+) noexcept {
+    std::free(p);
+}
+
+namespace ogmaneo {
+// Heap allocations so far
+inline long long getNumAllocations() {
+    return numNewAllocations.load(std::memory_order_relaxed) + getNumAlignedAllocations();
+}
+} // namespace ogmaneo
+#endif
\ No newline at end of file
@@ -0,0 +1,80 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Steps of a warmed up hierarchy (with an actor) must not allocate, on the OpenMP backend and on the thread pool
+
+#include "AllocationCounter.h"
+
+#include <ogmaneo/Hierarchy.h>
+
+#include <cstdio>
+
+using namespace ogmaneo;
+
+// Allocations made by the steps after the warm up
+static long long countStepAllocations(
+    ComputeSystem &cs
+) {
+    const int warmUpSteps = 100;
+    const int steps = 400;
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(3);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++)
+        layerDescs[l].hiddenSize = Int3(6, 6, 16);
+
+    Hierarchy h;
+
+    h.initRandom(cs, { Int3(3, 3, 8), Int3(4, 4, 4) }, { InputType::prediction, InputType::action }, layerDescs);
+
+    IntBuffer inputCs(9);
+    IntBuffer actionCs(16, 0);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs, &actionCs };
+
+    long long start = 0;
+
+    for (int t = 0; t < warmUpSteps + steps; t++) {
+        if (t == warmUpSteps)
+            start = getNumAllocations();
+
+        for (std::size_t i = 0; i < inputCs.size(); i++)
+            inputCs[i] = ((t % 13) * 3 + i) % 8;
+
+        const IntBuffer &predictions = h.getPredictionCs(1);
+
+        for (std::size_t i = 0; i < actionCs.size(); i++)
+            actionCs[i] = predictions[i];
+
+        h.step(cs, inputs, true, actionCs[0] == t % 4 ? 1.0f : 0.0f);
+    }
+
+    return getNumAllocations() - start;
+}
+
+int main() {
+    int failures = 0;
+
+    for (int backend = 0; backend < 2; backend++) {
+        ComputeSystem cs;
+
+        cs.rng.seed(1);
+
+        if (backend == threadPool)
+            cs.setThreadPool(2);
+
+        long long allocations = countStepAllocations(cs);
+
+        printf("%s: %lld allocations\n", backend == threadPool ? "thread pool" : "OpenMP", allocations);
+
+        if (allocations != 0)
+            failures++;
+    }
+
+    return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,47 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// Assignment between hierarchies in and out of arena mode, of the same and of different layouts. The assigned hierarchy
+// must step like its source. Buffers kept from the previous arena would be used after free (run with OGMANEO_SANITIZE)
+
+#include "HierarchyFixture.h"
+
+#include <cstdio>
+
+using namespace ogmaneo;
+
+int main() {
+    int failures = 0;
+
+    for (int targetArena = 0; targetArena < 2; targetArena++)
+        for (int sourceArena = 0; sourceArena < 2; sourceArena++)
+            for (int sameLayout = 0; sameLayout < 2; sameLayout++) {
+                Hierarchy target;
+                Hierarchy source;
+
+                initHierarchy(target, 5);
+                initHierarchy(source, sameLayout ? 5 : 7);
+
+                target.setArenaMode(targetArena);
+                source.setArenaMode(sourceArena);
+
+                target = source;
+
+                bool arenaOk = target.getArenaMode() == static_cast<bool>(sourceArena) && (target.getArena() != nullptr) == static_cast<bool>(sourceArena);
+
+                int mismatches = compareSteps(target, source, 50);
+
+                printf("%s into %s, %s layout: %d mismatches%s\n", sourceArena ? "arena" : "heap", targetArena ? "arena" : "heap",
+                    sameLayout ? "same" : "other", mismatches, arenaOk ? "" : ", wrong arena state");
+
+                if (mismatches != 0 || !arenaOk)
+                    failures++;
+            }
+
+    return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,66 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+#pragma once
+
+// Small two layer hierarchies and a step comparison, shared by the tests that check that a hierarchy which was copied,
+// read back or mapped steps like its source
+
+#include <ogmaneo/Hierarchy.h>
+
+namespace ogmaneo {
+// Two layers of columns x columns hidden columns over a 4x4 input of one-hot size 8. The weights are seeded from columns,
+// so hierarchies of the same size start out identical
+inline void initHierarchy(
+    Hierarchy &h,
+    int columns
+) {
+    ComputeSystem cs;
+
+    cs.rng.seed(columns);
+
+    std::vector<Hierarchy::LayerDesc> layerDescs(2);
+
+    for (std::size_t l = 0; l < layerDescs.size(); l++)
+        layerDescs[l].hiddenSize = Int3(columns, columns, 16);
+
+    h.initRandom(cs, { Int3(4, 4, 8) }, { InputType::prediction }, layerDescs);
+}
+
+// Step a and b on the same inputs (learning), returns the number of steps where their predictions differ
+inline int compareSteps(
+    Hierarchy &a,
+    Hierarchy &b,
+    int steps = 20
+) {
+    ComputeSystem csA;
+    ComputeSystem csB;
+
+    csA.rng.seed(1);
+    csB.rng.seed(1);
+
+    IntBuffer inputCs(16);
+
+    std::vector<const IntBuffer*> inputs = { &inputCs };
+
+    int mismatches = 0;
+
+    for (int t = 0; t < steps; t++) {
+        for (std::size_t i = 0; i < inputCs.size(); i++)
+            inputCs[i] = (t * 3 + i) % 8;
+
+        a.step(csA, inputs, true);
+        b.step(csB, inputs, true);
+
+        if (a.getPredictionCs(0) != b.getPredictionCs(0))
+            mismatches++;
+    }
+
+    return mismatches;
+}
+} // namespace ogmaneo
@@ -0,0 +1,177 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// A hierarchy mapped from a file must step like the original. Files whose section directory doesn't match the file or the
+// matrices (sections out of range, outside the file, misaligned or of the wrong size) must be rejected, leaving the hierarchy unchanged
+
+#include "HierarchyFixture.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+using namespace ogmaneo;
+
+// Mirrors the file layout of Hierarchy::writeToFile
+struct FileHeader {
+    char magic[8];
+    int version;
+    int numSections;
+    int structureSection;
+    int reserved;
+    long long directoryOffset;
+};
+
+struct FileSectionEntry {
+    long long offset;
+    long long size;
+};
+
+static const char* filePath = "MappedFileTest.ohr";
+
+// Map data (written to filePath) into a copy of target, returns whether mapping succeeded. The copy must match reference afterwards
+static bool mapInto(
+    const Hierarchy &target,
+    const Hierarchy &reference,
+    const std::string &data,
+    int &mismatches
+) {
+    {
+        std::ofstream os(filePath, std::ios::binary);
+
+        os.write(data.data(), data.size());
+    }
+
+    Hierarchy h = target;
+    Hierarchy expected = reference;
+
+    bool ok = h.mapFile(filePath, true);
+
+    mismatches = compareSteps(h, expected);
+
+    return ok;
+}
+
+static FileHeader* getHeader(
+    std::string &data
+) {
+    return reinterpret_cast<FileHeader*>(&data[0]);
+}
+
+static FileSectionEntry* getDirectory(
+    std::string &data
+) {
+    return reinterpret_cast<FileSectionEntry*>(&data[getHeader(data)->directoryOffset]);
+}
+
+// Map a corrupted copy of data, which must be rejected
+static bool checkRejected(
+    const char* name,
+    const Hierarchy &target,
+    const std::string &data
+) {
+    int mismatches;
+
+    bool ok = mapInto(target, target, data, mismatches);
+
+    printf("%s: %s, %d mismatches\n", name, ok ? "mapped" : "rejected", mismatches);
+
+    return !ok && mismatches == 0;
+}
+
+int main() {
+    int failures = 0;
+
+    Hierarchy source;
+    Hierarchy target;
+
+    initHierarchy(source, 5);
+    initHierarchy(target, 6);
+
+    if (!source.writeToFile(filePath)) {
+        printf("write failed\n");
+
+        return 1;
+    }
+
+    std::string data;
+
+    {
+        std::ifstream is(filePath, std::ios::binary);
+        std::ostringstream os;
+
+        os << is.rdbuf();
+
+        data = os.str();
+    }
+
+    int mismatches;
+
+    // Intact
+    bool ok = mapInto(target, source, data, mismatches);
+
+    printf("intact: %s, %d mismatches\n", ok ? "mapped" : "rejected", mismatches);
+
+    if (!ok || mismatches != 0)
+        failures++;
+
+    // Only the structure section is left (moved to the front), the matrices refer to sections past the end of the directory
+    {
+        std::string corrupt = data;
+
+        FileHeader* header = getHeader(corrupt);
+        FileSectionEntry* directory = getDirectory(corrupt);
+
+        directory[0] = directory[header->structureSection];
+        header->numSections = 1;
+        header->structureSection = 0;
+
+        failures += !checkRejected("missing sections", target, corrupt);
+    }
+
+    // A section running past the end of the file
+    {
+        std::string corrupt = data;
+
+        getDirectory(corrupt)[0].size = corrupt.size();
+
+        failures += !checkRejected("section past end", target, corrupt);
+    }
+
+    // A section offset that overflows with the size
+    {
+        std::string corrupt = data;
+
+        getDirectory(corrupt)[0].offset = 0x7fffffffffffffc0ll;
+
+        failures += !checkRejected("overflowing offset", target, corrupt);
+    }
+
+    // A misaligned section
+    {
+        std::string corrupt = data;
+
+        getDirectory(corrupt)[0].offset += 4;
+
+        failures += !checkRejected("misaligned section", target, corrupt);
+    }
+
+    // A section too small for its matrix (still inside the file)
+    {
+        std::string corrupt = data;
+
+        getDirectory(corrupt)[0].size -= 4;
+
+        failures += !checkRejected("short section", target, corrupt);
+    }
+
+    std::remove(filePath);
+
+    return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
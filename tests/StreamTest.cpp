@@ -0,0 +1,151 @@
+// ----------------------------------------------------------------------------
+//  OgmaNeo
+//  Copyright(c) 2016-2020 Ogma Intelligent Systems Corp. All rights reserved.
+//
+//  This copy of OgmaNeo is licensed to you under the terms described
+//  in the OGMANEO_LICENSE.md file included in this distribution.
+// ----------------------------------------------------------------------------
+
+// A hierarchy read back from a stream must step like the original. Streams without the header (the layout before
+// versioning) and truncated streams must be rejected, leaving the hierarchy unchanged. The same goes for kernel tunings,
+// which must also reject empty batches
+
+#include "HierarchyFixture.h"
+
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+using namespace ogmaneo;
+
+// Read tunings into a fresh compute system, returns whether the read succeeded. Rejected streams must not add tunings
+static bool readTunings(
+    const std::string &data,
+    int &numTunings
+) {
+    ComputeSystem cs;
+
+    std::istringstream is(data);
+
+    readKernelTuningsFromStream(is, cs);
+
+    numTunings = cs.getKernelTunings().size();
+
+    return !is.fail();
+}
+
+// Read data into a copy of target, returns whether the read succeeded. The copy must match reference afterwards
+static bool readInto(
+    const Hierarchy &target,
+    const Hierarchy &reference,
+    const std::string &data,
+    int &mismatches
+) {
+    Hierarchy h = target;
+    Hierarchy expected = reference;
+
+    std::istringstream is(data);
+
+    h.readFromStream(is);
+
+    mismatches = compareSteps(h, expected);
+
+    return !is.fail();
+}
+
+int main() {
+    int failures = 0;
+
+    Hierarchy source;
+    Hierarchy target;
+
+    initHierarchy(source, 5);
+    initHierarchy(target, 6);
+
+    std::ostringstream os;
+
+    source.writeToStream(os);
+
+    std::string data = os.str();
+
+    int mismatches;
+
+    // Round trip
+    bool ok = readInto(target, source, data, mismatches);
+
+    printf("round trip: %s, %d mismatches\n", ok ? "read" : "rejected", mismatches);
+
+    if (!ok || mismatches != 0)
+        failures++;
+
+    // Layout before versioning: the same data without the magic and version
+    ok = readInto(target, target, data.substr(2 * sizeof(int)), mismatches);
+
+    printf("unversioned: %s, %d mismatches\n", ok ? "read" : "rejected", mismatches);
+
+    if (ok || mismatches != 0)
+        failures++;
+
+    // Truncated
+    ok = readInto(target, target, data.substr(0, data.size() / 2), mismatches);
+
+    printf("truncated: %s, %d mismatches\n", ok ? "read" : "rejected", mismatches);
+
+    if (ok || mismatches != 0)
+        failures++;
+
+    // Tunings of every call site of a few autotuned steps
+    ComputeSystem cs;
+
+    cs.setAutotune(1);
+
+    Hierarchy tuned = source;
+
+    IntBuffer inputCs(16, 0);
+
+    for (int t = 0; t < 40; t++)
+        tuned.step(cs, { &inputCs }, true);
+
+    std::ostringstream tuningsOs;
+
+    writeKernelTuningsToStream(tuningsOs, cs);
+
+    std::string tuningsData = tuningsOs.str();
+
+    int numTunings;
+
+    ok = readTunings(tuningsData, numTunings);
+
+    printf("tunings round trip: %s, %d tunings\n", ok ? "read" : "rejected", numTunings);
+
+    if (!ok || numTunings == 0)
+        failures++;
+
+    ok = readTunings(tuningsData.substr(2 * sizeof(int)), numTunings);
+
+    printf("unversioned tunings: %s, %d tunings\n", ok ? "read" : "rejected", numTunings);
+
+    if (ok || numTunings != 0)
+        failures++;
+
+    ok = readTunings(tuningsData.substr(0, tuningsData.size() - 1), numTunings);
+
+    printf("truncated tunings: %s, %d tunings\n", ok ? "read" : "rejected", numTunings);
+
+    if (ok || numTunings != 0)
+        failures++;
+
+    // Batch size of the last tuning (followed by its schedule) set to 0x0
+    std::string emptyBatch = tuningsData;
+
+    std::memset(&emptyBatch[emptyBatch.size() - sizeof(int) - sizeof(Int2)], 0, sizeof(Int2));
+
+    ok = readTunings(emptyBatch, numTunings);
+
+    printf("empty batch tuning: %s, %d tunings\n", ok ? "read" : "rejected", numTunings);
+
+    if (ok || numTunings != 0)
+        failures++;
+
+    return failures == 0 ? 0 : 1;
+}
\ No newline at end of file